@@ -32,6 +32,7 @@ DEFINE_string(file, "bench.shd", "dict filename");
 DEFINE_uint32(thread, 4, "number of worker threads");
 DEFINE_bool(build, false, "build instead of fetching");
 DEFINE_bool(copy, false, "load by copy");
+DEFINE_uint32(request, 0, "keys per request split by BatchExecutor, 0 means one batch per thread");
 
 static constexpr size_t BILLION = 1UL << 30U;
 
@@ -52,10 +53,12 @@ static int BenchBuild() {
 		off += sz;
 	}
 
-	shd::g_trace_build_time = true;
+	shd::BuildLogger logger;
+	shd::BuildOptions options;
+	options.observer = &logger;
 
 	auto start = std::chrono::steady_clock::now();
-	auto ret = BuildDict(input, output);
+	auto ret = BuildDict(input, output, options);
 	if (ret != shd::BUILD_STATUS_OK) {
 		std::cout << "fail to build: " << ret << std::endl;
 		return 2;
@@ -66,6 +69,36 @@ static int BenchBuild() {
 	return 0;
 }
 
+static int BenchExecutor(const shd::PerfectHashtable& dict) {
+	const unsigned batch = FLAGS_request;
+	constexpr unsigned loop = 1000;
+
+	shd::BatchExecutor executor(FLAGS_thread);
+	std::vector<uint64_t> key_vec(batch);
+	auto out = std::make_unique<uint8_t[]>(EmbeddingGenerator::VALUE_SIZE*batch);
+	std::vector<uint64_t> cost(loop);
+
+	XorShift128Plus rnd;
+	for (unsigned i = 0; i < loop; i++) {
+		for (unsigned j = 0; j < batch; j++) {
+			key_vec[j] = rnd()%BILLION;
+		}
+		auto start = std::chrono::steady_clock::now();
+		executor.batch_fetch(dict, batch, (const uint8_t*)key_vec.data(), out.get());
+		auto end = std::chrono::steady_clock::now();
+		cost[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+	}
+
+	uint64_t sum = 0;
+	for (auto x : cost) {
+		sum += x;
+	}
+	std::sort(cost.begin(), cost.end());
+	std::cout << (loop*(uint64_t)batch*1000ULL/sum) << " mqps with " << executor.workers() << " threads" << std::endl;
+	std::cout << "p50: " << cost[loop/2]/1000U << "us, p99: " << cost[loop*99/100]/1000U << "us" << std::endl;
+	return 0;
+}
+
 static int BenchFetch() {
 	shd::PerfectHashtable dict(FLAGS_file, FLAGS_copy ? shd::PerfectHashtable::COPY_DATA : shd::PerfectHashtable::MAP_FETCH);
 	if (!dict) {
@@ -77,6 +110,10 @@ static int BenchFetch() {
 		return 1;
 	}
 
+	if (FLAGS_request != 0) {
+		return BenchExecutor(dict);
+	}
+
 	const unsigned n = FLAGS_thread;
 	constexpr unsigned batch = 5000;
 	constexpr unsigned loop = 1000;
@@ -121,7 +158,6 @@ static int BenchFetch() {
 	return 0;
 }
 
-
 int main(int argc, char* argv[]) {
 	google::ParseCommandLineFlags(&argc, &argv, true);
 
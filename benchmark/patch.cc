@@ -0,0 +1,148 @@
+//==============================================================================
+// Skew Hash and Displace Algorithm.
+// Copyright (C) 2020  Ruan Kunliang
+//
+// This library is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the Free
+// Software Foundation; either version 2.1 of the License, or (at your option)
+// any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+// details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with the This Library; if not, see <https://www.gnu.org/licenses/>.
+//==============================================================================
+
+#include <cstdio>
+#include <iostream>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <shd.h>
+#include <gflags/gflags.h>
+#include "benchmark.h"
+
+DEFINE_string(prefix, "bench-stack", "filename prefix of base and patches");
+DEFINE_uint64(base, 1UL << 24U, "items in base dict");
+DEFINE_uint64(patch, 1UL << 20U, "items in each patch");
+DEFINE_uint32(depth, 8, "max number of patches");
+DEFINE_uint32(thread, 4, "number of worker threads");
+DEFINE_bool(build, false, "build base and patches before fetching");
+
+static std::string FileName(unsigned i) {
+	if (i == 0) {
+		return FLAGS_prefix + "-base.shd";
+	}
+	return FLAGS_prefix + "-patch" + std::to_string(i) + ".shd";
+}
+
+//patch i covers a different slice of base, with different values
+static int BenchBuild() {
+	for (unsigned i = 0; i <= FLAGS_depth; i++) {
+		shd::FileWriter output(FileName(i).c_str());
+		if (!output) {
+			std::cout << "fail to create output file" << std::endl;
+			return -1;
+		}
+		shd::DataReaders input;
+		if (i == 0) {
+			input.push_back(std::make_unique<EmbeddingGenerator>(0, FLAGS_base));
+		} else {
+			const uint64_t begin = (i-1)*FLAGS_patch % FLAGS_base;
+			input.push_back(std::make_unique<EmbeddingGenerator>(begin, FLAGS_patch, EmbeddingGenerator::MASK1 + i));
+		}
+		auto ret = BuildDict(input, output);
+		if (ret != shd::BUILD_STATUS_OK) {
+			std::cout << "fail to build: " << ret << std::endl;
+			return 2;
+		}
+	}
+	return 0;
+}
+
+static int BenchFetch() {
+	std::vector<std::unique_ptr<shd::PerfectHashtable>> tables;
+	for (unsigned i = 0; i <= FLAGS_depth; i++) {
+		tables.push_back(std::make_unique<shd::PerfectHashtable>(FileName(i), shd::PerfectHashtable::MAP_FETCH));
+		if (!*tables.back()) {
+			std::cout << "fail to load: " << FileName(i) << std::endl;
+			return -1;
+		}
+	}
+	auto& base = *tables.front();
+	std::vector<const shd::PerfectHashtable*> patches;
+	for (unsigned i = FLAGS_depth; i > 0; i--) {
+		patches.push_back(tables[i].get());
+	}
+
+	const unsigned n = FLAGS_thread;
+	constexpr unsigned batch = 5000;
+	constexpr unsigned loop = 200;
+
+	for (unsigned depth = 0; depth <= FLAGS_depth; depth++) {
+		//newest patches come first
+		auto stack = patches.data() + (FLAGS_depth - depth);
+		std::vector<std::thread> workers;
+		workers.reserve(n);
+		std::vector<uint64_t> results(n);
+		for (unsigned i = 0; i < n; i++) {
+			workers.emplace_back([&base, stack, depth](uint64_t* res){
+				std::vector<uint64_t> key_vec(batch);
+				auto out = std::make_unique<uint8_t[]>(EmbeddingGenerator::VALUE_SIZE*batch);
+
+				XorShift128Plus rnd;
+				uint64_t sum_ns = 0;
+				for (unsigned i = 0; i < loop; i++) {
+					for (unsigned j = 0; j < batch; j++) {
+						key_vec[j] = rnd()%FLAGS_base;
+					}
+					auto start = std::chrono::steady_clock::now();
+					base.batch_fetch(batch, (const uint8_t*)key_vec.data(), out.get(), nullptr, stack, depth);
+					auto end = std::chrono::steady_clock::now();
+					sum_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+				}
+				*res = sum_ns;
+			}, &results[i]);
+		}
+		for (auto& t : workers) {
+			t.join();
+		}
+
+		uint64_t qps = 0;
+		uint64_t ns = 0;
+		for (auto x : results) {
+			qps += (loop*batch)*1000000000ULL/x;
+			ns += x;
+		}
+		ns /= n*(uint64_t)loop*(uint64_t)batch;
+		std::cout << "depth " << depth << ": " << (qps/1000000U) << " mqps, " << ns << " ns/op" << std::endl;
+	}
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	google::ParseCommandLineFlags(&argc, &argv, true);
+
+	auto cpus = std::thread::hardware_concurrency();
+	if (cpus == 0) cpus = 1;
+	if (FLAGS_thread == 0 || FLAGS_thread > cpus) {
+		FLAGS_thread = cpus;
+	}
+	if (FLAGS_base == 0 || FLAGS_patch == 0 || FLAGS_depth > shd::MAX_PATCH_DEPTH) {
+		std::cout << "bad arguments" << std::endl;
+		return 1;
+	}
+
+	if (FLAGS_build) {
+		auto ret = BenchBuild();
+		if (ret != 0) {
+			return ret;
+		}
+	}
+	return BenchFetch();
+}
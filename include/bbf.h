@@ -63,6 +63,7 @@ public:
 private:
 	MemBlock m_mem;
 	Divisor<uint64_t> m_block;
+	unsigned m_level = 0;
 };
 
 } // bbf
@@ -35,10 +35,12 @@ static constexpr size_t MAX_INLINE_VALUE_LEN = UINT16_MAX;
 static constexpr unsigned MAX_VALUE_LEN_BIT = 35U;	//7x
 static constexpr size_t MAX_VALUE_LEN = (1ULL<<MAX_VALUE_LEN_BIT)-1U;
 static constexpr uint16_t MAX_SEGMENT = 256U;
+static constexpr unsigned MAX_PATCH_DEPTH = 64U;
 
 enum BuildStatus {
 	BUILD_STATUS_OK, BUILD_STATUS_BAD_INPUT, BUILD_STATUS_FAIL_TO_OUTPUT,
-	BUILD_STATUS_OUT_OF_CHANCE, BUILD_STATUS_CONFLICT
+	BUILD_STATUS_OUT_OF_CHANCE, BUILD_STATUS_CONFLICT,
+	BUILD_STATUS_OUT_OF_MEMORY	//nothing fits in memory_budget, refused before start
 };
 
 struct Retry {
@@ -49,23 +51,177 @@ static constexpr Retry DEFAULT_RETRY = {1, 4};
 
 using DataReaders = std::vector<std::unique_ptr<IDataReader>>;
 
-SHD_API BuildStatus BuildIndex(const DataReaders& in, IDataWriter& out, Retry retry=DEFAULT_RETRY);
-SHD_API BuildStatus BuildIndexFast(const DataReaders& in, IDataWriter& out, Retry retry=DEFAULT_RETRY);
+//Layout flags can be combined.
+//LAYOUT_LOCAL_L2 keeps the bitmap bit of a key in a 64B block found by key alone,
+//so a lookup fetches cell and bitmap together, one dependent miss less.
+//It costs a little more bitmap space and a bit more chance to retry in build.
+//LAYOUT_SPLIT_KV stores keys and values of KV_INLINE in two parallel arrays,
+//a miss only touches the key array and values are fetched after key matches.
+//LAYOUT_COMPRESS_VALUE packs values of KV_SEPARATED into compressed blocks,
+//value slices then live in a thread local buffer till next search in that thread.
+//LAYOUT_VAR_KEY keeps keys of any length in a key arena, a line refers to its key.
+//Such table is only searched with key length given, and key_len() reports 0.
+//It does not work with LAYOUT_SPLIT_KV.
+enum IndexLayout : uint8_t {
+	LAYOUT_SPREAD = 0,
+	LAYOUT_LOCAL_L2 = 1,
+	LAYOUT_SPLIT_KV = 2,
+	LAYOUT_COMPRESS_VALUE = 4,
+	LAYOUT_VAR_KEY = 8,
+};
+static constexpr IndexLayout operator|(IndexLayout a, IndexLayout b) noexcept {
+	return static_cast<IndexLayout>(static_cast<uint8_t>(a) | static_cast<uint8_t>(b));
+}
+
+//Build events for monitoring, see BuildOptions.observer.
+//Phases of separated values and spilling builds may show more than once.
+enum BuildPhase : uint8_t {
+	PHASE_PREPARE,		//merge base and patch in rebuild
+	PHASE_GEN_ID,		//read and hash keys
+	PHASE_SPILL,		//write records into spill files
+	PHASE_PARTITION,	//move ids into segments
+	PHASE_BUILD,		//build all segments, L1 sort and mapping included
+	PHASE_L1_SORT,		//sum of all segments, they are built in parallel
+	PHASE_MAPPING,		//sum of all segments, they are built in parallel
+	PHASE_FILL,			//place content lines
+	PHASE_DUMP,			//write content out
+	PHASE_STAGE,		//read input once into staging area
+};
+SHD_API const char* PhaseName(BuildPhase phase) noexcept;
+
+//How ids are shuffled into segments, from the fastest.
+enum BuildStrategy : uint8_t {
+	STRATEGY_SHADOW,	//to a shadow copy, twice memory for ids
+	STRATEGY_IN_PLACE,	//within the ids
+	STRATEGY_SPILL,		//through spill files, one segment in memory at a time
+};
+SHD_API const char* StrategyName(BuildStrategy strategy) noexcept;
+
+//Choice of the memory planner. Peak counts the large buffers only: ids, their
+//shadow copy, index and content not filled in place.
+struct MemoryPlan {
+	BuildStrategy strategy = STRATEGY_IN_PLACE;
+	bool keep_ids = false;		//ids kept till fill phase, only with a budget
+	bool fill_in_place = false;	//content filled in mapped output, only with a budget
+	bool stage_fill = false;	//wide lines staged to fill in position order, only with a budget
+	uint64_t peak = 0;			//bytes estimated
+};
+
+static constexpr unsigned SD8_TRY_BINS = 9;
+static constexpr unsigned ALL_SEGMENTS = UINT32_MAX;
+
+struct SegmentStats {
+	unsigned segment = 0;
+	uint32_t size = 0;
+	uint32_t salt = 0;
+	uint32_t max_bucket = 0;	//keys in the largest L1 bucket
+	BuildStatus status = BUILD_STATUS_OK;
+	double l1_sort = 0;			//seconds
+	double mapping = 0;
+	double total = 0;
+	//L1 buckets by sd8 tries taken in mapping, bin i counts (2^(i-1), 2^i] tries
+	uint64_t sd8_tries[SD8_TRY_BINS] = {};
+};
+
+//Segments are built in parallel, so on_segment may be called from many threads
+//at once, other events come from the thread calling build.
+struct BuildObserver {
+	virtual void on_phase(BuildPhase, double) {}
+	//every segment built, failed ones included
+	virtual void on_segment(const SegmentStats&) {}
+	//segment is ALL_SEGMENTS when the whole table is tried with another seed
+	virtual void on_retry(BuildStatus, unsigned) {}
+	//size of the table when done
+	virtual void on_output(uint64_t) {}
+	//memory plan picked before work starts
+	virtual void on_plan(const MemoryPlan&) {}
+	virtual ~BuildObserver() noexcept = default;
+};
+
+//logs phase durations and memory plan
+class SHD_API BuildLogger : public BuildObserver {
+public:
+	void on_phase(BuildPhase phase, double seconds) override;
+	void on_plan(const MemoryPlan& plan) override;
+};
+
+//Options of a build, more may be added, so set fields by name.
+struct BuildOptions {
+	Retry retry = DEFAULT_RETRY;
+	IndexLayout layout = LAYOUT_SPREAD;
+	//works as the Fast variants, faster but takes twice memory for ids
+	bool use_extra_mem = false;
+	//Set it to spill to disk, for input larger than memory. Records are spilled
+	//by segment into temporary files here, then segments are built and filled
+	//one at a time. With a budget, it spills only when no plan in memory fits.
+	//It does not work with LAYOUT_SPLIT_KV.
+	std::string spill_dir;
+	//Bounds the large buffers of a build in bytes, 0 means no limit. The fastest
+	//plan fits is picked then, use_extra_mem is not needed, and content is filled
+	//in place when the writer can map. A build which does not fit is refused
+	//with BUILD_STATUS_OUT_OF_MEMORY before reading any input.
+	size_t memory_budget = 0;
+	//number of L0 segments, 0 means one for each reader, or as the budget needs
+	//for a spilling build
+	uint16_t segments = 0;
+	//threads to read, hash and build segments, 0 means one for each core,
+	//readers are taken as chunks, so a few readers can still keep all busy
+	unsigned workers = 0;
+	//receives events of the build if not null
+	BuildObserver* observer = nullptr;
+	//Reads each reader once from where it is, without reset, for input hard to
+	//read again. Records are staged in memory, or in temporary files under
+	//spill_dir if it is set, and all passes of the build read them there. A
+	//stage in files spills the build only as the budget asks. A stage in memory
+	//takes its part of memory_budget.
+	bool single_pass = false;
+	//Taken in order by the first try and the retries of the whole table instead
+	//of random ones, more are derived from the last one. Same input and options
+	//give byte identical output then, whatever the workers.
+	std::vector<uint32_t> seeds;
+};
+
+struct PackView;
+
+SHD_API BuildStatus BuildIndex(const DataReaders& in, IDataWriter& out, Retry retry=DEFAULT_RETRY,
+							   IndexLayout layout=LAYOUT_SPREAD);
+SHD_API BuildStatus BuildIndexFast(const DataReaders& in, IDataWriter& out, Retry retry=DEFAULT_RETRY,
+								   IndexLayout layout=LAYOUT_SPREAD);
+SHD_API BuildStatus BuildIndex(const DataReaders& in, IDataWriter& out, const BuildOptions& options);
 
-//key should have fixed length
-//dynamic length key is not useful, just pad or use checksum instead
-SHD_API BuildStatus BuildSet(const DataReaders& in, IDataWriter& out, Retry retry=DEFAULT_RETRY);
-SHD_API BuildStatus BuildSetFast(const DataReaders& in, IDataWriter& out, Retry retry=DEFAULT_RETRY);
+//key should have fixed length unless LAYOUT_VAR_KEY is set
+SHD_API BuildStatus BuildSet(const DataReaders& in, IDataWriter& out, Retry retry=DEFAULT_RETRY,
+							 IndexLayout layout=LAYOUT_SPREAD);
+SHD_API BuildStatus BuildSetFast(const DataReaders& in, IDataWriter& out, Retry retry=DEFAULT_RETRY,
+								 IndexLayout layout=LAYOUT_SPREAD);
+SHD_API BuildStatus BuildSet(const DataReaders& in, IDataWriter& out, const BuildOptions& options);
 
-//key & value should have fixed length
+//keep a fingerprint of 8, 16 or 32 bits instead of the key
+//a key not in set is reported as member with chance about 2^-bits
+//keys are not kept, so the set cannot be derived
+SHD_API BuildStatus BuildFingerprintSet(const DataReaders& in, IDataWriter& out, unsigned bits=16,
+										Retry retry=DEFAULT_RETRY, IndexLayout layout=LAYOUT_SPREAD);
+SHD_API BuildStatus BuildFingerprintSetFast(const DataReaders& in, IDataWriter& out, unsigned bits=16,
+											Retry retry=DEFAULT_RETRY, IndexLayout layout=LAYOUT_SPREAD);
+SHD_API BuildStatus BuildFingerprintSet(const DataReaders& in, IDataWriter& out, unsigned bits,
+										const BuildOptions& options);
+
+//value should have fixed length, so does key unless LAYOUT_VAR_KEY is set
 //inline large value may consume a lot of memory
-SHD_API BuildStatus BuildDict(const DataReaders& in, IDataWriter& out, Retry retry=DEFAULT_RETRY);
-SHD_API BuildStatus BuildDictFast(const DataReaders& in, IDataWriter& out, Retry retry=DEFAULT_RETRY);
+SHD_API BuildStatus BuildDict(const DataReaders& in, IDataWriter& out, Retry retry=DEFAULT_RETRY,
+							  IndexLayout layout=LAYOUT_SPREAD);
+SHD_API BuildStatus BuildDictFast(const DataReaders& in, IDataWriter& out, Retry retry=DEFAULT_RETRY,
+								  IndexLayout layout=LAYOUT_SPREAD);
+SHD_API BuildStatus BuildDict(const DataReaders& in, IDataWriter& out, const BuildOptions& options);
 
-//key should have fixed length
-SHD_API BuildStatus BuildDictWithVariedValue(const DataReaders& in, IDataWriter& out, Retry retry=DEFAULT_RETRY);
-SHD_API BuildStatus BuildDictWithVariedValueFast(const DataReaders& in, IDataWriter& out, Retry retry=DEFAULT_RETRY);
+//key should have fixed length unless LAYOUT_VAR_KEY is set
+SHD_API BuildStatus BuildDictWithVariedValue(const DataReaders& in, IDataWriter& out, Retry retry=DEFAULT_RETRY,
+											 IndexLayout layout=LAYOUT_SPREAD);
+SHD_API BuildStatus BuildDictWithVariedValueFast(const DataReaders& in, IDataWriter& out, Retry retry=DEFAULT_RETRY,
+												 IndexLayout layout=LAYOUT_SPREAD);
+SHD_API BuildStatus BuildDictWithVariedValue(const DataReaders& in, IDataWriter& out, const BuildOptions& options);
 
+//deprecated, works as a BuildLogger for builds without observer
 SHD_API extern bool g_trace_build_time;
 
 
@@ -86,12 +242,16 @@ public:
 		KEY_SET = 1,
 		KV_INLINE = 2,
 		KV_SEPARATED = 3,
+		FINGERPRINT_SET = 4,
 		ILLEGAL_TYPE = 0xff
 	};
 	Type type() const noexcept { return m_type; }
 	uint8_t key_len() const noexcept { return m_key_len; }
 	uint16_t val_len() const noexcept { return m_val_len; }
 	size_t item() const noexcept { return m_item; }
+	IndexLayout layout() const noexcept;
+	//only for FINGERPRINT_SET
+	unsigned fingerprint_bits() const noexcept;
 
 	// May return item().
 	size_t locate(const uint8_t* key, uint8_t key_len) const noexcept;
@@ -99,15 +259,23 @@ public:
 	void batch_locate(unsigned batch, const uint8_t* __restrict keys,
 					  uint8_t key_len, uint64_t* __restrict out);
 
-	//KEY_SET, KV_INLINE or KV_SEPARATED
+	//KEY_SET, KV_INLINE, KV_SEPARATED or FINGERPRINT_SET
 	//key is found when output slice is valid
 	Slice search(const uint8_t* key) const noexcept;
+	//works with variable length key too, key of other length misses fixed length table
+	Slice search(const uint8_t* key, uint8_t key_len) const noexcept;
 
-	//KEY_SET or KV_INLINE
+	//KEY_SET, KV_INLINE or FINGERPRINT_SET
 	//keys == out is OK
 	unsigned batch_search(unsigned batch, const uint8_t* const keys[], const uint8_t* out[],
 					   const PerfectHashtable* patch=nullptr) const noexcept;
 
+	//KEY_SET, KV_INLINE, KV_SEPARATED or FINGERPRINT_SET
+	//key is found when output slice is valid
+	unsigned batch_search(unsigned batch, const uint8_t* const keys[], Slice out[]) const noexcept;
+	//same as above, but works with variable length key too
+	unsigned batch_search(unsigned batch, const Slice keys[], Slice out[]) const noexcept;
+
 	//only KV_INLINE, if dft_val == nullptr, do nothing when miss
 	unsigned batch_fetch(unsigned batch, const uint8_t* __restrict keys, uint8_t* __restrict data,
 						 const uint8_t* __restrict dft_val=nullptr,
@@ -116,11 +284,46 @@ public:
 	unsigned batch_try_fetch(unsigned batch, const uint8_t* __restrict keys, uint8_t* __restrict data,
 							 unsigned* __restrict miss, const PerfectHashtable* patch=nullptr) const noexcept;
 
+	//chained lookup over a stack of patches with the same type as base
+	//patches[0] is checked first and base is checked last, the first hit wins
+	//depth should not exceed MAX_PATCH_DEPTH
+	unsigned batch_search(unsigned batch, const uint8_t* const keys[], const uint8_t* out[],
+						  const PerfectHashtable* const patches[], unsigned depth) const noexcept;
+	unsigned batch_fetch(unsigned batch, const uint8_t* __restrict keys, uint8_t* __restrict data,
+						 const uint8_t* __restrict dft_val, const PerfectHashtable* const patches[],
+						 unsigned depth) const noexcept;
+	unsigned batch_try_fetch(unsigned batch, const uint8_t* __restrict keys, uint8_t* __restrict data,
+							 unsigned* __restrict miss, const PerfectHashtable* const patches[],
+							 unsigned depth) const noexcept;
+
 	BuildStatus derive(const DataReaders& in, IDataWriter& out, Retry retry=DEFAULT_RETRY) const;
 
+	//batch lookups keep more keys in flight at higher level to hide memory latency
+	//the level is guessed from table size at load time
+	static constexpr unsigned PIPELINE_LEVELS = 5;
+	unsigned pipeline_level() const noexcept;
+	bool set_pipeline_level(unsigned level) noexcept;
+	//micro-benchmark every level on this table and keep the fastest one
+	//not thread safe, call it before sharing the table
+	unsigned tune_pipeline();
+
+	//Optional small cache for skewed traffic, only KEY_SET or KV_INLINE.
+	//keys may be sampled traffic with repeats or a plain list of hot keys, the
+	//most frequent ones found in table are copied in, up to capacity.
+	//Batch lookups check it first, so output may point into the cache.
+	//not thread safe, call it before sharing the table
+	bool build_hot_cache(unsigned n, const uint8_t* keys, unsigned capacity);
+	void drop_hot_cache() noexcept;
+	struct HotCacheStats {
+		uint64_t lookup = 0;
+		uint64_t hit = 0;
+	};
+	HotCacheStats hot_cache_stats() const noexcept;
+
 private:
 	MemMap m_res;
 	MemBlock m_mem;
+	MemBlock m_hot;
 	std::unique_ptr<uint8_t[]> m_view;
 	Type m_type = ILLEGAL_TYPE;
 	uint8_t m_key_len = 0;
@@ -128,6 +331,43 @@ private:
 	size_t m_item = 0;
 
 	void _post_init() noexcept;
+	unsigned _chain(const PerfectHashtable* const patches[], unsigned depth,
+					const PackView* layers[]) const noexcept;
+};
+
+//Splits a large batch into cache-sized chunks for a pool of pinned workers.
+//Idle workers steal chunks from busy ones, the calling thread works too.
+//Calls on one executor are serialized, tables are only borrowed.
+class SHD_API BatchExecutor {
+public:
+	//workers == 0 means one per hardware thread
+	explicit BatchExecutor(unsigned workers=0, bool pin=true);
+	~BatchExecutor() noexcept;
+	BatchExecutor(const BatchExecutor&) = delete;
+	BatchExecutor& operator=(const BatchExecutor&) = delete;
+	unsigned workers() const noexcept;
+
+	void batch_locate(PerfectHashtable& table, unsigned batch, const uint8_t* __restrict keys,
+					  uint8_t key_len, uint64_t* __restrict out);
+	unsigned batch_search(const PerfectHashtable& table, unsigned batch, const uint8_t* const keys[],
+						  const uint8_t* out[], const PerfectHashtable* patch=nullptr);
+	//compressed values stay in calling thread
+	unsigned batch_search(const PerfectHashtable& table, unsigned batch, const uint8_t* const keys[],
+						  Slice out[]);
+	unsigned batch_search(const PerfectHashtable& table, unsigned batch, const Slice keys[], Slice out[]);
+	unsigned batch_fetch(const PerfectHashtable& table, unsigned batch, const uint8_t* __restrict keys,
+						 uint8_t* __restrict data, const uint8_t* __restrict dft_val=nullptr,
+						 const PerfectHashtable* patch=nullptr);
+	//miss list keeps ascending order like PerfectHashtable::batch_try_fetch
+	unsigned batch_try_fetch(const PerfectHashtable& table, unsigned batch, const uint8_t* __restrict keys,
+							 uint8_t* __restrict data, unsigned* __restrict miss,
+							 const PerfectHashtable* patch=nullptr);
+
+private:
+	struct Pool;
+	std::unique_ptr<Pool> m_pool;
+
+	unsigned _run(unsigned chunks, const std::function<unsigned(unsigned)>& task);
 };
 
 } //shd
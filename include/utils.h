@@ -138,6 +138,17 @@ struct IDataReader {
 	virtual void reset() = 0;
 	virtual size_t total() = 0;
 	virtual Record read(bool key_only) = 0;
+	//Reads up to n records, returns how many, 0 only when none left.
+	//Unlike read, slices of all of them stay valid till next read or read_batch,
+	//so the default takes one. Readers owning their data can give more at once
+	//to save a call per record.
+	virtual unsigned read_batch(Record out[], unsigned n, bool key_only) {
+		if (n == 0) {
+			return 0;
+		}
+		out[0] = read(key_only);
+		return 1;
+	}
 	virtual ~IDataReader() noexcept = default;
 };
 
@@ -145,6 +156,17 @@ struct IDataWriter {
 	virtual bool operator!() const noexcept = 0;
 	virtual bool flush() = 0;
 	virtual bool write(const void* data, size_t n) = 0;
+	//Optional positional output, so a region can be written by many threads.
+	//reserve(n) skips next n bytes and returns where they start, SIZE_MAX if
+	//not supported. write_at then fills them in any order from any thread.
+	virtual size_t reserve(size_t) { return SIZE_MAX; }
+	virtual bool write_at(size_t, const void*, size_t) { return false; }
+	//Optional in place output, map(n) skips next n bytes as reserve does and
+	//returns writable memory of them, nullptr if not supported. The memory is
+	//valid till next map or the writer is closed. can_map tells it ahead, for
+	//planning, map may still fail then.
+	virtual uint8_t* map(size_t) { return nullptr; }
+	virtual bool can_map() const noexcept { return false; }
 	virtual ~IDataWriter() noexcept = default;
 };
 
@@ -155,8 +177,10 @@ public:
 	virtual ~FileWriter() noexcept;
 
 	FileWriter(FileWriter&& other) noexcept
-		: m_buf(std::move(other.m_buf)), m_fd(other.m_fd) {
+		: m_buf(std::move(other.m_buf)), m_off(other.m_off), m_fd(other.m_fd), m_done(other.m_done),
+		  m_map(other.m_map), m_map_size(other.m_map_size) {
 		other.m_fd = -1;
+		other.m_map = nullptr;
 	}
 	FileWriter& operator=(FileWriter&& other) noexcept {
 		if (&other != this) {
@@ -169,12 +193,22 @@ public:
 	bool operator!() const noexcept override;
 	bool flush() noexcept override;
 	bool write(const void* data, size_t n) noexcept override;
+	//not supported on windows
+	size_t reserve(size_t n) noexcept override;
+	bool write_at(size_t offset, const void* data, size_t n) noexcept override;
+	//file is preallocated and mapped shared
+	uint8_t* map(size_t n) noexcept override;
+	bool can_map() const noexcept override;
 
 private:
 	static constexpr size_t BUFSZ = 8192;
 	std::unique_ptr<uint8_t[]> m_buf;
 	unsigned m_off = 0;
 	int m_fd = -1;
+	size_t m_done = 0;	//bytes taken, including buffered and reserved
+	uint8_t* m_map = nullptr;
+	size_t m_map_size = 0;
+	void _unmap() noexcept;
 	bool _flush() noexcept;
 	bool _write(const void* data, size_t n) noexcept;
 };
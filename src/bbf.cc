@@ -39,6 +39,8 @@ static FORCE_INLINE Step Calc(const Divisor<uint64_t>& block, const uint8_t *key
 	return {code.h % block, (a | b) | (c | d) | e};
 }
 
+static constexpr unsigned BUBBLE[PIPELINE_LEVELS] = {4, 8, 15, 20, 28};
+
 bool BloomFilter::test(const uint8_t *key, unsigned len) const noexcept {
 	auto s = Calc(m_block, key, len);
 	auto space = reinterpret_cast<const uint64_t*>(m_mem.addr()+sizeof(uint64_t));
@@ -68,6 +70,7 @@ BloomFilter::BloomFilter(size_t capacity) {
 		return;
 	}
 	memset(m_mem.addr(), 0, m_mem.size());
+	m_level = GuessPipelineLevel(m_mem.size(), true);
 }
 
 BloomFilter::BloomFilter(const std::string& path) {
@@ -80,6 +83,7 @@ BloomFilter::BloomFilter(const std::string& path) {
 	}
 	m_block = (mem.size()-sizeof(uint64_t)) / sizeof(uint64_t);
 	m_mem = std::move(mem);
+	m_level = GuessPipelineLevel(m_mem.size(), true);
 }
 
 BloomFilter::BloomFilter(size_t size, const std::function<bool(uint8_t*)>& load) {
@@ -92,40 +96,45 @@ BloomFilter::BloomFilter(size_t size, const std::function<bool(uint8_t*)>& load)
 	}
 	m_block = (size-sizeof(uint64_t)) / sizeof(uint64_t);
 	m_mem = std::move(mem);
+	m_level = GuessPipelineLevel(m_mem.size(), true);
 }
 
 unsigned BloomFilter::batch_test(unsigned batch, unsigned key_len,
 								 const uint8_t* __restrict keys, bool* __restrict out) const noexcept {
 	auto space = reinterpret_cast<const uint64_t*>(m_mem.addr()+sizeof(uint64_t));
 	unsigned hit = 0;
-	Pipeline<15>(batch,
-			[this, space, &keys, key_len](unsigned i)->Step {
-				auto s = Calc(m_block, keys+i*key_len, key_len);
-				PrefetchForNext(&space[s.blk]);
-				return s;
-			},
-			[space, &out, &hit](Step& s, unsigned i) {
-				out[i] = (space[s.blk] & s.mask) == s.mask;
-				hit += out[i];
-			}
-	);
+	WithPipelineLevel(m_level, [&](auto level) {
+		Pipeline<BUBBLE[decltype(level)::value]>(batch,
+				[this, space, &keys, key_len](unsigned i)->Step {
+					auto s = Calc(m_block, keys+i*key_len, key_len);
+					PrefetchForNext(&space[s.blk]);
+					return s;
+				},
+				[space, &out, &hit](Step& s, unsigned i) {
+					out[i] = (space[s.blk] & s.mask) == s.mask;
+					hit += out[i];
+				}
+		);
+	});
 	return hit;
 }
 
 void BloomFilter::batch_set(unsigned batch, unsigned key_len, const uint8_t* keys) const noexcept {
 	auto space = reinterpret_cast<uint64_t*>(m_mem.addr()+sizeof(uint64_t));
 	auto& item = *reinterpret_cast<uint64_t*>(m_mem.addr());
-	Pipeline<15>(batch,
-			[this, space, &keys, key_len](unsigned i)->Step {
-				auto s = Calc(m_block, keys+i*key_len, key_len);
-				PrefetchForNext(&space[s.blk]);
-				return s;
-			},
-			[space, &item](Step& s, unsigned) {
-				item += (space[s.blk] & s.mask) != s.mask;
-				space[s.blk] |= s.mask;
-			}
-	);
+	WithPipelineLevel(m_level, [&](auto level) {
+		Pipeline<BUBBLE[decltype(level)::value]>(batch,
+				[this, space, &keys, key_len](unsigned i)->Step {
+					auto s = Calc(m_block, keys+i*key_len, key_len);
+					PrefetchForNext(&space[s.blk]);
+					return s;
+				},
+				[space, &item](Step& s, unsigned) {
+					item += (space[s.blk] & s.mask) != s.mask;
+					space[s.blk] |= s.mask;
+				}
+		);
+	});
 }
 
 } // bbf
\ No newline at end of file
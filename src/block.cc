@@ -0,0 +1,266 @@
+//==============================================================================
+// Skew Hash and Displace Algorithm.
+// Copyright (C) 2020  Ruan Kunliang
+//
+// This library is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the Free
+// Software Foundation; either version 2.1 of the License, or (at your option)
+// any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+// details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with the This Library; if not, see <https://www.gnu.org/licenses/>.
+//==============================================================================
+
+#include <cstring>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include "internal.h"
+#include "codec.h"
+
+namespace shd {
+
+static constexpr uint32_t BLOCK_MAGIC = 0x4b4c427f;
+
+static FORCE_INLINE uint64_t LoadEnd(const uint8_t* ends, uint64_t i) {
+	uint64_t x;
+	memcpy(&x, ends + i*sizeof(uint64_t), sizeof(x));
+	return x;
+}
+
+BlockWriter::BlockWriter(IDataWriter& out)
+	: m_out(out), m_raw(std::make_unique<uint8_t[]>(VALUE_BLOCK_SIZE)),
+	  m_packed(std::make_unique<uint8_t[]>(VALUE_BLOCK_SIZE)) {}
+
+bool BlockWriter::_dump() {
+	if (m_fill == 0) {
+		return true;
+	}
+	//keep raw data when compression does not pay, it shows as equal size
+	auto size = LzCompress(m_raw.get(), m_fill, m_packed.get(), m_fill-1U);
+	auto data = m_packed.get();
+	if (size == 0) {
+		size = m_fill;
+		data = m_raw.get();
+	}
+	if (!m_out.write(data, size)) {
+		return false;
+	}
+	m_done += size;
+	m_ends.push_back(m_done);
+	m_raw_size += m_fill;
+	m_fill = 0;
+	return true;
+}
+
+bool BlockWriter::write(const void* data, size_t n) {
+	auto src = (const uint8_t*)data;
+	while (n != 0) {
+		const auto m = std::min(n, VALUE_BLOCK_SIZE-m_fill);
+		memcpy(m_raw.get()+m_fill, src, m);
+		m_fill += m;
+		src += m;
+		n -= m;
+		if (m_fill == VALUE_BLOCK_SIZE && !_dump()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool BlockWriter::flush() {
+	return m_out.flush();
+}
+
+bool BlockWriter::finish() {
+	if (!_dump()) {
+		return false;
+	}
+	BlockTrailer trailer;
+	trailer.raw_size = m_raw_size;
+	trailer.block_cnt = m_ends.size();
+	trailer.block_shift = VALUE_BLOCK_SHIFT;
+	trailer.magic = BLOCK_MAGIC;
+	return m_out.write(m_ends.data(), m_ends.size()*sizeof(uint64_t))
+		&& m_out.write(&trailer, sizeof(trailer));
+}
+
+bool LoadValueBlocks(const uint8_t* begin, const uint8_t* end, ValueBlocks& out) {
+	static std::atomic<uint64_t> s_uid{0};
+	BlockTrailer trailer;
+	if (end-begin < (ptrdiff_t)sizeof(trailer)) {
+		return false;
+	}
+	memcpy(&trailer, end-sizeof(trailer), sizeof(trailer));
+	if (trailer.magic != BLOCK_MAGIC || trailer.block_shift != VALUE_BLOCK_SHIFT
+		|| trailer.block_cnt != (trailer.raw_size + VALUE_BLOCK_SIZE - 1U) / VALUE_BLOCK_SIZE
+		|| trailer.block_cnt > static_cast<size_t>(end-begin-sizeof(trailer)) / sizeof(uint64_t)) {
+		return false;
+	}
+	out.ends = end - sizeof(trailer) - trailer.block_cnt*sizeof(uint64_t);
+	out.data = begin;
+	out.cnt = trailer.block_cnt;
+	out.raw_size = trailer.raw_size;
+	uint64_t last = 0;
+	for (uint64_t i = 0; i < out.cnt; i++) {
+		const auto curr = LoadEnd(out.ends, i);
+		const auto raw = i+1 < out.cnt? VALUE_BLOCK_SIZE : out.raw_size - i*VALUE_BLOCK_SIZE;
+		if (curr <= last || curr - last > raw) {
+			return false;
+		}
+		last = curr;
+	}
+	if (last != static_cast<size_t>(out.ends-out.data)) {
+		return false;
+	}
+	out.uid = ++s_uid;	//cached blocks are told apart by uid, not by address
+	return true;
+}
+
+//A few recently used blocks of this thread, least recently used one is replaced.
+class BlockCache {
+public:
+	const uint8_t* get(const ValueBlocks& blocks, uint64_t idx, size_t& raw) {
+		raw = idx+1 < blocks.cnt? VALUE_BLOCK_SIZE : blocks.raw_size - idx*VALUE_BLOCK_SIZE;
+		m_tick++;
+		Entry* victim = &m_entries[0];
+		for (auto& e : m_entries) {
+			if (e.uid == blocks.uid && e.idx == idx) {
+				e.tick = m_tick;
+				return e.data.get();
+			}
+			if (e.tick < victim->tick) {
+				victim = &e;
+			}
+		}
+		if (victim->data == nullptr) {
+			victim->data = std::make_unique<uint8_t[]>(VALUE_BLOCK_SIZE);
+		}
+		const auto begin = idx == 0? 0 : LoadEnd(blocks.ends, idx-1);
+		const auto size = LoadEnd(blocks.ends, idx) - begin;
+		auto src = blocks.data + begin;
+		victim->uid = 0;
+		if (size == raw) {
+			memcpy(victim->data.get(), src, raw);
+		} else if (!LzDecompress(src, size, victim->data.get(), raw)) {
+			return nullptr;
+		}
+		victim->uid = blocks.uid;
+		victim->idx = idx;
+		victim->tick = m_tick;
+		return victim->data.get();
+	}
+
+	//copy n bytes at offset of the raw stream
+	bool read(const ValueBlocks& blocks, uint64_t off, uint8_t* dst, size_t n) {
+		while (n != 0) {
+			size_t raw;
+			auto blk = get(blocks, off >> VALUE_BLOCK_SHIFT, raw);
+			const auto in = off & (VALUE_BLOCK_SIZE-1U);
+			if (blk == nullptr || in >= raw) {
+				return false;
+			}
+			const auto m = std::min<size_t>(n, raw-in);
+			memcpy(dst, blk+in, m);
+			dst += m;
+			off += m;
+			n -= m;
+		}
+		return true;
+	}
+
+private:
+	static constexpr unsigned WAYS = 8;
+	struct Entry {
+		uint64_t uid = 0;
+		uint64_t idx = 0;
+		uint64_t tick = 0;
+		std::unique_ptr<uint8_t[]> data;
+	};
+	Entry m_entries[WAYS];
+	uint64_t m_tick = 0;
+};
+
+//Holds values handed out since last reset, chunks never move.
+class ValueArena {
+public:
+	uint8_t* alloc(size_t n) {
+		if (m_chunks.empty() || n > m_cap - m_used) {
+			const auto size = std::max(n, CHUNK);
+			m_chunks.push_back(std::make_unique<uint8_t[]>(size));
+			if (m_chunks.size() == 1) {
+				m_first = size;
+			}
+			m_cap = size;
+			m_used = 0;
+		}
+		auto out = m_chunks.back().get() + m_used;
+		m_used += n;
+		return out;
+	}
+	void reset() noexcept {
+		if (m_chunks.size() > 1) {
+			m_chunks.resize(1);
+		}
+		m_cap = m_chunks.empty()? 0 : m_first;
+		m_used = 0;
+	}
+
+private:
+	static constexpr size_t CHUNK = 64U*1024U;
+	std::vector<std::unique_ptr<uint8_t[]>> m_chunks;
+	size_t m_first = 0;
+	size_t m_cap = 0;
+	size_t m_used = 0;
+};
+
+static thread_local BlockCache t_cache;
+static thread_local ValueArena t_arena;
+
+void ResetValueArena() noexcept {
+	t_arena.reset();
+}
+
+Slice CompressedValueAt(const ValueBlocks& blocks, uint64_t offset) noexcept {
+	if (offset >= blocks.raw_size) {
+		return {};
+	}
+	constexpr unsigned MARK_LIMIT = MAX_VALUE_LEN_BIT / 7U;
+	uint8_t mark[MARK_LIMIT];
+	const auto n = std::min<uint64_t>(MARK_LIMIT, blocks.raw_size-offset);
+	try {
+		if (!t_cache.read(blocks, offset, mark, n)) {
+			return {};
+		}
+		uint64_t len = 0;
+		unsigned i = 0;
+		for (unsigned sft = 0; i < n; sft += 7U) {
+			const uint8_t b = mark[i++];
+			len |= static_cast<uint64_t>(b & 0x7fU) << sft;
+			if ((b & 0x80U) == 0) {
+				break;
+			}
+			if (i == n) {
+				return {};
+			}
+		}
+		if (len > blocks.raw_size - offset - i) {
+			return {};
+		}
+		auto out = t_arena.alloc(len);
+		if (!t_cache.read(blocks, offset+i, out, len)) {
+			return {};
+		}
+		return {out, len};
+	} catch (const std::bad_alloc&) {
+		return {};
+	}
+}
+
+} //shd
@@ -17,14 +17,17 @@
 //==============================================================================
 
 #include <cassert>
+#include <cstdio>
 #include <cstring>
 #include <tuple>
 #include <vector>
 #include <chrono>
 #include <atomic>
 #include <thread>
+#include <mutex>
 #include <memory>
 #include <random>
+#include <string>
 #include <exception>
 #include <algorithm>
 #include <functional>
@@ -33,8 +36,56 @@
 namespace shd {
 
 bool g_trace_build_time = false;
+
+#ifdef SHD_TEST_HOOKS
+std::atomic<uint32_t> g_fail_segment_once{UINT32_MAX};
+
+static bool FailOnce(unsigned seg) noexcept {
+	uint32_t target = seg;
+	return g_fail_segment_once.load(std::memory_order_relaxed) == seg
+		&& g_fail_segment_once.compare_exchange_strong(target, UINT32_MAX);
+}
+#else
+static constexpr bool FailOnce(unsigned) noexcept { return false; }
+#endif
+
 static double DurationS(const std::chrono::steady_clock::time_point& start, const std::chrono::steady_clock::time_point& end) {
-	return std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() / 1000.0;
+	return std::chrono::duration<double>(end - start).count();
+}
+
+const char* PhaseName(BuildPhase phase) noexcept {
+	static const char* const names[] = {
+		"prepare", "gen-id", "spill", "partition", "build", "l1-sort", "mapping", "fill", "dump", "stage"
+	};
+	return phase < sizeof(names)/sizeof(names[0])? names[phase] : "unknown";
+}
+
+void BuildLogger::on_phase(BuildPhase phase, double seconds) {
+	Logger::Printf("%s: %.3fs\n", PhaseName(phase), seconds);
+}
+
+const char* StrategyName(BuildStrategy strategy) noexcept {
+	static const char* const names[] = {"shadow", "in-place", "spill"};
+	return strategy < sizeof(names)/sizeof(names[0])? names[strategy] : "unknown";
+}
+
+void BuildLogger::on_plan(const MemoryPlan& plan) {
+	Logger::Printf("plan: %s%s%s%s, peak %lluMB\n", StrategyName(plan.strategy),
+				   plan.keep_ids? " +keep-ids" : "", plan.fill_in_place? " +fill-in-place" : "",
+				   plan.stage_fill? " +stage-fill" : "", (unsigned long long)(plan.peak >> 20U));
+}
+
+static BuildObserver* PickObserver(BuildObserver* observer) {
+	static BuildLogger s_logger;
+	return observer == nullptr && g_trace_build_time? &s_logger : observer;
+}
+
+static void ReportPhase(BuildObserver* observer, BuildPhase phase,
+						const std::chrono::steady_clock::time_point& start,
+						const std::chrono::steady_clock::time_point& end) {
+	if (observer != nullptr) {
+		observer->on_phase(phase, DurationS(start, end));
+	}
 }
 
 struct BuildException : public std::exception {
@@ -85,12 +136,57 @@ static bool HasConflict(V96 ids[], uint32_t cnt) {
 	return false;
 }
 
-static bool TryToMapLarge(V96 ids[], uint32_t cnt, uint8_t& sd8, uint8_t bitmap[], const Divisor<uint64_t>& range, unsigned n) {
-	auto mini_batch_mapping = [bitmap,range](uint8_t sd8, V96 ids[], unsigned n)->bool {
+//Where a key goes in bitmap of its segment with seed sd8. The batch form
+//takes seeds from sd8 on, pos[s*cnt+j] is for ids[j] with seed sd8+s.
+struct SpreadL2 {
+	explicit SpreadL2(uint64_t size)
+		: range(size), mod{size, UINT64_MAX / size}, lanes(HasBatchMod()) {}
+	Divisor<uint64_t> range;
+	LaneModulus mod;
+	bool lanes;	//modulo in SIMD lanes, it dominates the cost
+	FORCE_INLINE uint64_t operator()(const V96& id, uint8_t sd8) const {
+		return L2Hash(id, sd8) % range;
+	}
+	FORCE_INLINE void operator()(const V96 ids[], unsigned cnt, uint8_t sd8, unsigned seeds, uint64_t pos[]) const {
+		assert(cnt*seeds <= MINI_BATCH);
+		if (!lanes) {
+			for (unsigned s = 0, k = 0; s < seeds; s++, sd8++) {
+				for (unsigned j = 0; j < cnt; j++) {
+					pos[k++] = L2Hash(ids[j], sd8) % range;
+				}
+			}
+			return;
+		}
+		uint64_t codes[MINI_BATCH];
+		for (unsigned s = 0, k = 0; s < seeds; s++, sd8++) {
+			for (unsigned j = 0; j < cnt; j++) {
+				codes[k++] = L2Hash(ids[j], sd8);
+			}
+		}
+		BatchMod(codes, cnt*seeds, mod, pos);
+	}
+};
+struct LocalL2 {
+	uint32_t pairs;
+	FORCE_INLINE uint64_t operator()(const V96& id, uint8_t sd8) const {
+		return LocalL2Pos(id, sd8, pairs);
+	}
+	FORCE_INLINE void operator()(const V96 ids[], unsigned cnt, uint8_t sd8, unsigned seeds, uint64_t pos[]) const {
+		for (unsigned s = 0, k = 0; s < seeds; s++, sd8++) {
+			for (unsigned j = 0; j < cnt; j++) {
+				pos[k++] = LocalL2Pos(ids[j], sd8, pairs);
+			}
+		}
+	}
+};
+
+template <typename L2Pos>
+static bool TryToMapLarge(V96 ids[], uint32_t cnt, uint8_t& sd8, uint8_t bitmap[], const L2Pos& l2pos, unsigned n) {
+	auto mini_batch_mapping = [bitmap,&l2pos](uint8_t sd8, V96 ids[], unsigned n)->bool {
 		assert(n <= MINI_BATCH);
 		uint64_t pos[MINI_BATCH];
+		l2pos(ids, n, sd8, 1, pos);
 		for (unsigned i = 0; i < n; i++) {
-			pos[i] = L2Hash(ids[i], sd8) % range;
 			PrefetchBit(bitmap, pos[i]);
 		}
 		for (unsigned i = 0; i < n; i++) {
@@ -120,25 +216,23 @@ static bool TryToMapLarge(V96 ids[], uint32_t cnt, uint8_t& sd8, uint8_t bitmap[
 		}
 	retry:
 		for (auto p = ids; p < tail; p++) {
-			ClearBit(bitmap, L2Hash(*p, sd8) % range);
+			ClearBit(bitmap, l2pos(*p, sd8));
 		}
 		sd8++;
 	}
 	return false;
 }
 
-static bool TryToMapSmall(V96 ids[], uint32_t cnt, uint8_t& sd8, uint8_t bitmap[], const Divisor<uint64_t>& range, unsigned n) {
+template <typename L2Pos>
+static bool TryToMapSmall(V96 ids[], uint32_t cnt, uint8_t& sd8, uint8_t bitmap[], const L2Pos& l2pos, unsigned n) {
 	assert(cnt <= MINI_BATCH);
+	const unsigned group = MINI_BATCH / cnt;	//seeds tried in a round
 	for (unsigned m = 0; m < n; ) {
 		uint64_t pos[MINI_BATCH];
-		auto sd8x = sd8;
-		for (unsigned i = m, off = 0; i < n && off+cnt <= MINI_BATCH; i++) {
-			for (unsigned j = 0; j < cnt; j++) {
-				auto t = L2Hash(ids[j], sd8x) % range;
-				PrefetchBit(bitmap, t);
-				pos[off++] = t;
-			}
-			sd8x++;
+		const auto seeds = std::min(group, n-m);
+		l2pos(ids, cnt, sd8, seeds, pos);
+		for (unsigned i = 0; i < seeds*cnt; i++) {
+			PrefetchBit(bitmap, pos[i]);
 		}
 		for (unsigned off = 0; m < n && off+cnt <= MINI_BATCH; m++) {
 			for (unsigned j = 0; j < cnt; j++) {
@@ -158,14 +252,14 @@ static bool TryToMapSmall(V96 ids[], uint32_t cnt, uint8_t& sd8, uint8_t bitmap[
 	return false;
 }
 
+template <typename L2Pos>
 static std::tuple<uint8_t, BuildStatus>
-Mapping(V96 ids[], uint32_t cnt, uint8_t sd8, uint8_t bitmap[], const Divisor<uint64_t>& range) {
-	auto mini_batch_try = [bitmap,range,&sd8](V96 id, unsigned n)->bool {
+Mapping(V96 ids[], uint32_t cnt, uint8_t sd8, uint8_t bitmap[], const L2Pos& l2pos) {
+	auto mini_batch_try = [bitmap,&l2pos,&sd8](V96 id, unsigned n)->bool {
 		assert(n <= MINI_BATCH);
 		uint64_t pos[MINI_BATCH];
-		auto sd8x = sd8;
+		l2pos(&id, 1, sd8, n, pos);
 		for (unsigned i = 0; i < n; i++) {
-			pos[i] = L2Hash(id, sd8x++) % range;
 			PrefetchBit(bitmap, pos[i]);
 		}
 		for (unsigned i = 0; i < n; i++) {
@@ -181,25 +275,25 @@ Mapping(V96 ids[], uint32_t cnt, uint8_t sd8, uint8_t bitmap[], const Divisor<ui
 	if (cnt > MINI_BATCH) {
 		constexpr unsigned FIRST_TRIES = 56;
 		constexpr unsigned SECOND_TRIES = TOTAL_TRIES - FIRST_TRIES;
-		if (TryToMapLarge(ids, cnt, sd8, bitmap, range, FIRST_TRIES)) {
+		if (TryToMapLarge(ids, cnt, sd8, bitmap, l2pos, FIRST_TRIES)) {
 			return {sd8, BUILD_STATUS_OK};
 		}
 		if (HasConflict(ids, cnt)) {
 			return {sd8, BUILD_STATUS_CONFLICT};
 		}
-		if (TryToMapLarge(ids, cnt, sd8, bitmap, range, SECOND_TRIES)) {
+		if (TryToMapLarge(ids, cnt, sd8, bitmap, l2pos, SECOND_TRIES)) {
 			return {sd8, BUILD_STATUS_OK};
 		}
 	} else if (cnt != 1) {
 		constexpr unsigned FIRST_TRIES = 96;
 		constexpr unsigned SECOND_TRIES = TOTAL_TRIES - FIRST_TRIES;
-		if (TryToMapSmall(ids, cnt, sd8, bitmap, range, FIRST_TRIES)) {
+		if (TryToMapSmall(ids, cnt, sd8, bitmap, l2pos, FIRST_TRIES)) {
 			return {sd8, BUILD_STATUS_OK};
 		}
 		if (HasConflict(ids, cnt)) {
 			return {sd8, BUILD_STATUS_CONFLICT};
 		}
-		if (TryToMapSmall(ids, cnt, sd8, bitmap, range, SECOND_TRIES)) {
+		if (TryToMapSmall(ids, cnt, sd8, bitmap, l2pos, SECOND_TRIES)) {
 			return {sd8, BUILD_STATUS_OK};
 		}
 	} else {
@@ -218,6 +312,7 @@ Mapping(V96 ids[], uint32_t cnt, uint8_t sd8, uint8_t bitmap[], const Divisor<ui
 
 struct IndexPiece {
 	uint32_t size = 0;
+	uint32_t salt = 0;
 	std::unique_ptr<uint8_t[]> cells;
 	std::unique_ptr<BitmapSection[]> sections;
 };
@@ -227,6 +322,28 @@ static uint64_t GetSeed() {
 	return (static_cast<uint64_t>(rd()) << 32U) | static_cast<uint64_t>(rd());
 }
 
+//Seeds of tries of the whole table, random unless given.
+class SeedSequence {
+public:
+	explicit SeedSequence(const std::vector<uint32_t>& given) noexcept : m_given(given) {}
+	uint32_t next() {
+		if (m_given.empty()) {
+			return GetSeed();
+		}
+		if (m_next < m_given.size()) {
+			m_last = m_given[m_next++];
+		} else {
+			m_last = ((m_last + 1ULL) * 0x9E3779B97F4A7C15ULL) >> 32U;
+		}
+		return m_last;
+	}
+
+private:
+	const std::vector<uint32_t>& m_given;
+	size_t m_next = 0;
+	uint32_t m_last = 0;
+};
+
 static size_t SumInputSize(const DataReaders& in) {
 	size_t total = 0;
 	for (auto& reader : in) {
@@ -235,6 +352,40 @@ static size_t SumInputSize(const DataReaders& in) {
 	return total;
 }
 
+static constexpr unsigned READ_BLOCK = 32;
+
+//Records are taken by blocks, visit(rec, i) sees the i-th one and returns false
+//to stop. It fails too if the reader ends early.
+template <typename Visit>
+static FORCE_INLINE bool ReadRecords(IDataReader& reader, size_t n, bool key_only, const Visit& visit) {
+	Record recs[READ_BLOCK];
+	for (size_t i = 0; i < n; ) {
+		const auto m = reader.read_batch(recs, std::min<size_t>(READ_BLOCK, n-i), key_only);
+		if (m == 0) {
+			return false;
+		}
+		for (unsigned j = 0; j < m; j++, i++) {
+			if (!visit(recs[j], i)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+//n keys of fixed length go to buf one after another
+static void ReadKeys(IDataReader& reader, uint8_t key_len, uint8_t* buf, unsigned n) {
+	if (!ReadRecords(reader, n, true, [key_len, buf](const Record& rec, size_t i)->bool {
+			if (rec.key.ptr == nullptr || rec.key.len != key_len) {
+				return false;
+			}
+			Assign(buf + i*key_len, rec.key.ptr, key_len);
+			return true;
+		})) {
+		throw BuildException();
+	}
+}
+
 template <typename Hash, typename Offset, typename Border, typename Order>
 static FORCE_INLINE void ShuffleInOrder(V96 ids[], uint32_t parts,
 										const Hash& hash, const Offset& offset, const Border& border,
@@ -512,11 +663,11 @@ static NOINLINE void L1SortShuffle(V96 ids[], V96 shadow[], uint32_t total,
 }
 
 static V96* L1Sort(V96 ids[], V96 shadow[], uint32_t total,
-									 uint32_t l1sz, const Divisor<uint64_t>& l1bd) {
+									 uint32_t l1sz, const Divisor<uint64_t>& l1bd, uint32_t& max) {
 	ALLOC_MEM_BLOCK(mem, ((size_t)l1sz) * sizeof(L1Mark) * 2)
 	auto table = (L1Mark*)mem.addr();
 
-	auto max = L1SortMarking(ids, total, table, l1sz, l1bd);
+	max = L1SortMarking(ids, total, table, l1sz, l1bd);
 	if (max > std::min(l1sz+16U, (uint32_t)UINT16_MAX)) {
 		return nullptr;
 	}
@@ -529,45 +680,69 @@ static V96* L1Sort(V96 ids[], V96 shadow[], uint32_t total,
 	return shadow == nullptr? ids : shadow;
 }
 
-static NOINLINE BuildStatus Build(V96 ids[], V96 shadow[], IndexPiece& out) {
+//bit width of sd8 steps taken, so bin i holds (2^(i-1), 2^i] tries
+static FORCE_INLINE unsigned TryBin(uint8_t steps) {
+	unsigned bin = 0;
+	for (; steps != 0; steps >>= 1U) {
+		bin++;
+	}
+	return bin;
+}
+
+static NOINLINE BuildStatus Build(V96 ids[], V96 shadow[], IndexPiece& out, IndexLayout layout, SegmentStats& stats) {
 	const uint32_t l1sz = L1Size(out.size);
 	const Divisor<uint64_t> l1bd(L1Band(out.size));
-	const Divisor<uint64_t> l2sz(L2Size(out.size));
+	const bool local = layout & LAYOUT_LOCAL_L2;
 
-	ids = L1Sort(ids, shadow, out.size, l1sz, l1bd);
+	auto spot1 = std::chrono::steady_clock::now();
+	ids = L1Sort(ids, shadow, out.size, l1sz, l1bd, stats.max_bucket);
+	auto spot2 = std::chrono::steady_clock::now();
+	stats.l1_sort = DurationS(spot1, spot2);
 	if (ids == nullptr) {
 		return BUILD_STATUS_CONFLICT;
 	};
 
-	const auto bitmap_size = BitmapSize(out.size);
+	const auto bitmap_size = BitmapSize(out.size, local);
 	auto bitmap = std::make_unique<uint8_t[]>(bitmap_size);
 	memset(bitmap.get(), 0, bitmap_size);
 	auto cells = std::make_unique<uint8_t[]>(l1sz);
 
-	uint8_t magic = 0;
-
-	auto last = SkewMap(L1Hash(ids[0]), l1bd);
-	uint32_t begin = 0;
-	for (uint32_t i = 1; i < out.size; i++) {
-		auto curr = SkewMap(L1Hash(ids[i]), l1bd);
-		if (curr != last) {
-			auto [sd8, status] = Mapping(ids+begin, i-begin, magic--, bitmap.get(), l2sz);
-			if (status != BUILD_STATUS_OK) {
-				return status;
+	auto tries = stats.sd8_tries;
+	auto map_all = [ids, l1bd, &out, &bitmap, &cells, tries](const auto& l2pos)->BuildStatus {
+		uint8_t magic = 0;
+		auto last = SkewMap(L1Hash(ids[0]), l1bd);
+		uint32_t begin = 0;
+		for (uint32_t i = 1; i < out.size; i++) {
+			auto curr = SkewMap(L1Hash(ids[i]), l1bd);
+			if (curr != last) {
+				const auto start = magic--;
+				auto [sd8, status] = Mapping(ids+begin, i-begin, start, bitmap.get(), l2pos);
+				if (status != BUILD_STATUS_OK) {
+					return status;
+				}
+				tries[TryBin(sd8-start)]++;
+				cells[last] = sd8;
+				last = curr;
+				begin = i;
 			}
-			cells[last] = sd8;
-			last = curr;
-			begin = i;
 		}
-	}
-	auto [sd8, status] = Mapping(ids+begin, out.size-begin, magic, bitmap.get(), l2sz);
+		auto [sd8, status] = Mapping(ids+begin, out.size-begin, magic, bitmap.get(), l2pos);
+		if (status != BUILD_STATUS_OK) {
+			return status;
+		}
+		tries[TryBin(sd8-magic)]++;
+		cells[last] = sd8;
+		return BUILD_STATUS_OK;
+	};
+	const auto status = local? map_all(LocalL2{L2Pairs(out.size)})
+							 : map_all(SpreadL2(L2Size(out.size)));
+	stats.mapping = DurationS(spot2, std::chrono::steady_clock::now());
 	if (status != BUILD_STATUS_OK) {
 		return status;
 	}
-	cells[last] = sd8;
 
 	out.cells = std::move(cells);
-	const auto sec_sz = SectionSize(out.size);
+	const auto sec_sz = SectionSize(out.size, local);
 	out.sections = std::make_unique<BitmapSection[]>(sec_sz);
 	auto b32 = (const uint32_t*)bitmap.get();
 	uint32_t step = 0;
@@ -590,33 +765,136 @@ static NOINLINE BuildStatus Build(V96 ids[], V96 shadow[], IndexPiece& out) {
 	return BUILD_STATUS_OK;
 }
 
-static BuildStatus Build(V96 ids[], V96 shadow[], std::vector<IndexPiece>& out) {
+//Workers take tasks in order till all are done, a worker takes the next one
+//once its current one is done, so uneven tasks are balanced.
+static void RunTasks(unsigned workers, size_t tasks, const std::function<void(size_t)>& task) {
+	workers = std::min<size_t>(workers, tasks);
+	if (workers <= 1) {
+		for (size_t i = 0; i < tasks; i++) {
+			task(i);
+		}
+		return;
+	}
+	std::atomic<size_t> next{0};
+	auto work = [&next, tasks, &task]() {
+		for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < tasks; ) {
+			task(i);
+		}
+	};
 	std::vector<std::thread> threads;
-	threads.reserve(out.size());
-	std::vector<BuildStatus> part_status(out.size());
+	threads.reserve(workers-1);
+	for (unsigned i = 1; i < workers; i++) {
+		threads.emplace_back(work);
+	}
+	work();
+	for (auto& t : threads) {
+		t.join();
+	}
+}
+
+static uint32_t SegmentSalt(uint32_t seed, unsigned seg, unsigned round) {
+	const uint64_t x = (((uint64_t)seed << 32U) | (seg << 8U) | (round & 0xffU)) * 0x9E3779B97F4A7C15ULL;
+	return (x >> 32U) | 1U;
+}
+
+//ids of the segment stay salted, the old salt is taken off before the new one
+static void ResaltIDs(V96 ids[], uint32_t n, uint32_t old_salt, uint32_t new_salt) {
+	for (uint32_t i = 0; i < n; i++) {
+		ids[i] = SaltID(SaltID(ids[i], old_salt), new_salt);
+	}
+}
+
+static BuildStatus BuildSegment(V96 ids[], V96 shadow[], IndexPiece& piece, IndexLayout layout, unsigned seg,
+								BuildObserver* observer, SegmentStats& stats) {
+	stats = SegmentStats{};
+	stats.segment = seg;
+	stats.size = piece.size;
+	stats.salt = piece.salt;
+	auto spot = std::chrono::steady_clock::now();
+	stats.status = UNLIKELY(FailOnce(seg))? BUILD_STATUS_OUT_OF_CHANCE : Build(ids, shadow, piece, layout, stats);
+	stats.total = DurationS(spot, std::chrono::steady_clock::now());
+	if (observer != nullptr) {
+		observer->on_segment(stats);
+	}
+	return stats.status;
+}
+
+static void ReportSegmentPhases(BuildObserver* observer, const std::vector<SegmentStats>& stats,
+								const std::vector<uint32_t>& built) {
+	if (observer == nullptr) {
+		return;
+	}
+	double l1_sort = 0;
+	double mapping = 0;
+	for (auto i : built) {
+		l1_sort += stats[i].l1_sort;
+		mapping += stats[i].mapping;
+	}
+	observer->on_phase(PHASE_L1_SORT, l1_sort);
+	observer->on_phase(PHASE_MAPPING, mapping);
+}
 
+struct BuildPlan {
+	IndexLayout layout;
+	bool use_extra_mem;
+	bool keep_ids;
+	uint16_t segments;
+	unsigned workers;
+	BuildObserver* observer;
+};
+
+//Segments out of chance are salted and built again alone, each round costs one
+//retry. Conflict means duplicate ids, which no salt can fix.
+static BuildStatus Build(V96 ids[], V96 shadow[], std::vector<IndexPiece>& out, const BuildPlan& plan,
+						 uint32_t seed, Retry& retry) {
+	std::vector<size_t> offsets(out.size());
 	size_t off = 0;
 	for (unsigned i = 0; i < out.size(); i++) {
-		threads.emplace_back([](V96 ids[], V96 shadow[], IndexPiece* piece, BuildStatus* status) {
-			*status = Build(ids, shadow, *piece);
-		}, ids+off, shadow!=nullptr? shadow+off : nullptr, &out[i], &part_status[i]);
+		offsets[i] = off;
 		off += out[i].size;
 	}
-	for (auto& t : threads) {
-		t.join();
-	}
-	BuildStatus status = BUILD_STATUS_OK;
-	for (auto part : part_status) {
-		if (part == BUILD_STATUS_CONFLICT) {
-			status = BUILD_STATUS_CONFLICT;
-		} else if (part == BUILD_STATUS_OUT_OF_CHANCE && status != BUILD_STATUS_CONFLICT) {
-			status = BUILD_STATUS_OUT_OF_CHANCE;
+	std::vector<uint32_t> todo(out.size());
+	for (unsigned i = 0; i < out.size(); i++) {
+		todo[i] = i;
+	}
+	std::vector<SegmentStats> stats(out.size());
+	for (unsigned round = 1; ; round++) {
+		RunTasks(plan.workers, todo.size(), [ids, shadow, &out, &plan, &offsets, &todo, &stats](size_t k) {
+			const auto i = todo[k];
+			BuildSegment(ids+offsets[i], shadow!=nullptr? shadow+offsets[i] : nullptr, out[i], plan.layout, i,
+						 plan.observer, stats[i]);
+		});
+		ReportSegmentPhases(plan.observer, stats, todo);
+		std::vector<uint32_t> failed;
+		for (auto i : todo) {
+			if (stats[i].status == BUILD_STATUS_CONFLICT) {
+				return BUILD_STATUS_CONFLICT;
+			} else if (stats[i].status == BUILD_STATUS_OUT_OF_CHANCE) {
+				failed.push_back(i);
+			}
 		}
+		if (failed.empty()) {
+			return BUILD_STATUS_OK;
+		}
+		if (retry.total == 0) {
+			return BUILD_STATUS_OUT_OF_CHANCE;
+		}
+		retry.total--;
+		Logger::Printf("%u segments failed, retry with salt\n", (unsigned)failed.size());
+		for (auto i : failed) {
+			if (plan.observer != nullptr) {
+				plan.observer->on_retry(BUILD_STATUS_OUT_OF_CHANCE, i);
+			}
+			const auto salt = SegmentSalt(seed, i, round);
+			ResaltIDs(ids+offsets[i], out[i].size, out[i].salt, salt);
+			out[i].salt = salt;
+		}
+		todo.swap(failed);
 	}
-	return status;
 }
 
-static BuildStatus Build(V96 ids[], V96 shadow[], std::vector<size_t>& shuffle, std::vector<IndexPiece>& out) {
+static BuildStatus Build(V96 ids[], V96 shadow[], std::vector<size_t>& shuffle, std::vector<IndexPiece>& out,
+						 const BuildPlan& plan, uint32_t seed, Retry& retry) {
 	const uint32_t n = shuffle.size();
 	Assert(n > 1 && n <= MAX_SEGMENT);
 	const Divisor<uint16_t> l0sz(n);
@@ -665,15 +943,13 @@ static BuildStatus Build(V96 ids[], V96 shadow[], std::vector<size_t>& shuffle,
 #else
 		auto heads = min >> 5U;
 #endif
-		if (heads <= 1) {
+		if (heads <= 1 || plan.workers <= 1) {
 			Shuffle(ids, shadow, total,
 					[l0sz, &shuffle](const V96& id)->size_t& {
 						return shuffle[L0Hash(id) % l0sz];
 					});
 		} else {	//multi-head shuffle
-			if (heads > n) {
-				heads = n;
-			}
+			heads = std::min<size_t>(heads, std::min(n, plan.workers));
 			struct Range {
 				size_t off;
 				size_t end;
@@ -727,138 +1003,207 @@ static BuildStatus Build(V96 ids[], V96 shadow[], std::vector<size_t>& shuffle,
 		std::swap(ids, shadow);
 	}
 	auto spot2 = std::chrono::steady_clock::now();
-	auto status = Build(ids, shadow, out);
-	auto spot3 = std::chrono::steady_clock::now();
-	if (g_trace_build_time) {
-		Logger::Printf("partition: %.3fs\n", DurationS(spot1, spot2));
-		Logger::Printf("build: %.3fs\n", DurationS(spot2, spot3));
-	}
+	ReportPhase(plan.observer, PHASE_PARTITION, spot1, spot2);
+	auto status = Build(ids, shadow, out, plan, seed, retry);
+	ReportPhase(plan.observer, PHASE_BUILD, spot2, std::chrono::steady_clock::now());
 	return status;
 }
 
-static BuildStatus Build(bool use_extra_mem, uint32_t seed, const DataReaders& in, std::vector<IndexPiece>& out) {
-	const auto total = SumInputSize(in);
-	Assert(!in.empty() && total > 0);
-
-	ALLOC_MEM_BLOCK(mem, total*sizeof(V96)*(use_extra_mem?2U:1U))
-	auto ids = (V96*)mem.addr();
-	auto shadow = use_extra_mem? ids + total : nullptr;
+//Readers are consumed as a queue of chunks. Keys of a chunk are copied out
+//under the lock of their reader, then hashed outside, so a few readers can
+//still keep all workers busy. Ids stay in input order.
+static constexpr size_t GEN_ID_CHUNK = 1024;
 
-	const uint32_t n = in.size();
-#ifdef NDEBUG
-	if (n == 1 || total < 8192U * n) {
-#else
-	if (n == 1 || total < 32U * n) {
-#endif
-		if (total > UINT32_MAX) {
-			return BUILD_STATUS_BAD_INPUT;
-		}
-		auto spot1 = std::chrono::steady_clock::now();
-		auto p = ids;
-		for (auto& reader : in) {
-			reader->reset();
-			auto cnt = reader->total();
-			for (size_t i = 0; i < cnt; i++) {
-				auto key = reader->read(true).key;
-				if (key.ptr == nullptr || key.len == 0 || key.len > MAX_KEY_LEN) {
-					return BUILD_STATUS_BAD_INPUT;
-				}
-				*p++ = GenID(seed, key.ptr, key.len);
-			}
-		}
-		out.resize(1);
-		out.front().size = total;
-		auto spot2 = std::chrono::steady_clock::now();
-		auto status = Build(ids, shadow, out.front());
-		auto spot3 = std::chrono::steady_clock::now();
-		if (g_trace_build_time) {
-			Logger::Printf("gen-id: %.3fs\n", DurationS(spot1, spot2));
-			Logger::Printf("build: %.3fs\n", DurationS(spot2, spot3));
-		}
-		return status;
+static bool GenIDs(uint32_t seed, const DataReaders& in, V96 ids[], unsigned workers, std::vector<size_t>& counts) {
+	struct Cursor {
+		std::mutex lock;
+		size_t base = 0;
+		size_t done = 0;
+	};
+	auto cursors = std::make_unique<Cursor[]>(in.size());
+	size_t off = 0;
+	for (unsigned i = 0; i < in.size(); i++) {
+		in[i]->reset();
+		cursors[i].base = off;
+		off += in[i]->total();
 	}
-
-	auto spot4 = std::chrono::steady_clock::now();
+	const uint32_t n = counts.size();
 	const Divisor<uint16_t> l0sz(n);
-
-	std::vector<std::thread> threads;
-	threads.reserve(n);
-	std::vector<size_t> shuffle(n, 0);
-
 	std::atomic<bool> fail{false};
-	size_t off = 0;
-	for (auto& reader : in) {
-		reader->reset();
-		threads.emplace_back([seed, &fail, &shuffle, l0sz](IDataReader* reader, V96 ids[]) {
-			auto cnt = reader->total();
-			const uint32_t n = shuffle.size();
-			std::vector<size_t> temp(n, 0);
-			for (size_t j = 0; j < cnt; j++) {
-				auto key = reader->read(true).key;
-				if (key.ptr == nullptr || key.len == 0 || key.len > MAX_KEY_LEN) {
+	RunTasks(workers, workers, [seed, &in, ids, n, l0sz, &counts, &cursors, &fail](size_t self) {
+		std::vector<size_t> temp(n, 0);
+		auto keys = std::make_unique<uint8_t[]>(GEN_ID_CHUNK*MAX_KEY_LEN);
+		auto msgs = std::make_unique<const uint8_t*[]>(GEN_ID_CHUNK);
+		auto codes = std::make_unique<V128[]>(GEN_ID_CHUNK);
+		uint8_t lens[GEN_ID_CHUNK];
+		for (size_t i = 0; i < GEN_ID_CHUNK; i++) {
+			msgs[i] = keys.get()+i*MAX_KEY_LEN;
+		}
+		unsigned r = self % in.size();
+		for (unsigned idle = 0; idle < in.size() && !fail.load(std::memory_order_relaxed); ) {
+			auto& cur = cursors[r];
+			size_t start, m;
+			{
+				std::lock_guard<std::mutex> guard(cur.lock);
+				auto& reader = *in[r];
+				m = std::min(GEN_ID_CHUNK, reader.total() - cur.done);
+				start = cur.base + cur.done;
+				cur.done += m;
+				if (!ReadRecords(reader, m, true, [&keys, &lens](const Record& rec, size_t i)->bool {
+						if (rec.key.ptr == nullptr || rec.key.len == 0 || rec.key.len > MAX_KEY_LEN) {
+							return false;
+						}
+						lens[i] = rec.key.len;
+						memcpy(keys.get()+i*MAX_KEY_LEN, rec.key.ptr, rec.key.len);
+						return true;
+					})) {
 					fail.store(true, std::memory_order_relaxed);
 					return;
 				}
-				ids[j] = GenID(seed, key.ptr, key.len);
-				temp[L0Hash(ids[j])%l0sz]++;
 			}
-			for (unsigned j = 0; j < n; j++) {
-				AddRelaxed(shuffle[j], temp[j]);
+			if (m == 0) {
+				idle++;
+				r = (r+1) % in.size();
+				continue;
 			}
-		}, reader.get(), ids+off);
-		off += reader->total();
-	}
-	for (auto& t : threads) {
-		t.join();
+			idle = 0;
+			for (size_t i = 0; i < m; ) {	//keys of the same length are hashed in lanes
+				size_t k = i+1;
+				while (k < m && lens[k] == lens[i]) {
+					k++;
+				}
+				HashTo128(msgs.get()+i, k-i, lens[i], seed, codes.get()+i);
+				i = k;
+			}
+			for (size_t i = 0; i < m; i++) {
+				auto& id = ids[start+i];
+				id = ToID(codes[i]);
+				if (n > 1) {
+					temp[L0Hash(id)%l0sz]++;
+				}
+			}
+		}
+		for (unsigned j = 0; j < n; j++) {
+			AddRelaxed(counts[j], temp[j]);
+		}
+	});
+	return !fail.load(std::memory_order_relaxed);
+}
+
+#ifdef NDEBUG
+static constexpr size_t MIN_SEGMENT_ITEMS = 8192U;
+#else
+static constexpr size_t MIN_SEGMENT_ITEMS = 32U;
+#endif
+
+//segments asked for, or only one if input is too small to share
+static uint32_t SegmentCount(size_t total, uint32_t n) {
+	return total < MIN_SEGMENT_ITEMS * n? 1U : n;
+}
+
+//ids in input order are copied to kept if not null, for the fill phase to skip hashing
+static BuildStatus Build(const BuildPlan& plan, uint32_t seed, const DataReaders& in, std::vector<IndexPiece>& out,
+						 Retry& retry, V96 kept[]) {
+	const auto total = SumInputSize(in);
+	Assert(!in.empty() && total > 0);
+
+	ALLOC_MEM_BLOCK(mem, total*sizeof(V96)*(plan.use_extra_mem?2U:1U))
+	auto ids = (V96*)mem.addr();
+	auto shadow = plan.use_extra_mem? ids + total : nullptr;
+
+	Assert(plan.segments != 0 && plan.segments <= MAX_SEGMENT);
+	const uint32_t n = SegmentCount(total, plan.segments);
+	if (n == 1 && total > UINT32_MAX) {
+		return BUILD_STATUS_BAD_INPUT;
 	}
-	if (fail.load(std::memory_order_relaxed)) {
+
+	auto spot1 = std::chrono::steady_clock::now();
+	std::vector<size_t> shuffle(n, 0);
+	if (!GenIDs(seed, in, ids, plan.workers, shuffle)) {
 		return BUILD_STATUS_BAD_INPUT;
 	}
-	auto spot5 = std::chrono::steady_clock::now();
-	if (g_trace_build_time) {
-		Logger::Printf("gen-id: %.3fs\n", DurationS(spot4, spot5));
+	if (kept != nullptr) {
+		memcpy(kept, ids, total*sizeof(V96));
 	}
-	return Build(ids, shadow, shuffle, out);
+	auto spot2 = std::chrono::steady_clock::now();
+	ReportPhase(plan.observer, PHASE_GEN_ID, spot1, spot2);
+	if (n > 1) {
+		return Build(ids, shadow, shuffle, out, plan, seed, retry);
+	}
+	out.clear();
+	out.resize(1);
+	out.front().size = total;
+	auto status = Build(ids, shadow, out, plan, seed, retry);
+	ReportPhase(plan.observer, PHASE_BUILD, spot2, std::chrono::steady_clock::now());
+	return status;
 }
 
-static bool DumpIndex(IDataWriter& out, const Header& header, const std::vector<IndexPiece>& pieces) {
+//cells and sections of a piece are written by the callbacks, they may come from spill files
+template <typename Cells, typename Sections>
+static bool DumpIndex(IDataWriter& out, const Header& header, const std::vector<IndexPiece>& pieces,
+					  const Cells& cells, const Sections& sections) {
 	std::vector<uint32_t> items(pieces.size());
+	std::vector<uint32_t> salts(pieces.size());
+	bool salted = false;
 	for (unsigned i = 0; i < pieces.size(); i++) {
 		items[i] = pieces[i].size;
+		salts[i] = pieces[i].salt;
+		salted |= salts[i] != 0;
+	}
+	Header head = header;
+	if (salted) {
+		head.type |= SEGMENT_SALT_FLAG;
 	}
 	if (items.empty()
-		|| !out.write(&header, sizeof(header))
+		|| !out.write(&head, sizeof(head))
 		|| !out.write(items.data(), items.size()*4U)
+		|| (salted && !out.write(salts.data(), salts.size()*4U))
 	) return false;
 
-	auto size = sizeof(Header) + items.size()*4U;
-	for (auto& res : pieces) {
-		auto sz = L1Size(res.size);
-		if (!out.write(res.cells.get(), sz)) {
+	auto size = sizeof(Header) + items.size()*(salted? 8U : 4U);
+	for (unsigned i = 0; i < pieces.size(); i++) {
+		auto sz = L1Size(pieces[i].size);
+		if (!cells(i, sz)) {
 			return false;
 		}
 		size += sz;
 	}
-	const uint64_t zeros[4] = {0,0,0,0};
+	const bool local = header.type & LOCAL_L2_FLAG;
+	const uint64_t zeros[8] = {0,0,0,0,0,0,0,0};
 	const auto unaligned = size;
-	size = (size+31U)&(~31U);
+	size = local? (size+63U)&(~63U) : (size+31U)&(~31U);
 	if (size > unaligned && !out.write(zeros, size-unaligned)) {
 		return false;
 	}
-	for (auto& res : pieces) {
-		auto sz = SectionSize(res.size) * (size_t)sizeof(BitmapSection);
-		if (!out.write(res.sections.get(), sz)) {
+	for (unsigned i = 0; i < pieces.size(); i++) {
+		auto sz = SectionSize(pieces[i].size, local) * (size_t)sizeof(BitmapSection);
+		if (!sections(i, sz)) {
 			return false;
 		}
 		size += sz;
 	}
+	if ((header.type & SPLIT_KV_FLAG) && (size & 63U) != 0
+		&& !out.write(zeros, 64U-(size & 63U))) {
+		return false;
+	}
 	return true;
 }
 
+static bool DumpIndex(IDataWriter& out, const Header& header, const std::vector<IndexPiece>& pieces) {
+	return DumpIndex(out, header, pieces,
+					 [&out, &pieces](unsigned i, size_t sz)->bool {
+						 return out.write(pieces[i].cells.get(), sz);
+					 },
+					 [&out, &pieces](unsigned i, size_t sz)->bool {
+						 return out.write(pieces[i].sections.get(), sz);
+					 });
+}
+
 struct BasicInfo {
 	Type type;
 	uint8_t key_len;
 	uint16_t val_len;
+	IndexLayout layout;
 };
 
 std::unique_ptr<uint8_t[]> CreateIndexView(const BasicInfo& info, uint32_t seed, const std::vector<IndexPiece>& pieces) {
@@ -873,11 +1218,13 @@ std::unique_ptr<uint8_t[]> CreateIndexView(const BasicInfo& info, uint32_t seed,
 #endif
 	auto index = (PackView*)view.get();
 	*index = PackView{};
-	index->key_len = info.key_len;
+	index->type = info.type;
+	index->key_len = (info.layout & LAYOUT_VAR_KEY)? KEY_REF_SIZE : info.key_len;
 	index->val_len = info.val_len;
-	index->line_size = info.key_len + (uint32_t)info.val_len;
+	index->line_size = LineSize(info.type, index->key_len, info.val_len);
 	index->seed = seed;
 	index->l0sz = pieces.size();
+	index->layout = info.layout;
 	uint64_t off = 0;
 	for (unsigned i = 0; i < pieces.size(); i++) {
 		index->segments[i] = SegmentView{};
@@ -886,48 +1233,223 @@ std::unique_ptr<uint8_t[]> CreateIndexView(const BasicInfo& info, uint32_t seed,
 		index->segments[i].sections = pieces[i].sections.get();
 		index->segments[i].cells = pieces[i].cells.get();
 		index->segments[i].offset = off;
+		index->segments[i].salt = pieces[i].salt;
+		if (info.layout & LAYOUT_LOCAL_L2) {
+			index->segments[i].l2pairs = L2Pairs(pieces[i].size);
+		}
 		off += pieces[i].size;
 	}
+	index->item = off;
 	return view;
 }
 
-static BuildStatus BuildAndDump(const DataReaders& in, IDataWriter& out, const BasicInfo& info, Retry retry,
-								const std::function<BuildStatus(const PackView&, const DataReaders&, IDataWriter&)>& fill,
-								bool force_extra_mem=false) {
+static unsigned BuildWorkers(const BuildOptions& options) {
+	return options.workers != 0? options.workers : std::max(std::thread::hardware_concurrency(), 1U);
+}
+
+//true to try again with another seed
+static bool ShouldRetry(BuildStatus status, Retry& retry, BuildObserver* observer) {
+	switch (status) {
+		case BUILD_STATUS_CONFLICT:
+			if (retry.conflict-- == 0) {
+				return false;
+			}
+		case BUILD_STATUS_OUT_OF_CHANCE:
+			if (retry.total-- == 0) {
+				return false;
+			}
+			Logger::Printf(status==BUILD_STATUS_CONFLICT? "conflict, retry\n" : "failed, retry\n");
+			if (observer != nullptr) {
+				observer->on_retry(status, ALL_SEGMENTS);
+			}
+			return true;
+		default:
+			return false;
+	}
+}
+
+static BuildStatus SpillBuildAndDump(const DataReaders& in, IDataWriter& out, const BasicInfo& info,
+									 Header& header, const BuildOptions& options, BuildObserver* observer);
+
+//decided by the memory plan
+struct FillHints {
+	const V96* ids = nullptr;	//of all records in input order
+	bool stage = false;			//wide lines are staged to fill in position order
+	bool in_place = false;		//content is filled in mapped output
+	unsigned workers = 1;		//resolved from BuildOptions
+};
+using FillFunction = std::function<BuildStatus(const PackView&, const DataReaders&, IDataWriter&, BuildObserver*,
+											   const FillHints&)>;
+
+#ifdef NDEBUG
+static constexpr size_t SORTED_FILL_MIN = 32U << 20U;
+#else
+static constexpr size_t SORTED_FILL_MIN = 1U << 20U;
+#endif
+
+static uint64_t ContentSize(const BasicInfo& info, uint64_t total) {
+	const uint32_t key_len = (info.layout & LAYOUT_VAR_KEY)? KEY_REF_SIZE : info.key_len;
+	if (info.type == Type::INDEX_ONLY) {
+		return 0;
+	} else if (info.layout & LAYOUT_SPLIT_KV) {
+		return SplitValueOffset(total, key_len) + total*info.val_len;
+	}
+	return total * LineSize(info.type, key_len, info.val_len);
+}
+
+static bool CanStageFill(const BasicInfo& info, uint64_t total) {
+	const auto line_size = LineSize(info.type, info.key_len, info.val_len);
+	return (info.type == Type::KEY_SET || info.type == Type::KV_INLINE)
+		&& !(info.layout & (LAYOUT_SPLIT_KV | LAYOUT_VAR_KEY))
+		&& line_size > DOUBLE_COPY_LINE_SIZE_LIMIT && total*line_size >= SORTED_FILL_MIN;
+}
+
+//index pieces, and temporary buffers of segments built at once
+static uint64_t IndexMemory(uint64_t total, uint32_t segments, unsigned workers) {
+	const uint64_t seg = (total + segments - 1U) / segments;
+	const uint64_t index = total/L1CELL + segments
+		+ (2U*total/BITMAP_SECTION_SIZE + 2U*segments) * sizeof(BitmapSection);
+	const uint64_t temp = (seg/L1CELL + 1U) * sizeof(L1Mark) * 2U + (2U*seg + BITMAP_SECTION_SIZE) / 8U;
+	return index + std::min<uint64_t>(workers, segments) * temp;
+}
+
+//Strategies are tried from the fastest, the first fits the budget is taken.
+//Key arena of variable length keys is not counted, key lengths are not known ahead.
+static bool PlanMemory(const BasicInfo& info, uint64_t total, uint32_t segments, unsigned workers,
+					   bool has_fill, bool can_map, size_t budget, MemoryPlan& plan) {
+	const uint64_t ids = total * sizeof(V96);
+	const uint64_t index = IndexMemory(total, segments, workers);
+	const uint64_t content = ContentSize(info, total);
+	const bool can_keep = has_fill && !(info.layout & LAYOUT_VAR_KEY);
+	struct Candidate {
+		BuildStrategy strategy;
+		bool keep_ids;
+	};
+	const Candidate candidates[] = {
+		{STRATEGY_SHADOW, true}, {STRATEGY_SHADOW, false}, {STRATEGY_IN_PLACE, false}
+	};
+	for (const auto& one : candidates) {
+		if (one.keep_ids && !can_keep) {
+			continue;
+		}
+		const uint64_t kept = one.keep_ids? ids : 0;
+		const uint64_t build = (one.strategy == STRATEGY_SHADOW? ids*2U : ids) + kept + index;
+		uint64_t fill = kept + index + (can_map? 0 : content);
+		if (std::max(build, fill) > budget) {
+			continue;
+		}
+		plan.strategy = one.strategy;
+		plan.keep_ids = one.keep_ids;
+		plan.fill_in_place = can_map && content != 0;
+		plan.stage_fill = CanStageFill(info, total) && fill + content + total*sizeof(uint32_t) <= budget;
+		if (plan.stage_fill) {
+			fill += content + total*sizeof(uint32_t);
+		}
+		plan.peak = std::max(build, fill);
+		return true;
+	}
+	plan.peak = ids + index + (can_map? 0 : content);	//the least to ask for
+	return false;
+}
+
+//the old rule without a budget, a shadow copy for large lines, content filled
+//in memory, ids not kept and no staging as they take more memory
+static MemoryPlan DefaultPlan(const BasicInfo& info, uint64_t total, uint32_t segments, unsigned workers,
+							  bool use_extra_mem) {
+	MemoryPlan plan;
+	const bool shadow = use_extra_mem || info.key_len + (uint32_t)info.val_len > sizeof(V96)*2+4;
+	plan.strategy = shadow? STRATEGY_SHADOW : STRATEGY_IN_PLACE;
+	const uint64_t ids = total * sizeof(V96);
+	const uint64_t index = IndexMemory(total, segments, workers);
+	const uint64_t content = ContentSize(info, total);
+	plan.peak = std::max((shadow? ids*2U : ids) + index, index + content);
+	return plan;
+}
+
+static BuildStatus BuildAndDump(const DataReaders& in, IDataWriter& out, const BasicInfo& info,
+								const BuildOptions& options, BuildObserver* observer, const FillFunction& fill) {
 	const size_t total = SumInputSize(in);
-	if (in.empty() || in.size() > MAX_SEGMENT || total == 0) {
+	if (in.empty() || total == 0 || options.segments > MAX_SEGMENT) {
+		return BUILD_STATUS_BAD_INPUT;
+	}
+	if ((info.layout & ~(LAYOUT_LOCAL_L2 | LAYOUT_SPLIT_KV | LAYOUT_COMPRESS_VALUE | LAYOUT_VAR_KEY)) != 0
+		|| ((info.layout & LAYOUT_SPLIT_KV) && info.type != Type::KV_INLINE)
+		|| ((info.layout & LAYOUT_COMPRESS_VALUE) && info.type != Type::KV_SEPARATED)
+		|| ((info.layout & LAYOUT_VAR_KEY) && ((info.layout & LAYOUT_SPLIT_KV) || info.key_len != 0
+			|| info.type == Type::INDEX_ONLY || info.type == Type::FINGERPRINT_SET))) {
 		return BUILD_STATUS_BAD_INPUT;
 	}
 	Header header;
 	header.type = info.type;
+	if (info.layout & LAYOUT_LOCAL_L2) {
+		header.type |= LOCAL_L2_FLAG;
+	}
+	if (info.layout & LAYOUT_SPLIT_KV) {
+		header.type |= SPLIT_KV_FLAG;
+	}
+	if (info.layout & LAYOUT_COMPRESS_VALUE) {
+		header.type |= COMPRESS_VALUE_FLAG;
+	}
+	if (info.layout & LAYOUT_VAR_KEY) {
+		header.type |= VAR_KEY_FLAG;
+	}
 	header.key_len = info.key_len;
 	header.val_len = info.val_len;
 	header.item = total;
 	header.item_high = total >> 32U;
 
-	const bool use_extra_mem = force_extra_mem
-		|| info.key_len + (uint32_t)info.val_len > sizeof(V96)*2+4;
+	//without a budget there is nothing to plan against, spill as asked
+	const bool can_spill = !options.spill_dir.empty();
+	if (can_spill && (options.memory_budget == 0 || (options.segments == 0 && in.size() > MAX_SEGMENT))) {
+		return SpillBuildAndDump(in, out, info, header, options, observer);
+	}
+
+	if (options.segments == 0 && in.size() > MAX_SEGMENT) {
+		return BUILD_STATUS_BAD_INPUT;
+	}
+	BuildPlan plan;
+	plan.layout = info.layout;
+	plan.segments = options.segments != 0? options.segments : in.size();
+	plan.workers = BuildWorkers(options);
+	plan.observer = observer;
+
+	MemoryPlan mem_plan;
+	const uint32_t segments = SegmentCount(total, plan.segments);
+	if (options.memory_budget == 0) {
+		mem_plan = DefaultPlan(info, total, segments, plan.workers, options.use_extra_mem);
+	} else if (!PlanMemory(info, total, segments, plan.workers, fill != nullptr, out.can_map(),
+						   options.memory_budget, mem_plan)) {
+		if (can_spill) {	//the last choice
+			return SpillBuildAndDump(in, out, info, header, options, observer);
+		}
+		Logger::Printf("memory budget is too small, %llu bytes needed at least\n",
+					   (unsigned long long)mem_plan.peak);
+		return BUILD_STATUS_OUT_OF_MEMORY;
+	}
+	if (observer != nullptr) {
+		observer->on_plan(mem_plan);
+	}
+	plan.use_extra_mem = mem_plan.strategy == STRATEGY_SHADOW;
+	plan.keep_ids = mem_plan.keep_ids;
 
+	MemBlock kept;
+	if (plan.keep_ids) {
+		kept = MemBlock(total*sizeof(V96));
+		if (!kept) {
+			throw std::bad_alloc();
+		}
+	}
+	auto retry = options.retry;
+	SeedSequence seeds(options.seeds);
 	std::vector<IndexPiece> pieces;
-	for (bool done = false; !done; ) {
-		header.seed = GetSeed();
-		const auto status = Build(use_extra_mem, header.seed, in, pieces);
-		switch (status) {
-			case BUILD_STATUS_OK:
-				done = true;
-				break;
-			case BUILD_STATUS_CONFLICT:
-				if (retry.conflict-- == 0) {
-					return status;
-				}
-			case BUILD_STATUS_OUT_OF_CHANCE:
-				if (retry.total-- == 0) {
-					return status;
-				}
-				Logger::Printf(status==BUILD_STATUS_CONFLICT? "conflict, retry\n" : "failed, retry\n");
-				break;
-			default:
-				return status;
+	for (;;) {
+		header.seed = seeds.next();
+		const auto status = Build(plan, header.seed, in, pieces, retry, (V96*)kept.addr());
+		if (status == BUILD_STATUS_OK) {
+			break;
+		}
+		if (!ShouldRetry(status, retry, observer)) {
+			return status;
 		}
 	}
 	header.seg_cnt = pieces.size();
@@ -937,17 +1459,101 @@ static BuildStatus BuildAndDump(const DataReaders& in, IDataWriter& out, const B
 	if (fill != nullptr) {
 		auto index = CreateIndexView(info, header.seed, pieces);
 		assert(index != nullptr);
-		return fill(*(PackView*)index.get(), in, out);
+		FillHints hints;
+		hints.ids = (const V96*)kept.addr();
+		hints.stage = mem_plan.stage_fill;
+		hints.in_place = mem_plan.fill_in_place;
+		hints.workers = plan.workers;
+		return fill(*(PackView*)index.get(), in, out, observer, hints);
 	}
 	return BUILD_STATUS_OK;
 }
 
-static FORCE_INLINE uint8_t* FindLine(uint8_t* space, const PackView& index, const uint8_t* key) {
+//counts bytes of the table for observer
+class CountingWriter : public IDataWriter {
+public:
+	explicit CountingWriter(IDataWriter& out) : m_out(out) {}
+	bool operator!() const noexcept override { return !m_out; }
+	bool flush() override { return m_out.flush(); }
+	bool write(const void* data, size_t n) override {
+		m_size += n;
+		return m_out.write(data, n);
+	}
+	size_t reserve(size_t n) override {
+		const auto off = m_out.reserve(n);
+		if (off != SIZE_MAX) {
+			m_size += n;
+		}
+		return off;
+	}
+	bool write_at(size_t offset, const void* data, size_t n) override {
+		return m_out.write_at(offset, data, n);
+	}
+	bool can_map() const noexcept override { return m_out.can_map(); }
+	uint8_t* map(size_t n) override {
+		auto addr = m_out.map(n);
+		if (addr != nullptr) {
+			m_size += n;
+		}
+		return addr;
+	}
+	uint64_t size() const noexcept { return m_size; }
+
+private:
+	IDataWriter& m_out;
+	uint64_t m_size = 0;
+};
+
+static BuildStatus BuildAndDump(const DataReaders& in, IDataWriter& out, const BasicInfo& info,
+								const BuildOptions& options, const FillFunction& fill) {
+	auto observer = PickObserver(options.observer);
+	if (observer == nullptr) {
+		return BuildAndDump(in, out, info, options, nullptr, fill);
+	}
+	CountingWriter counter(out);
+	const auto status = BuildAndDump(in, counter, info, options, observer, fill);
+	if (status == BUILD_STATUS_OK) {
+		observer->on_output(counter.size());
+	}
+	return status;
+}
+
+//Content is filled in output in place when planned and the writer can map it,
+//otherwise in memory and written out after.
+class ContentSpace {
+public:
+	ContentSpace(IDataWriter& out, size_t size, bool in_place) : m_out(out), m_size(size) {
+		m_addr = in_place? out.map(size) : nullptr;
+		if (m_addr == nullptr) {
+			m_block = MemBlock(size);
+			if (!m_block) {
+				throw std::bad_alloc();
+			}
+			m_addr = m_block.addr();
+		}
+	}
+	uint8_t* addr() const noexcept { return m_addr; }
+	size_t size() const noexcept { return m_size; }
+	bool dump() {
+		const bool done = !m_block || m_out.write(m_block.addr(), m_block.size());
+		m_block = MemBlock{};
+		m_addr = nullptr;
+		return done;
+	}
+
+private:
+	IDataWriter& m_out;
+	size_t m_size;
+	uint8_t* m_addr;
+	MemBlock m_block;
+};
+
+static FORCE_INLINE uint8_t* FindLine(uint8_t* space, const PackView& index, const uint8_t* key) {
 	const auto pos = CalcPos(index, key, index.key_len);
 	return space + pos*index.line_size;
 }
 
-static bool FillKeyValue(const PackView& index, IDataReader& reader, uint8_t* space) {
+static bool FillKeyValue(const PackView& index, IDataReader& reader, uint8_t* space, const V96* ids) {
 	Assert(index.key_len != 0);
 	const auto total = reader.total();
 	auto fill_line = [&index](const Record& rec, uint8_t* line)->bool {
@@ -961,70 +1567,194 @@ static bool FillKeyValue(const PackView& index, IDataReader& reader, uint8_t* sp
 		}
 		return true;
 	};
+	auto find_pos = [&index, ids](const Record& rec, size_t i)->uint64_t {
+		return ids != nullptr? CalcPos(index, ids[i]) : CalcPos(index, rec.key.ptr, index.key_len);
+	};
+	//split layout takes key and value apart when writing to space
+	const bool split = index.layout & LAYOUT_SPLIT_KV;
 	reader.reset();
 	if (index.line_size <= DOUBLE_COPY_LINE_SIZE_LIMIT) {
 		try {
 			BatchDataMapping(index, space, total,
-					[&reader, &fill_line, &index](uint8_t* buf) {
-						auto rec = reader.read(index.val_len==0);
-						if (rec.key.len != index.key_len || !fill_line(rec, buf)) {
+					[&reader, &fill_line, &index](uint8_t* buf, unsigned n) {
+						if (!ReadRecords(reader, n, index.val_len==0,
+								[buf, &fill_line, &index](const Record& rec, size_t i)->bool {
+									return rec.key.len == index.key_len
+										&& fill_line(rec, buf + i*index.line_size);
+								})) {
 							throw BuildException();
 						}
-					});
+					}, ids);
 		} catch (const BuildException&) {
 			return false;
 		}
-	} else {
-		for (size_t i = 0; i < total; i++) {
-			auto rec = reader.read(index.val_len==0);
-			if (rec.key.len != index.key_len
-				|| !fill_line(rec, FindLine(space, index, rec.key.ptr))) {
+	} else if (split) {
+		const auto values = space + SplitValueOffset(index.item, index.key_len);
+		return ReadRecords(reader, total, false, [space, values, &index, &find_pos](const Record& rec, size_t i)->bool {
+			if (rec.key.len != index.key_len || rec.val.ptr == nullptr || rec.val.len != index.val_len) {
 				return false;
 			}
-		}
+			const auto pos = find_pos(rec, i);
+			Assign(space + pos*index.key_len, rec.key.ptr, index.key_len);
+			memcpy(values + pos*index.val_len, rec.val.ptr, index.val_len);
+			return true;
+		});
+	} else {
+		return ReadRecords(reader, total, index.val_len==0,
+						   [space, &fill_line, &index, &find_pos](const Record& rec, size_t i)->bool {
+			return rec.key.len == index.key_len && fill_line(rec, space + find_pos(rec, i)*index.line_size);
+		});
 	}
 	return true;
 }
 
-static BuildStatus FillInlineKeyValue(const PackView& index, const DataReaders& in, IDataWriter& out) {
+//with ids, keys are not read again
+static bool FillFingerprint(const PackView& index, IDataReader& reader, uint8_t* space, const V96* ids) {
+	Assert(index.key_len != 0 && IsFingerprintSize(index.line_size));
+	if (ids == nullptr) {
+		reader.reset();
+	}
+	try {
+		BatchFingerprintMapping(index, space, reader.total(),
+				[&reader, &index](uint8_t* buf, unsigned n) {
+					ReadKeys(reader, index.key_len, buf, n);
+				}, ids);
+	} catch (const BuildException&) {
+		return false;
+	}
+	return true;
+}
+
+//Wide lines of a large table are staged by coarse position first, then each
+//bucket is written out in position order with streaming stores. Lines of a
+//bucket fit in cache, so random access stays there and output is sequential.
+//It takes another copy of content, so it is done only within a memory budget.
+static constexpr size_t FILL_BUCKET_SIZE = 256U << 10U;
+static constexpr size_t STREAM_CHUNK = 16U << 10U;
+
+//stage holds all lines, slots keep position of each staged line within its bucket
+static BuildStatus FillSortedKeyValue(const PackView& index, const DataReaders& in, const std::vector<const V96*>& parts,
+									  uint8_t* stage, uint32_t* slots, uint8_t* space, unsigned workers) {
+	const size_t line_size = index.line_size;
+	const size_t width = std::max<size_t>(FILL_BUCKET_SIZE / line_size, 1U);
+	const size_t buckets = (index.item + width - 1U) / width;
+	std::vector<size_t> cursors(buckets);
+	for (size_t b = 0; b < buckets; b++) {
+		cursors[b] = b * width;
+	}
+
+	std::atomic<bool> fail{false};
+	RunTasks(std::min<size_t>(workers, in.size()), in.size(), [&](size_t i) {
+		auto& reader = *in[i];
+		const auto ids = parts[i];
+		reader.reset();
+		if (!ReadRecords(reader, reader.total(), index.val_len==0, [&](const Record& rec, size_t k)->bool {
+				if (rec.key.len != index.key_len
+					|| (index.val_len != 0 && (rec.val.ptr == nullptr || rec.val.len != index.val_len))) {
+					return false;
+				}
+				const auto pos = ids != nullptr? CalcPos(index, ids[k]) : CalcPos(index, rec.key.ptr, index.key_len);
+				if (pos >= index.item) {
+					return false;
+				}
+				const auto b = pos / width;
+				const auto slot = AddRelaxed(cursors[b], size_t{1});
+				if (slot >= std::min<size_t>((b+1U)*width, index.item)) {
+					return false;
+				}
+				auto line = stage + slot*line_size;
+				memcpy(line, rec.key.ptr, index.key_len);
+				if (index.val_len != 0) {
+					memcpy(line+index.key_len, rec.val.ptr, index.val_len);
+				}
+				slots[slot] = pos - b*width;
+				return true;
+			})) {
+			fail.store(true, std::memory_order_relaxed);
+		}
+	});
+	if (fail.load(std::memory_order_relaxed)) {
+		return BUILD_STATUS_BAD_INPUT;
+	}
+
+	RunTasks(std::min<size_t>(workers, buckets), buckets, [&](size_t b) {
+		const auto base = b * width;
+		const auto cnt = std::min<size_t>(width, index.item-base);
+		std::vector<uint32_t> order(cnt, UINT32_MAX);
+		for (size_t k = 0; k < cnt; k++) {
+			order[slots[base+k]] = k;
+		}
+		const auto batch = std::max<size_t>(STREAM_CHUNK / line_size, 1U);
+		auto chunk = std::make_unique<uint8_t[]>(batch*line_size);
+		auto dst = space + base*line_size;
+		for (size_t j = 0; j < cnt; ) {
+			const auto m = std::min(batch, cnt-j);
+			for (size_t k = 0; k < m; k++, j++) {
+				if (order[j] == UINT32_MAX) {
+					fail.store(true, std::memory_order_relaxed);
+					return;
+				}
+				memcpy(chunk.get()+k*line_size, stage+(base+order[j])*line_size, line_size);
+			}
+			StreamCopy(dst, chunk.get(), m*line_size);
+			dst += m*line_size;
+		}
+		StreamFence();
+	});
+	return fail.load(std::memory_order_relaxed)? BUILD_STATUS_BAD_INPUT : BUILD_STATUS_OK;
+}
+
+static BuildStatus FillInlineKeyValue(const PackView& index, const DataReaders& in, IDataWriter& out,
+									  BuildObserver* observer, const FillHints& hints) {
+	const auto ids = hints.ids;
+	const auto fill = index.type == Type::FINGERPRINT_SET? FillFingerprint : FillKeyValue;
 	const auto total = SumInputSize(in);
 	Assert(!in.empty() && total > 0);
-	ALLOC_MEM_BLOCK(space, total*index.line_size);
+	std::vector<const V96*> parts(in.size(), nullptr);
+	for (size_t i = 0, off = 0; ids != nullptr && i < in.size(); i++) {
+		parts[i] = ids + off;
+		off += in[i]->total();
+	}
+	ContentSpace space(out, (index.layout & LAYOUT_SPLIT_KV)?
+		SplitValueOffset(total, index.key_len) + total*index.val_len : total*index.line_size, hints.in_place);
 
 	auto spot1 = std::chrono::steady_clock::now();
-	if (in.size() == 1 || total < 4096U * in.size()) {
-		for (auto& reader : in) {
-			if (!FillKeyValue(index, *reader, space.addr())) {
+	MemBlock stage, slots;
+	if (hints.stage) {	//planned within budget, lines are scattered directly if allocation fails
+		stage = MemBlock(total*index.line_size);
+		slots = MemBlock(total*sizeof(uint32_t));
+	}
+	if (stage.addr() != nullptr && slots.addr() != nullptr) {
+		const auto status = FillSortedKeyValue(index, in, parts, stage.addr(), (uint32_t*)slots.addr(),
+											   space.addr(), hints.workers);
+		if (status != BUILD_STATUS_OK) {
+			return status;
+		}
+		stage = MemBlock{};
+	} else if (in.size() == 1 || hints.workers <= 1 || total < 4096U * in.size()) {
+		for (size_t i = 0; i < in.size(); i++) {
+			if (!fill(index, *in[i], space.addr(), parts[i])) {
 				return BUILD_STATUS_BAD_INPUT;
 			}
 		}
 	} else {
-		std::vector<std::thread> threads;
-		threads.reserve(in.size());
 		std::atomic<bool> fail{false};
-		for (auto& reader : in) {
-			threads.emplace_back([&fail, &space, &index](IDataReader* reader) {
-				if (!FillKeyValue(index, *reader, space.addr())) {
-					fail.store(true, std::memory_order_relaxed);
-				}
-			}, reader.get());
-		}
-		for (auto& t : threads) {
-			t.join();
-		}
+		RunTasks(hints.workers, in.size(),
+				 [&fail, &space, &index, &in, &parts, fill](size_t i) {
+					 if (!fill(index, *in[i], space.addr(), parts[i])) {
+						 fail.store(true, std::memory_order_relaxed);
+					 }
+				 });
 		if (fail.load(std::memory_order_relaxed)) {
 			return BUILD_STATUS_BAD_INPUT;
 		}
 	}
 	auto spot2 = std::chrono::steady_clock::now();
-	if (!out.write(space.addr(), space.size())) {
+	if (!space.dump()) {
 		return BUILD_STATUS_FAIL_TO_OUTPUT;
 	}
-	auto spot3 = std::chrono::steady_clock::now();
-	if (g_trace_build_time) {
-		Logger::Printf("fill: %.3fs\n", DurationS(spot1, spot2));
-		Logger::Printf("dump: %.3fs\n", DurationS(spot2, spot3));
-	}
+	ReportPhase(observer, PHASE_FILL, spot1, spot2);
+	ReportPhase(observer, PHASE_DUMP, spot2, std::chrono::steady_clock::now());
 	return BUILD_STATUS_OK;
 }
 
@@ -1036,24 +1766,121 @@ static unsigned VarIntSize(size_t n) {
 	}
 	return cnt;
 }
-static bool WriteVarInt(size_t n, IDataWriter& out) {
-	uint8_t buf[10];
+static unsigned PutVarInt(size_t n, uint8_t buf[]) {
 	unsigned w = 0;
 	while ((n & ~0x7fULL) != 0) {
 		buf[w++] = 0x80ULL | (n & 0x7fULL);
 		n >>= 7U;
 	}
 	buf[w++] = n;
-	return out.write(buf, w);
+	return w;
+}
+static bool WriteVarInt(size_t n, IDataWriter& out) {
+	uint8_t buf[10];
+	return out.write(buf, PutVarInt(n, buf));
 }
 
-static BuildStatus FillSeparatedKeyValue(const PackView& index, const DataReaders& in, IDataWriter& out) {
-	const auto total = SumInputSize(in);
-	Assert(total> 0 && index.key_len != 0 && index.line_size == index.key_len + OFFSET_FIELD_SIZE);
-	ALLOC_MEM_BLOCK(space, total*index.line_size)
+//offsets in lines address the raw stream, it is the same with blocks
+static BuildStatus DumpSeparatedValues(const DataReaders& in, IDataWriter& out, IndexLayout layout) {
+	std::unique_ptr<BlockWriter> blocks;
+	if (layout & LAYOUT_COMPRESS_VALUE) {
+		blocks = std::make_unique<BlockWriter>(out);
+	}
+	IDataWriter& vout = blocks != nullptr? *blocks : out;
+	for (auto& reader : in) {
+		reader->reset();
+		if (!ReadRecords(*reader, reader->total(), false, [&vout](const Record& rec, size_t)->bool {
+				return WriteVarInt(rec.val.len, vout) && (rec.val.len == 0 || vout.write(rec.val.ptr, rec.val.len));
+			})) {
+			return BUILD_STATUS_FAIL_TO_OUTPUT;
+		}
+	}
+	if (blocks != nullptr && !blocks->finish()) {
+		return BUILD_STATUS_FAIL_TO_OUTPUT;
+	}
+	return BUILD_STATUS_OK;
+}
+
+//values of a reader take a continuous range, it starts after all readers before
+static BuildStatus SumValueSpace(const DataReaders& in, std::vector<size_t>& bases, unsigned workers) {
+	std::vector<size_t> sizes(in.size(), 0);
+	std::atomic<bool> fail{false};
+	RunTasks(workers, in.size(), [&in, &sizes, &fail](size_t i) {
+		auto& reader = *in[i];
+		reader.reset();
+		size_t sum = 0;
+		if (!ReadRecords(reader, reader.total(), false, [&sum](const Record& rec, size_t)->bool {
+				if (rec.val.len > MAX_VALUE_LEN || (rec.val.len != 0 && rec.val.ptr == nullptr)) {
+					return false;
+				}
+				sum += VarIntSize(rec.val.len) + rec.val.len;
+				return true;
+			})) {
+			fail.store(true, std::memory_order_relaxed);
+			return;
+		}
+		sizes[i] = sum;
+	});
+	if (fail.load(std::memory_order_relaxed)) {
+		return BUILD_STATUS_BAD_INPUT;
+	}
+	bases.resize(in.size()+1);
+	size_t off = 0;
+	for (unsigned i = 0; i < in.size(); i++) {
+		bases[i] = off;
+		off += sizes[i];
+	}
+	bases.back() = off;
+	return BUILD_STATUS_OK;
+}
 
+//Values of each reader go straight to their place in a reserved region.
+//Writes are gathered in a large buffer, a value larger than it goes alone.
+static BuildStatus DumpSeparatedValuesAt(const DataReaders& in, IDataWriter& out, size_t base,
+										 const std::vector<size_t>& bases, unsigned workers) {
+	constexpr size_t BUFFER_SIZE = 4U << 20U;
+	std::atomic<bool> fail{false};
+	RunTasks(workers, in.size(), [&in, &out, base, &bases, &fail](size_t i) {
+		auto buf = std::make_unique<uint8_t[]>(BUFFER_SIZE);
+		size_t used = 0;
+		size_t offset = base + bases[i];
+		auto dump = [&out, &buf, &used, &offset]()->bool {
+			if (used != 0 && !out.write_at(offset, buf.get(), used)) {
+				return false;
+			}
+			offset += used;
+			used = 0;
+			return true;
+		};
+		auto& reader = *in[i];
+		reader.reset();
+		auto put = [&out, &buf, &used, &offset, &dump, &fail](const Record& rec, size_t)->bool {
+			const auto& val = rec.val;
+			const auto mark = VarIntSize(val.len);
+			if (fail.load(std::memory_order_relaxed) || (used + mark + val.len > BUFFER_SIZE && !dump())) {
+				return false;
+			}
+			used += PutVarInt(val.len, buf.get()+used);
+			if (used + val.len <= BUFFER_SIZE) {
+				memcpy(buf.get()+used, val.ptr, val.len);
+				used += val.len;
+			} else if (!dump() || !out.write_at(offset, val.ptr, val.len)) {
+				return false;
+			} else {
+				offset += val.len;
+			}
+			return true;
+		};
+		if (!ReadRecords(reader, reader.total(), false, put) || !dump()) {
+			fail.store(true, std::memory_order_relaxed);
+		}
+	});
+	return fail.load(std::memory_order_relaxed)? BUILD_STATUS_FAIL_TO_OUTPUT : BUILD_STATUS_OK;
+}
+
+static BuildStatus FillSeparatedLines(const PackView& index, IDataReader& reader, uint8_t* space, size_t offset,
+									  const V96* ids) {
 	const auto key_len = index.key_len;
-	size_t offset = 0;
 	auto fill_line = [key_len, &offset](const Record& rec, uint8_t* line)->bool {
 		Assign(line, rec.key.ptr, key_len);
 		if (offset > MAX_OFFSET) {
@@ -1066,69 +1893,930 @@ static BuildStatus FillSeparatedKeyValue(const PackView& index, const DataReader
 		offset += VarIntSize(rec.val.len) + rec.val.len;
 		return true;
 	};
+	reader.reset();
+	auto cnt = reader.total();
+	if (index.line_size <= DOUBLE_COPY_LINE_SIZE_LIMIT) {
+		try {
+			BatchDataMapping(index, space, cnt,
+							 [&reader, &fill_line, &index](uint8_t* buf, unsigned n) {
+								 if (!ReadRecords(reader, n, false,
+										 [buf, &fill_line, &index](const Record& rec, size_t i)->bool {
+											 return rec.key.len == index.key_len
+												 && fill_line(rec, buf + i*index.line_size);
+										 })) {
+									 throw BuildException();
+								 }
+							 }, ids);
+		} catch (const BuildException&) {
+			return offset > MAX_OFFSET? BUILD_STATUS_FAIL_TO_OUTPUT : BUILD_STATUS_BAD_INPUT;
+		}
+	} else if (!ReadRecords(reader, cnt, false, [space, &fill_line, &index, ids](const Record& rec, size_t i)->bool {
+					if (rec.key.len != index.key_len) {
+						return false;
+					}
+					auto line = ids != nullptr? space + CalcPos(index, ids[i])*index.line_size
+						: FindLine(space, index, rec.key.ptr);
+					return fill_line(rec, line);
+				})) {
+		return offset > MAX_OFFSET? BUILD_STATUS_FAIL_TO_OUTPUT : BUILD_STATUS_BAD_INPUT;
+	}
+	return BUILD_STATUS_OK;
+}
+
+//Value offsets are summed up per reader first, then readers fill lines in parallel.
+static BuildStatus FillSeparatedKeyValue(const PackView& index, const DataReaders& in, IDataWriter& out,
+										 BuildObserver* observer, const FillHints& hints) {
+	const auto ids = hints.ids;
+	const auto total = SumInputSize(in);
+	Assert(total> 0 && index.key_len != 0 && index.line_size == index.key_len + OFFSET_FIELD_SIZE);
+	const unsigned workers = (in.size() == 1 || total < 4096U * in.size())? 1U : hints.workers;
+
+	auto spot1 = std::chrono::steady_clock::now();
+	std::vector<size_t> bases;
+	auto status = SumValueSpace(in, bases, workers);
+	if (status != BUILD_STATUS_OK) {
+		return status;
+	}
+	ContentSpace space(out, total*index.line_size, hints.in_place);
+	std::vector<BuildStatus> part_status(in.size(), BUILD_STATUS_OK);
+	std::vector<const V96*> parts(in.size(), nullptr);
+	for (size_t i = 0, off = 0; ids != nullptr && i < in.size(); i++) {
+		parts[i] = ids + off;
+		off += in[i]->total();
+	}
+	RunTasks(workers, in.size(), [&index, &in, &space, &bases, &parts, &part_status](size_t i) {
+		part_status[i] = FillSeparatedLines(index, *in[i], space.addr(), bases[i], parts[i]);
+	});
+	for (auto part : part_status) {
+		if (part != BUILD_STATUS_OK) {
+			return part;
+		}
+	}
+	auto spot2 = std::chrono::steady_clock::now();
+	if (!space.dump()) {
+		return BUILD_STATUS_FAIL_TO_OUTPUT;
+	}
+	size_t base = SIZE_MAX;
+	if (in.size() > 1 && !(index.layout & LAYOUT_COMPRESS_VALUE)) {
+		base = out.reserve(bases.back());
+	}
+	if (base != SIZE_MAX) {
+		status = DumpSeparatedValuesAt(in, out, base, bases, workers);
+	} else {
+		status = DumpSeparatedValues(in, out, index.layout);
+	}
+	if (status != BUILD_STATUS_OK) {
+		return status;
+	}
+	ReportPhase(observer, PHASE_FILL, spot1, spot2);
+	ReportPhase(observer, PHASE_DUMP, spot2, std::chrono::steady_clock::now());
+	return BUILD_STATUS_OK;
+}
+
+//Keys go to the arena in input order, a line only keeps where its key is.
+static BuildStatus FillVarKeyValue(const PackView& index, const DataReaders& in, IDataWriter& out,
+								   BuildObserver* observer, const FillHints& hints) {
+	const auto total = SumInputSize(in);
+	Assert(total > 0 && index.key_len == KEY_REF_SIZE);
+	ContentSpace space(out, total*index.line_size, hints.in_place);
+
+	const bool separated = index.type == Type::KV_SEPARATED;
+	std::vector<uint8_t> arena;
+	size_t offset = 0;	//of separated value
 
 	auto spot1 = std::chrono::steady_clock::now();
 	for (auto& reader : in) {
 		reader->reset();
 		auto cnt = reader->total();
-		if (index.line_size <= DOUBLE_COPY_LINE_SIZE_LIMIT) {
-			try {
-				BatchDataMapping(index, space.addr(), cnt,
-								 [&reader, &fill_line, key_len](uint8_t* buf) {
-									 auto rec = reader->read(false);
-									 if (rec.key.len != key_len || !fill_line(rec, buf)) {
-										 throw BuildException();
-									 }
-								 });
-			} catch (const BuildException&) {
-				return offset > MAX_OFFSET? BUILD_STATUS_FAIL_TO_OUTPUT : BUILD_STATUS_BAD_INPUT;
+		for (size_t i = 0; i < cnt; i++) {
+			auto rec = reader->read(index.val_len == 0);
+			if (rec.key.ptr == nullptr || rec.key.len == 0 || rec.key.len > MAX_KEY_LEN) {
+				return BUILD_STATUS_BAD_INPUT;
 			}
-		} else {
-			for (size_t i = 0; i < cnt; i++) {
-				auto rec = reader->read(false);
-				if (rec.key.len != key_len
-					|| !fill_line(rec, FindLine(space.addr(), index, rec.key.ptr))) {
-					return offset > MAX_OFFSET? BUILD_STATUS_FAIL_TO_OUTPUT : BUILD_STATUS_BAD_INPUT;
+			if (arena.size() + rec.key.len > MAX_KEY_ARENA) {
+				return BUILD_STATUS_FAIL_TO_OUTPUT;
+			}
+			const auto id = GenID(index.seed, rec.key.ptr, rec.key.len);
+			auto line = space.addr() + CalcPos(index, id)*index.line_size;
+			WriteKeyRef(line, {arena.size(), (uint8_t)rec.key.len, KeyTag(id)});
+			arena.insert(arena.end(), rec.key.ptr, rec.key.ptr+rec.key.len);
+			auto field = line + KEY_REF_SIZE;
+			if (separated) {
+				if (offset > MAX_OFFSET) {
+					return BUILD_STATUS_FAIL_TO_OUTPUT;
+				}
+				if (rec.val.len > MAX_VALUE_LEN || (rec.val.len != 0 && rec.val.ptr == nullptr)) {
+					return BUILD_STATUS_BAD_INPUT;
+				}
+				WriteOffsetField(field, offset);
+				offset += VarIntSize(rec.val.len) + rec.val.len;
+			} else if (index.val_len != 0) {
+				if (rec.val.ptr == nullptr || rec.val.len != index.val_len) {
+					return BUILD_STATUS_BAD_INPUT;
 				}
+				memcpy(field, rec.val.ptr, index.val_len);
 			}
 		}
 	}
 	auto spot2 = std::chrono::steady_clock::now();
-	if (!out.write(space.addr(), space.size())) {
+	const uint64_t arena_size = arena.size();
+	if (!space.dump() || !out.write(&arena_size, sizeof(arena_size))
+		|| !out.write(arena.data(), arena.size())) {
 		return BUILD_STATUS_FAIL_TO_OUTPUT;
 	}
-	space = MemBlock{};
-	auto spot3 = std::chrono::steady_clock::now();
+	arena = std::vector<uint8_t>();
+	if (separated) {
+		const auto status = DumpSeparatedValues(in, out, index.layout);
+		if (status != BUILD_STATUS_OK) {
+			return status;
+		}
+	}
+	ReportPhase(observer, PHASE_FILL, spot1, spot2);
+	ReportPhase(observer, PHASE_DUMP, spot2, std::chrono::steady_clock::now());
+	return BUILD_STATUS_OK;
+}
+
+static BuildStatus FillContent(const PackView& index, const DataReaders& in, IDataWriter& out,
+							   BuildObserver* observer, const FillHints& hints) {
+	if (index.layout & LAYOUT_VAR_KEY) {
+		return FillVarKeyValue(index, in, out, observer, hints);
+	} else if (index.type == Type::KV_SEPARATED) {
+		return FillSeparatedKeyValue(index, in, out, observer, hints);
+	} else {
+		return FillInlineKeyValue(index, in, out, observer, hints);
+	}
+}
+
+
+//Spilling build works segment by segment. Id and line of each record are
+//spilled into the file of its segment first, then segments are built one at
+//a time with their index pieces spilled too. At last lines of each segment
+//are placed in a buffer of that segment and written out in order.
+
+//Temporary file written in sequence and read back from start, removed when closed.
+class SpillFile {
+public:
+	SpillFile() = default;
+	SpillFile(const SpillFile&) = delete;
+	SpillFile& operator=(const SpillFile&) = delete;
+	~SpillFile() noexcept { close(); }
+
+	bool open(const std::string& path) {
+		close();
+		m_file = std::fopen(path.c_str(), "w+b");
+		if (m_file == nullptr) {
+			return false;
+		}
+		m_path = path;
+		std::setvbuf(m_file, nullptr, _IOFBF, BUFFER_SIZE);
+		return true;
+	}
+	bool write(const void* data, size_t n) {
+		return n == 0 || std::fwrite(data, 1, n, m_file) == n;
+	}
+	bool rewind() {
+		return std::fseek(m_file, 0, SEEK_SET) == 0;
+	}
+	bool read(void* data, size_t n) {
+		return n == 0 || std::fread(data, 1, n, m_file) == n;
+	}
+	void close() noexcept {
+		if (m_file != nullptr) {
+			std::fclose(m_file);
+			std::remove(m_path.c_str());
+			m_file = nullptr;
+		}
+	}
+
+private:
+	static constexpr size_t BUFFER_SIZE = 64U*1024U;
+	std::FILE* m_file = nullptr;
+	std::string m_path;
+};
+
+static constexpr size_t SPILL_CHUNK = 1U << 20U;
+#ifdef NDEBUG
+static constexpr size_t MIN_SPILL_SEGMENT = 1024U;
+#else
+static constexpr size_t MIN_SPILL_SEGMENT = 32U;
+#endif
+
+//Visit cnt records of rec_size bytes from start of the file. With more than
+//one worker, batches are read in turn and visited at once, in any order.
+template <typename Visit>
+static bool ScanSpill(SpillFile& file, size_t cnt, size_t rec_size, const Visit& visit, unsigned workers=1) {
+	const size_t batch = std::max<size_t>(1U, SPILL_CHUNK / rec_size);
+	if (!file.rewind()) {
+		return false;
+	}
+	const size_t buf_size = std::min(batch, cnt) * rec_size;
+	const unsigned n = std::min<size_t>(workers, (cnt + batch - 1U) / batch);
+	std::mutex lock;
+	std::atomic<bool> fail{false};
+	RunTasks(n, n, [&](size_t) {
+		auto buf = std::make_unique<uint8_t[]>(buf_size);
+		for (;;) {
+			size_t m;
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				m = std::min(batch, cnt);
+				if (m == 0 || fail.load(std::memory_order_relaxed)) {
+					return;
+				}
+				if (!file.read(buf.get(), m*rec_size)) {
+					fail.store(true, std::memory_order_relaxed);
+					return;
+				}
+				cnt -= m;
+			}
+			for (size_t i = 0; i < m; i++) {
+				visit(buf.get() + i*rec_size);
+			}
+		}
+	});
+	return !fail.load(std::memory_order_relaxed);
+}
 
+static bool CopySpill(SpillFile& file, size_t n, IDataWriter& out, uint8_t buf[]) {
+	while (n != 0) {
+		const auto m = std::min(n, SPILL_CHUNK);
+		if (!file.read(buf, m) || !out.write(buf, m)) {
+			return false;
+		}
+		n -= m;
+	}
+	return true;
+}
+
+//segments are made as many as the budget needs, but not too small to be empty
+//memory of a record when its segment is built or filled
+static size_t SpillKeyMemory(size_t line_size, bool use_extra_mem) {
+	return std::max<size_t>(sizeof(V96)*(use_extra_mem?2U:1U) + 4U, line_size + 2U);
+}
+
+static uint32_t SpillSegments(size_t total, size_t line_size, bool use_extra_mem, size_t budget) {
+	const size_t per_key = SpillKeyMemory(line_size, use_extra_mem);
+	const size_t limit = std::min<size_t>(MAX_SEGMENT, std::max<size_t>(1U, total / MIN_SPILL_SEGMENT));
+	size_t n = budget == 0? 1U : (total*per_key + budget - 1U) / budget;
+	if (n > limit) {
+		if (budget != 0 && limit == MAX_SEGMENT) {
+			Logger::Printf("memory budget is too small, use %u segments\n", MAX_SEGMENT);
+		}
+		n = limit;
+	}
+	//leave room for skew, a segment should not exceed UINT32_MAX
+	return std::max<size_t>(n, (total >> 31U) + 1U);
+}
+
+struct SpillContext {
+	const BasicInfo& info;
+	const DataReaders& in;
+	bool use_extra_mem;
+	uint32_t key_len;	//of line
+	uint32_t line_size;
+	uint32_t rec_size;	//id, line and reader if offsets are counted in it
+	unsigned workers;
+	std::string prefix;
+	std::unique_ptr<SpillFile[]> segments;
+	SpillFile cells;
+	SpillFile sections;
+	uint64_t arena_size = 0;
+	std::vector<uint64_t> arena_bases;	//of readers, with LAYOUT_VAR_KEY
+	std::vector<uint64_t> value_bases;	//of readers, with KV_SEPARATED
+	BuildObserver* observer = nullptr;
+
+	bool open(uint32_t n) {
+		segments = std::make_unique<SpillFile[]>(n);
+		for (uint32_t i = 0; i < n; i++) {
+			if (!segments[i].open(prefix + std::to_string(i))) {
+				return false;
+			}
+		}
+		return cells.open(prefix + "cells") && sections.open(prefix + "sections");
+	}
+};
+
+//offsets in the key arena and of separated values follow input order
+static bool SpillWithReader(const BasicInfo& info) {
+	return (info.layout & LAYOUT_VAR_KEY) || info.type == Type::KV_SEPARATED;
+}
+
+//Spill id and line of every record into the file of its segment. Readers are
+//consumed as a queue of chunks like GenIDs, records of a chunk are copied out
+//under the lock of their reader, then hashed and spilled by segment outside.
+//Arena and value offsets are counted within each reader, bases of readers are
+//added when lines are filled.
+static BuildStatus SpillRecords(SpillContext& ctx, uint32_t seed, std::vector<IndexPiece>& pieces) {
+	struct Cursor {
+		std::mutex lock;
+		size_t done = 0;
+		uint64_t arena = 0;
+		size_t offset = 0;
+		size_t last = 0;	//offset of the last value
+	};
+	const auto& info = ctx.info;
+	const auto& in = ctx.in;
+	const uint32_t n = pieces.size();
+	auto cursors = std::make_unique<Cursor[]>(in.size());
+	auto locks = std::make_unique<std::mutex[]>(n);
+	std::vector<size_t> counts(n, 0);
 	for (auto& reader : in) {
 		reader->reset();
-		auto cnt = reader->total();
-		for (size_t i = 0; i < cnt; i++) {
-			auto val = reader->read(false).val;
-			if (!WriteVarInt(val.len, out) ||
-				(val.len != 0 && !out.write(val.ptr, val.len))) {
-				return BUILD_STATUS_FAIL_TO_OUTPUT;
+	}
+	std::atomic<bool> bad_input{false};
+	std::atomic<bool> fail_to_output{false};
+	RunTasks(ctx.workers, ctx.workers, [&](size_t self) {
+		const Divisor<uint16_t> l0sz(n);
+		const bool var_key = info.layout & LAYOUT_VAR_KEY;
+		const bool separated = info.type == Type::KV_SEPARATED;
+		const bool key_only = info.type != Type::KV_INLINE && !separated;
+		const size_t rec_size = ctx.rec_size;
+		const size_t line_size = ctx.line_size;
+		const uint32_t key_len = ctx.key_len;
+		auto keys = std::make_unique<uint8_t[]>(GEN_ID_CHUNK*MAX_KEY_LEN);
+		auto msgs = std::make_unique<const uint8_t*[]>(GEN_ID_CHUNK);
+		auto codes = std::make_unique<V128[]>(GEN_ID_CHUNK);
+		auto recs = std::make_unique<uint8_t[]>(GEN_ID_CHUNK*rec_size);
+		auto sorted = std::make_unique<uint8_t[]>(GEN_ID_CHUNK*rec_size);
+		uint64_t arena[GEN_ID_CHUNK];
+		uint16_t segs[GEN_ID_CHUNK];
+		uint8_t lens[GEN_ID_CHUNK];
+		std::vector<uint32_t> heads(n+1);
+		for (size_t i = 0; i < GEN_ID_CHUNK; i++) {
+			msgs[i] = keys.get()+i*MAX_KEY_LEN;
+		}
+		unsigned r = self % in.size();
+		for (unsigned idle = 0; idle < in.size(); ) {
+			if (bad_input.load(std::memory_order_relaxed) || fail_to_output.load(std::memory_order_relaxed)) {
+				return;
+			}
+			auto& cur = cursors[r];
+			size_t m;
+			{
+				std::lock_guard<std::mutex> guard(cur.lock);
+				auto& reader = *in[r];
+				m = std::min(GEN_ID_CHUNK, reader.total() - cur.done);
+				cur.done += m;
+				bool too_large = false;
+				if (!ReadRecords(reader, m, key_only, [&](const Record& rec, size_t i)->bool {
+						if (rec.key.ptr == nullptr || rec.key.len == 0 || rec.key.len > MAX_KEY_LEN
+							|| (info.key_len != 0 && rec.key.len != info.key_len)) {
+							return false;
+						}
+						lens[i] = rec.key.len;
+						memcpy(keys.get()+i*MAX_KEY_LEN, rec.key.ptr, rec.key.len);
+						auto line = recs.get() + i*rec_size + sizeof(V96);
+						if (info.type == Type::FINGERPRINT_SET || info.type == Type::INDEX_ONLY) {
+							return true;
+						}
+						if (var_key) {
+							if (cur.arena + rec.key.len > MAX_KEY_ARENA) {
+								too_large = true;
+								return false;
+							}
+							arena[i] = cur.arena;
+							cur.arena += rec.key.len;
+						} else {
+							memcpy(line, rec.key.ptr, key_len);
+						}
+						if (separated) {
+							if (rec.val.len > MAX_VALUE_LEN || (rec.val.len != 0 && rec.val.ptr == nullptr)) {
+								return false;
+							}
+							if (cur.offset > MAX_OFFSET) {
+								too_large = true;
+								return false;
+							}
+							WriteOffsetField(line+key_len, cur.offset);
+							cur.last = cur.offset;
+							cur.offset += VarIntSize(rec.val.len) + rec.val.len;
+						} else if (info.type == Type::KV_INLINE) {
+							if (rec.val.ptr == nullptr || rec.val.len != info.val_len) {
+								return false;
+							}
+							memcpy(line+key_len, rec.val.ptr, info.val_len);
+						}
+						return true;
+					})) {
+					(too_large? fail_to_output : bad_input).store(true, std::memory_order_relaxed);
+					return;
+				}
+			}
+			if (m == 0) {
+				idle++;
+				r = (r+1) % in.size();
+				continue;
+			}
+			idle = 0;
+			for (size_t i = 0; i < m; ) {	//keys of the same length are hashed in lanes
+				size_t k = i+1;
+				while (k < m && lens[k] == lens[i]) {
+					k++;
+				}
+				HashTo128(msgs.get()+i, k-i, lens[i], seed, codes.get()+i);
+				i = k;
+			}
+			std::fill(heads.begin(), heads.end(), 0);
+			for (size_t i = 0; i < m; i++) {
+				const auto id = ToID(codes[i]);
+				auto rec = recs.get() + i*rec_size;
+				auto line = rec + sizeof(V96);
+				memcpy(rec, &id, sizeof(V96));
+				if (info.type == Type::FINGERPRINT_SET) {
+					WriteFingerprint(line, Fingerprint(id), line_size);
+				} else if (var_key) {
+					WriteKeyRef(line, {arena[i], lens[i], KeyTag(id)});
+				}
+				if (rec_size != sizeof(V96) + line_size) {
+					const uint32_t tag = r;
+					memcpy(line+line_size, &tag, sizeof(tag));
+				}
+				segs[i] = L0Hash(id) % l0sz;
+				heads[segs[i]+1]++;
+			}
+			for (uint32_t j = 0; j < n; j++) {
+				heads[j+1] += heads[j];
+			}
+			for (size_t i = 0; i < m; i++) {
+				memcpy(sorted.get() + (heads[segs[i]]++)*rec_size, recs.get() + i*rec_size, rec_size);
+			}
+			//records of a segment are together now, each run goes out under its lock
+			for (uint32_t j = 0, begin = 0; begin < m; j++) {
+				const auto end = heads[j];
+				if (end == begin) {
+					continue;
+				}
+				std::lock_guard<std::mutex> guard(locks[j]);
+				if (!ctx.segments[j].write(sorted.get() + begin*rec_size, (end-begin)*rec_size)) {
+					fail_to_output.store(true, std::memory_order_relaxed);
+					return;
+				}
+				counts[j] += end - begin;
+				begin = end;
+			}
+		}
+	});
+	if (bad_input.load(std::memory_order_relaxed)) {
+		return BUILD_STATUS_BAD_INPUT;
+	}
+	if (fail_to_output.load(std::memory_order_relaxed)) {
+		return BUILD_STATUS_FAIL_TO_OUTPUT;
+	}
+	for (uint32_t i = 0; i < n; i++) {
+		if (counts[i] == 0 || counts[i] > UINT32_MAX) {
+			return BUILD_STATUS_BAD_INPUT;
+		}
+		pieces[i].size = counts[i];
+	}
+	ctx.arena_bases.assign(in.size(), 0);
+	ctx.value_bases.assign(in.size(), 0);
+	uint64_t arena_size = 0;
+	size_t offset = 0;
+	for (unsigned i = 0; i < in.size(); i++) {
+		ctx.arena_bases[i] = arena_size;
+		ctx.value_bases[i] = offset;
+		if (cursors[i].offset != 0 && offset + cursors[i].last > MAX_OFFSET) {
+			return BUILD_STATUS_FAIL_TO_OUTPUT;
+		}
+		arena_size += cursors[i].arena;
+		offset += cursors[i].offset;
+	}
+	if (arena_size > MAX_KEY_ARENA) {
+		return BUILD_STATUS_FAIL_TO_OUTPUT;
+	}
+	ctx.arena_size = arena_size;
+	return BUILD_STATUS_OK;
+}
+
+//build segments one by one, pieces are spilled and only their sizes are kept
+static BuildStatus SpillBuild(SpillContext& ctx, uint32_t seed, std::vector<IndexPiece>& pieces, Retry& retry) {
+	std::vector<SegmentStats> stats(pieces.size());
+	std::vector<uint32_t> built;
+	built.reserve(pieces.size());
+	for (uint32_t i = 0; i < pieces.size(); i++) {
+		auto& piece = pieces[i];
+		ALLOC_MEM_BLOCK(mem, piece.size*sizeof(V96)*(ctx.use_extra_mem?2U:1U))
+		auto ids = (V96*)mem.addr();
+		auto shadow = ctx.use_extra_mem? ids + piece.size : nullptr;
+		auto p = ids;
+		if (!ScanSpill(ctx.segments[i], piece.size, ctx.rec_size, [&p](const uint8_t* rec) {
+				memcpy(p++, rec, sizeof(V96));
+			})) {
+			return BUILD_STATUS_FAIL_TO_OUTPUT;
+		}
+		auto status = BuildSegment(ids, shadow, piece, ctx.info.layout, i, ctx.observer, stats[i]);
+		for (unsigned round = 1; status == BUILD_STATUS_OUT_OF_CHANCE && retry.total != 0; round++) {
+			retry.total--;
+			Logger::Printf("segment %u failed, retry with salt\n", i);
+			if (ctx.observer != nullptr) {
+				ctx.observer->on_retry(status, i);
+			}
+			const auto salt = SegmentSalt(seed, i, round);
+			ResaltIDs(ids, piece.size, piece.salt, salt);
+			piece.salt = salt;
+			status = BuildSegment(ids, shadow, piece, ctx.info.layout, i, ctx.observer, stats[i]);
+		}
+		built.push_back(i);
+		if (status != BUILD_STATUS_OK) {
+			ReportSegmentPhases(ctx.observer, stats, built);
+			return status;
+		}
+		const bool local = ctx.info.layout & LAYOUT_LOCAL_L2;
+		if (!ctx.cells.write(piece.cells.get(), L1Size(piece.size))
+			|| !ctx.sections.write(piece.sections.get(),
+								   SectionSize(piece.size, local) * (size_t)sizeof(BitmapSection))) {
+			return BUILD_STATUS_FAIL_TO_OUTPUT;
+		}
+		piece.cells.reset();
+		piece.sections.reset();
+	}
+	ReportSegmentPhases(ctx.observer, stats, built);
+	return BUILD_STATUS_OK;
+}
+
+//place lines of each segment with its piece loaded back
+static BuildStatus SpillFill(SpillContext& ctx, uint32_t seed, std::vector<IndexPiece>& pieces, IDataWriter& out) {
+	auto view = CreateIndexView(ctx.info, seed, pieces);
+	auto& index = *(PackView*)view.get();
+	const bool local = ctx.info.layout & LAYOUT_LOCAL_L2;
+	if (!ctx.cells.rewind() || !ctx.sections.rewind()) {
+		return BUILD_STATUS_FAIL_TO_OUTPUT;
+	}
+	for (uint32_t i = 0; i < pieces.size(); i++) {
+		auto& piece = pieces[i];
+		const auto sec_sz = SectionSize(piece.size, local);
+		piece.cells = std::make_unique<uint8_t[]>(L1Size(piece.size));
+		piece.sections = std::make_unique<BitmapSection[]>(sec_sz);
+		if (!ctx.cells.read(piece.cells.get(), L1Size(piece.size))
+			|| !ctx.sections.read(piece.sections.get(), sec_sz * (size_t)sizeof(BitmapSection))) {
+			return BUILD_STATUS_FAIL_TO_OUTPUT;
+		}
+		auto& seg = index.segments[i];
+		seg.cells = piece.cells.get();
+		seg.sections = piece.sections.get();
+
+		ContentSpace space(out, piece.size*(size_t)ctx.line_size, false);
+		const auto line_size = ctx.line_size;
+		const auto key_len = ctx.key_len;
+		const bool var_key = ctx.info.layout & LAYOUT_VAR_KEY;
+		const bool separated = ctx.info.type == Type::KV_SEPARATED;
+		auto base = seg.offset;
+		auto size = piece.size;
+		if (!ScanSpill(ctx.segments[i], piece.size, ctx.rec_size,
+				[&index, &space, &ctx, line_size, key_len, var_key, separated, base, size](const uint8_t* rec) {
+					V96 id;
+					memcpy(&id, rec, sizeof(V96));
+					const auto pos = CalcPos(index, id) - base;
+					Assert(pos < size);
+					auto line = space.addr() + pos*line_size;
+					memcpy(line, rec + sizeof(V96), line_size);
+					if (!var_key && !separated) {
+						return;
+					}
+					uint32_t r;
+					memcpy(&r, rec + sizeof(V96) + line_size, sizeof(r));
+					if (var_key) {
+						auto ref = ReadKeyRef(line);
+						ref.offset += ctx.arena_bases[r];
+						WriteKeyRef(line, ref);
+					}
+					if (separated) {
+						WriteOffsetField(line+key_len, ReadOffsetField(line+key_len) + ctx.value_bases[r]);
+					}
+				}, ctx.workers)
+			|| !space.dump()) {
+			return BUILD_STATUS_FAIL_TO_OUTPUT;
+		}
+		ctx.segments[i].close();
+		seg.cells = nullptr;
+		seg.sections = nullptr;
+		piece.cells.reset();
+		piece.sections.reset();
+	}
+	if (ctx.info.layout & LAYOUT_VAR_KEY) {
+		const uint64_t arena_size = ctx.arena_size;
+		if (!out.write(&arena_size, sizeof(arena_size))) {
+			return BUILD_STATUS_FAIL_TO_OUTPUT;
+		}
+		for (auto& reader : ctx.in) {
+			reader->reset();
+			auto cnt = reader->total();
+			for (size_t i = 0; i < cnt; i++) {
+				auto key = reader->read(true).key;
+				if (!out.write(key.ptr, key.len)) {
+					return BUILD_STATUS_FAIL_TO_OUTPUT;
+				}
 			}
 		}
 	}
+	if (ctx.info.type == Type::KV_SEPARATED) {
+		return DumpSeparatedValues(ctx.in, out, ctx.info.layout);
+	}
+	return BUILD_STATUS_OK;
+}
+
+static BuildStatus SpillBuildAndDump(const DataReaders& in, IDataWriter& out, const BasicInfo& info,
+									 Header& header, const BuildOptions& options, BuildObserver* observer) {
+	if (info.layout & LAYOUT_SPLIT_KV) {
+		return BUILD_STATUS_BAD_INPUT;
+	}
+	const size_t total = SumInputSize(in);
+	const uint32_t key_len = (info.layout & LAYOUT_VAR_KEY)? KEY_REF_SIZE : info.key_len;
+	const auto line_size = LineSize(info.type, key_len, info.val_len);
+	SpillContext ctx = {info, in, options.use_extra_mem, key_len, line_size,
+						(uint32_t)(sizeof(V96) + line_size + (SpillWithReader(info)? sizeof(uint32_t) : 0)),
+						BuildWorkers(options)};
+	const auto n = options.segments != 0? SegmentCount(total, options.segments)
+		: SpillSegments(total, line_size, ctx.use_extra_mem, options.memory_budget);
+	if (n > MAX_SEGMENT) {
+		return BUILD_STATUS_BAD_INPUT;
+	}
+	MemoryPlan mem_plan;
+	mem_plan.strategy = STRATEGY_SPILL;
+	mem_plan.peak = SpillKeyMemory(line_size, ctx.use_extra_mem) * ((total + n - 1U) / n);
+	if (options.memory_budget != 0 && mem_plan.peak > options.memory_budget) {
+		Logger::Printf("memory budget is too small, %llu bytes needed at least\n",
+					   (unsigned long long)mem_plan.peak);
+		return BUILD_STATUS_OUT_OF_MEMORY;
+	}
+	if (observer != nullptr) {
+		observer->on_plan(mem_plan);
+	}
+	char tag[24];
+	snprintf(tag, sizeof(tag), "%016llx", (unsigned long long)GetSeed());
+	ctx.prefix = options.spill_dir + "/shd-" + tag + "-";
+	ctx.observer = observer;
+
+	auto retry = options.retry;
+	SeedSequence seeds(options.seeds);
+	std::vector<IndexPiece> pieces;
+	for (;;) {
+		header.seed = seeds.next();
+		pieces.clear();
+		pieces.resize(n);
+		if (!ctx.open(n)) {
+			return BUILD_STATUS_FAIL_TO_OUTPUT;
+		}
+		auto spot1 = std::chrono::steady_clock::now();
+		auto status = SpillRecords(ctx, header.seed, pieces);
+		auto spot2 = std::chrono::steady_clock::now();
+		if (status == BUILD_STATUS_OK) {
+			status = SpillBuild(ctx, header.seed, pieces, retry);
+		}
+		ReportPhase(observer, PHASE_SPILL, spot1, spot2);
+		ReportPhase(observer, PHASE_BUILD, spot2, std::chrono::steady_clock::now());
+		if (status == BUILD_STATUS_OK) {
+			break;
+		}
+		if (!ShouldRetry(status, retry, observer)) {
+			return status;
+		}
+	}
+	header.seg_cnt = n;
+	std::vector<uint8_t> buf(SPILL_CHUNK);
+	if (!ctx.cells.rewind() || !ctx.sections.rewind()
+		|| !DumpIndex(out, header, pieces,
+					  [&ctx, &out, &buf](unsigned, size_t sz)->bool {
+						  return CopySpill(ctx.cells, sz, out, buf.data());
+					  },
+					  [&ctx, &out, &buf](unsigned, size_t sz)->bool {
+						  return CopySpill(ctx.sections, sz, out, buf.data());
+					  })) {
+		return BUILD_STATUS_FAIL_TO_OUTPUT;
+	}
+	if (line_size == 0) {
+		return BUILD_STATUS_OK;
+	}
+	buf = std::vector<uint8_t>();
 	auto spot4 = std::chrono::steady_clock::now();
-	if (g_trace_build_time) {
-		Logger::Printf("fill index: %.3fs\n", DurationS(spot1, spot2));
-		Logger::Printf("dump index: %.3fs\n", DurationS(spot2, spot3));
-		Logger::Printf("dump value: %.3fs\n", DurationS(spot3, spot4));
+	const auto status = SpillFill(ctx, header.seed, pieces, out);
+	auto spot5 = std::chrono::steady_clock::now();
+	ReportPhase(observer, PHASE_FILL, spot4, spot5);
+	return status;
+}
+
+//A staged record is key length (1B), value length (varint, only with values),
+//key and value. Data of a reader stays in place, so a batch can take many.
+class StagedReader : public IDataReader {
+public:
+	StagedReader(std::vector<uint8_t>&& data, size_t total, bool with_val)
+		: m_buf(std::move(data)), m_begin(m_buf.data()), m_end(m_begin+m_buf.size()),
+		  m_pos(m_begin), m_total(total), m_with_val(with_val) {}
+	StagedReader(MemMap&& map, const std::string& path, size_t total, bool with_val)
+		: m_map(std::move(map)), m_path(path), m_begin(m_map.addr()), m_end(m_map.end()),
+		  m_pos(m_begin), m_total(total), m_with_val(with_val) {}
+	~StagedReader() noexcept override {
+		m_map = MemMap();
+		if (!m_path.empty()) {
+			std::remove(m_path.c_str());
+		}
+	}
+
+	void reset() override {
+		m_pos = m_begin;
+	}
+	size_t total() override {
+		return m_total;
+	}
+	Record read(bool) override {
+		Record rec = {{nullptr, 0}, {nullptr, 0}};
+		if (m_pos >= m_end) {
+			return rec;
+		}
+		rec.key.len = *m_pos++;
+		if (m_with_val) {
+			size_t len = 0;
+			for (unsigned sft = 0; ; sft += 7U) {
+				const uint8_t b = *m_pos++;
+				len |= static_cast<size_t>(b & 0x7fU) << sft;
+				if ((b & 0x80U) == 0) {
+					break;
+				}
+			}
+			rec.val.len = len;
+		}
+		rec.key.ptr = m_pos;
+		m_pos += rec.key.len;
+		rec.val.ptr = m_pos;
+		m_pos += rec.val.len;
+		return rec;
+	}
+	unsigned read_batch(Record out[], unsigned n, bool key_only) override {
+		unsigned i = 0;
+		for (; i < n && m_pos < m_end; i++) {
+			out[i] = read(key_only);
+		}
+		return i;
+	}
+
+private:
+	std::vector<uint8_t> m_buf;
+	MemMap m_map;
+	std::string m_path;
+	const uint8_t* m_begin;
+	const uint8_t* m_end;
+	const uint8_t* m_pos;
+	const size_t m_total;
+	const bool m_with_val;
+};
+
+//Each reader is read once without reset, records go to memory, or to a file
+//under spill_dir which is mapped back.
+//memory taken by a stage in memory is added to used, it should be within memory_budget
+static BuildStatus StageInput(const DataReaders& in, bool with_val, const BuildOptions& options,
+							  DataReaders& out, size_t& used) {
+	const bool to_file = !options.spill_dir.empty();
+	const size_t budget = options.memory_budget != 0? options.memory_budget : SIZE_MAX;
+	std::atomic<size_t> taken{0};
+	std::string prefix;
+	if (to_file) {
+		char tag[24];
+		snprintf(tag, sizeof(tag), "%016llx", (unsigned long long)GetSeed());
+		prefix = options.spill_dir + "/shd-stage-" + tag + "-";
+	}
+	out.clear();
+	out.resize(in.size());
+	std::vector<BuildStatus> part_status(in.size(), BUILD_STATUS_OK);
+	RunTasks(BuildWorkers(options), in.size(), [&](size_t i) {
+		auto& reader = *in[i];
+		const auto total = reader.total();
+		const auto path = to_file? prefix + std::to_string(i) : std::string();
+		std::vector<uint8_t> buf;
+		FileWriter file;
+		if (to_file) {
+			file = FileWriter(path.c_str());
+			if (!file) {
+				part_status[i] = BUILD_STATUS_FAIL_TO_OUTPUT;
+				return;
+			}
+		}
+		bool fail_to_output = false;
+		bool out_of_memory = false;
+		auto put = [&](const Record& rec, size_t)->bool {
+			if (rec.key.ptr == nullptr || rec.key.len == 0 || rec.key.len > MAX_KEY_LEN
+				|| (with_val && (rec.val.len > MAX_VALUE_LEN || (rec.val.len != 0 && rec.val.ptr == nullptr)))) {
+				return false;
+			}
+			uint8_t mark[16];
+			mark[0] = rec.key.len;
+			const auto w = with_val? 1U + PutVarInt(rec.val.len, mark+1) : 1U;
+			const auto val_len = with_val? rec.val.len : 0;
+			if (to_file) {
+				fail_to_output = !file.write(mark, w) || !file.write(rec.key.ptr, rec.key.len)
+					|| (val_len != 0 && !file.write(rec.val.ptr, val_len));
+				return !fail_to_output;
+			}
+			const auto off = buf.size();
+			const auto cap = buf.capacity();
+			buf.resize(off + w + rec.key.len + val_len);
+			if (buf.capacity() != cap
+				&& taken.fetch_add(buf.capacity()-cap, std::memory_order_relaxed) + buf.capacity()-cap > budget) {
+				out_of_memory = true;
+				return false;
+			}
+			memcpy(buf.data()+off, mark, w);
+			memcpy(buf.data()+off+w, rec.key.ptr, rec.key.len);
+			if (val_len != 0) {
+				memcpy(buf.data()+off+w+rec.key.len, rec.val.ptr, val_len);
+			}
+			return true;
+		};
+		if (!ReadRecords(reader, total, !with_val, put)) {
+			part_status[i] = fail_to_output? BUILD_STATUS_FAIL_TO_OUTPUT
+				: out_of_memory? BUILD_STATUS_OUT_OF_MEMORY : BUILD_STATUS_BAD_INPUT;
+			if (to_file) {
+				file = FileWriter();
+				std::remove(path.c_str());
+			}
+			return;
+		}
+		if (!to_file) {
+			const auto cap = buf.capacity();
+			buf.shrink_to_fit();
+			taken.fetch_sub(cap-buf.capacity(), std::memory_order_relaxed);
+			out[i] = std::make_unique<StagedReader>(std::move(buf), total, with_val);
+			return;
+		}
+		const bool flushed = file.flush();
+		file = FileWriter();
+		MemMap map;
+		if (flushed && total != 0) {
+			map = MemMap(path.c_str());
+		}
+		if (!flushed || (total != 0 && !map)) {
+			std::remove(path.c_str());
+			part_status[i] = BUILD_STATUS_FAIL_TO_OUTPUT;
+			return;
+		}
+		out[i] = std::make_unique<StagedReader>(std::move(map), path, total, with_val);
+	});
+	for (auto status : part_status) {
+		if (status != BUILD_STATUS_OK) {
+			out.clear();
+			if (status == BUILD_STATUS_OUT_OF_MEMORY) {
+				Logger::Printf("memory budget is too small to stage input\n");
+			}
+			return status;
+		}
 	}
+	used = taken.load(std::memory_order_relaxed);
 	return BUILD_STATUS_OK;
 }
 
-BuildStatus BuildIndex(const DataReaders& in, IDataWriter& out, Retry retry) {
-	return BuildAndDump(in, out, {Type::INDEX_ONLY, 0, 0}, retry, nullptr);
+//with single_pass, input is staged first and the build runs on the stage
+static BuildStatus BuildOnStage(const DataReaders& in, bool with_val, const BuildOptions& options,
+								const std::function<BuildStatus(const DataReaders&, const BuildOptions&)>& build) {
+	auto spot1 = std::chrono::steady_clock::now();
+	DataReaders staged;
+	size_t used = 0;
+	const auto status = StageInput(in, with_val, options, staged, used);
+	if (status != BUILD_STATUS_OK) {
+		return status;
+	}
+	ReportPhase(PickObserver(options.observer), PHASE_STAGE, spot1, std::chrono::steady_clock::now());
+	auto next = options;
+	next.single_pass = false;
+	//spill_dir is taken for the stage, the build spills only when a budget asks
+	//or there are too many readers for segments
+	if (options.memory_budget == 0 && (options.segments != 0 || staged.size() <= MAX_SEGMENT)) {
+		next.spill_dir.clear();
+	}
+	if (options.memory_budget != 0) {	//the stage stays through the build
+		if (used >= options.memory_budget) {
+			return BUILD_STATUS_OUT_OF_MEMORY;
+		}
+		next.memory_budget -= used;
+	}
+	return build(staged, next);
+}
+
+static BuildOptions LegacyOptions(Retry retry, IndexLayout layout, bool use_extra_mem) {
+	BuildOptions options;
+	options.retry = retry;
+	options.layout = layout;
+	options.use_extra_mem = use_extra_mem;
+	return options;
+}
+
+BuildStatus BuildIndex(const DataReaders& in, IDataWriter& out, const BuildOptions& options) {
+	if (options.single_pass) {
+		return BuildOnStage(in, false, options, [&out](const DataReaders& staged, const BuildOptions& next) {
+			return BuildIndex(staged, out, next);
+		});
+	}
+	return BuildAndDump(in, out, {Type::INDEX_ONLY, 0, 0, options.layout}, options, nullptr);
+}
+
+BuildStatus BuildIndex(const DataReaders& in, IDataWriter& out, Retry retry, IndexLayout layout) {
+	return BuildIndex(in, out, LegacyOptions(retry, layout, false));
 }
 
-BuildStatus BuildIndexFast(const DataReaders& in, IDataWriter& out, Retry retry) {
-	return BuildAndDump(in, out, {Type::INDEX_ONLY, 0, 0}, retry, nullptr, true);
+BuildStatus BuildIndexFast(const DataReaders& in, IDataWriter& out, Retry retry, IndexLayout layout) {
+	return BuildIndex(in, out, LegacyOptions(retry, layout, true));
 }
 
-static bool DetectKeyValueLen(const DataReaders& in, uint8_t& key_len, uint16_t* val_len) {
+//key_len is left 0 for variable length key
+static bool DetectKeyValueLen(const DataReaders& in, uint8_t& key_len, uint16_t* val_len, bool var_key=false) {
 	for (auto& reader : in) {
 		if (reader->total() == 0) {
 			continue;
@@ -1137,7 +2825,7 @@ static bool DetectKeyValueLen(const DataReaders& in, uint8_t& key_len, uint16_t*
 		if (rec.key.ptr == nullptr || rec.key.len == 0 || rec.key.len > MAX_KEY_LEN) {
 			return false;
 		}
-		key_len = rec.key.len;
+		key_len = var_key? 0 : rec.key.len;
 		if (val_len != nullptr) {
 			if (rec.val.ptr == nullptr || rec.val.len == 0 || rec.val.len > MAX_INLINE_VALUE_LEN) {
 				return false;
@@ -1150,63 +2838,96 @@ static bool DetectKeyValueLen(const DataReaders& in, uint8_t& key_len, uint16_t*
 	return false;
 }
 
-static BuildStatus BuildSet(const DataReaders& in, IDataWriter& out, Retry retry, bool force_extra_mem) {
+BuildStatus BuildSet(const DataReaders& in, IDataWriter& out, const BuildOptions& options) {
+	if (options.single_pass) {
+		return BuildOnStage(in, false, options, [&out](const DataReaders& staged, const BuildOptions& next) {
+			return BuildSet(staged, out, next);
+		});
+	}
 	uint8_t key_len;
-	if (!DetectKeyValueLen(in, key_len, nullptr)) {
+	if (!DetectKeyValueLen(in, key_len, nullptr, options.layout & LAYOUT_VAR_KEY)) {
 		return BUILD_STATUS_BAD_INPUT;
 	}
-	return BuildAndDump(in, out, {Type::KEY_SET, key_len, 0}, retry,
-						[](const PackView& index, const DataReaders& in, IDataWriter& out)->BuildStatus {
-							return FillInlineKeyValue(index, in, out);
-						}, force_extra_mem);
+	return BuildAndDump(in, out, {Type::KEY_SET, key_len, 0, options.layout}, options, FillContent);
 }
 
-BuildStatus BuildSet(const DataReaders& in, IDataWriter& out, Retry retry) {
-	return BuildSet(in, out, retry, false);
+BuildStatus BuildSet(const DataReaders& in, IDataWriter& out, Retry retry, IndexLayout layout) {
+	return BuildSet(in, out, LegacyOptions(retry, layout, false));
 }
 
-BuildStatus BuildSetFast(const DataReaders& in, IDataWriter& out, Retry retry) {
-	return BuildSet(in, out, retry, true);
+BuildStatus BuildSetFast(const DataReaders& in, IDataWriter& out, Retry retry, IndexLayout layout) {
+	return BuildSet(in, out, LegacyOptions(retry, layout, true));
 }
 
-static BuildStatus BuildDict(const DataReaders& in, IDataWriter& out, Retry retry, bool force_extra_mem) {
+BuildStatus BuildFingerprintSet(const DataReaders& in, IDataWriter& out, unsigned bits, const BuildOptions& options) {
+	if (options.single_pass) {
+		return BuildOnStage(in, false, options, [&out, bits](const DataReaders& staged, const BuildOptions& next) {
+			return BuildFingerprintSet(staged, out, bits, next);
+		});
+	}
+	uint8_t key_len;
+	if (bits % 8U != 0 || !IsFingerprintSize(bits / 8U) || !DetectKeyValueLen(in, key_len, nullptr)) {
+		return BUILD_STATUS_BAD_INPUT;
+	}
+	return BuildAndDump(in, out, {Type::FINGERPRINT_SET, key_len, (uint16_t)(bits / 8U), options.layout}, options,
+						[](const PackView& index, const DataReaders& in, IDataWriter& out,
+						   BuildObserver* observer, const FillHints& hints)->BuildStatus {
+							return FillInlineKeyValue(index, in, out, observer, hints);
+						});
+}
+
+BuildStatus BuildFingerprintSet(const DataReaders& in, IDataWriter& out, unsigned bits, Retry retry,
+								IndexLayout layout) {
+	return BuildFingerprintSet(in, out, bits, LegacyOptions(retry, layout, false));
+}
+
+BuildStatus BuildFingerprintSetFast(const DataReaders& in, IDataWriter& out, unsigned bits, Retry retry,
+									IndexLayout layout) {
+	return BuildFingerprintSet(in, out, bits, LegacyOptions(retry, layout, true));
+}
+
+BuildStatus BuildDict(const DataReaders& in, IDataWriter& out, const BuildOptions& options) {
+	if (options.single_pass) {
+		return BuildOnStage(in, true, options, [&out](const DataReaders& staged, const BuildOptions& next) {
+			return BuildDict(staged, out, next);
+		});
+	}
 	uint8_t key_len;
 	uint16_t val_len;
-	if (!DetectKeyValueLen(in, key_len, &val_len)) {
+	if (!DetectKeyValueLen(in, key_len, &val_len, options.layout & LAYOUT_VAR_KEY)) {
 		return BUILD_STATUS_BAD_INPUT;
 	}
-	return BuildAndDump(in, out, {Type::KV_INLINE, key_len, val_len}, retry,
-					 [](const PackView& index, const DataReaders& in, IDataWriter& out)->BuildStatus {
-							 return FillInlineKeyValue(index, in, out);
-						 }, force_extra_mem);
+	return BuildAndDump(in, out, {Type::KV_INLINE, key_len, val_len, options.layout}, options, FillContent);
 }
 
-BuildStatus BuildDict(const DataReaders& in, IDataWriter& out, Retry retry) {
-	return BuildDict(in, out, retry, false);
+BuildStatus BuildDict(const DataReaders& in, IDataWriter& out, Retry retry, IndexLayout layout) {
+	return BuildDict(in, out, LegacyOptions(retry, layout, false));
 }
 
-BuildStatus BuildDictFast(const DataReaders& in, IDataWriter& out, Retry retry) {
-	return BuildDict(in, out, retry, true);
+BuildStatus BuildDictFast(const DataReaders& in, IDataWriter& out, Retry retry, IndexLayout layout) {
+	return BuildDict(in, out, LegacyOptions(retry, layout, true));
 }
 
-static BuildStatus BuildDictWithVariedValue(const DataReaders& in, IDataWriter& out, Retry retry,
-											 bool force_extra_mem) {
+BuildStatus BuildDictWithVariedValue(const DataReaders& in, IDataWriter& out, const BuildOptions& options) {
+	if (options.single_pass) {
+		return BuildOnStage(in, true, options, [&out](const DataReaders& staged, const BuildOptions& next) {
+			return BuildDictWithVariedValue(staged, out, next);
+		});
+	}
 	uint8_t key_len;
-	if (!DetectKeyValueLen(in, key_len, nullptr)) {
+	if (!DetectKeyValueLen(in, key_len, nullptr, options.layout & LAYOUT_VAR_KEY)) {
 		return BUILD_STATUS_BAD_INPUT;
 	}
-	return BuildAndDump(in, out, {Type::KV_SEPARATED, key_len, OFFSET_FIELD_SIZE}, retry,
-						[](const PackView& index, const DataReaders& in, IDataWriter& out)->BuildStatus {
-							return FillSeparatedKeyValue(index, in, out);
-						}, force_extra_mem);
+	return BuildAndDump(in, out, {Type::KV_SEPARATED, key_len, OFFSET_FIELD_SIZE, options.layout}, options,
+						FillContent);
 }
 
-BuildStatus BuildDictWithVariedValue(const DataReaders& in, IDataWriter& out, Retry retry) {
-	return BuildDictWithVariedValue(in, out, retry, false);
+BuildStatus BuildDictWithVariedValue(const DataReaders& in, IDataWriter& out, Retry retry, IndexLayout layout) {
+	return BuildDictWithVariedValue(in, out, LegacyOptions(retry, layout, false));
 }
 
-BuildStatus BuildDictWithVariedValueFast(const DataReaders& in, IDataWriter& out, Retry retry) {
-	return BuildDictWithVariedValue(in, out, retry, true);
+BuildStatus BuildDictWithVariedValueFast(const DataReaders& in, IDataWriter& out, Retry retry, IndexLayout layout) {
+	return BuildDictWithVariedValue(in, out, LegacyOptions(retry, layout, true));
 }
 
 struct Shard {
@@ -1237,14 +2958,15 @@ public:
 				m_pos++;
 				continue;
 			}
-			auto line = m_base.content + (m_pos++)*m_base.line_size;
+			auto line = KeyAt(m_base, m_pos);
+			auto field = ValueAt(m_base, m_pos++, line);
 			Record out;
-			out.key = {line, m_base.key_len};
+			out.key = m_base.keys != nullptr? VarKeyAt(m_base, line) : Slice{line, m_base.key_len};
 			if (!key_only) {
-				auto field = line + m_base.key_len;
 				if (m_base.type != Type::KV_SEPARATED) {
 					out.val = {field, m_base.val_len};
 				} else {
+					ResetValueArena();	//a record lives till next read
 					out.val = SeparatedValueAt(m_base, field);
 				}
 			}
@@ -1261,14 +2983,54 @@ private:
 	size_t m_pos = 0;
 };
 
+//variable length keys cannot be batched in a fixed size window, they are looked up one by one
+static DataReaders PrepareVarKeyRebuild(const PackView& base, const DataReaders& in,
+										const std::shared_ptr<MemBlock>& dirty) {
+	for (auto& reader : in) {
+		reader->reset();
+		const auto cnt = reader->total();
+		for (size_t i = 0; i < cnt; i++) {
+			auto key = reader->read(true).key;
+			if (key.ptr == nullptr || key.len == 0 || key.len > MAX_KEY_LEN) {
+				return {};
+			}
+			auto line = SearchVarKey(base, key.ptr, key.len);
+			if (line != nullptr && !TestAndSetBit(dirty->addr(), (line-base.content)/base.line_size)) {
+				return {};
+			}
+		}
+	}
+
+	DataReaders out;
+	out.reserve(in.size());
+	const auto piece = base.item / in.size();
+	const auto remain = base.item % in.size();
+	size_t off = 0;
+	for (unsigned i = 0; i < in.size(); i++) {
+		Shard shard;
+		shard.begin = off;
+		off += i<remain ? piece+1 : piece;
+		shard.end = off;
+		shard.valid = 0;
+		for (auto pos = shard.begin; pos < shard.end; pos++) {
+			shard.valid += !TestBit(dirty->addr(), pos);
+		}
+		out.emplace_back(new RebuildReader(dirty, shard, base, *in[i]));
+	}
+	return out;
+}
+
 static DataReaders PrepareForRebuild(const PackView& base, const DataReaders& in) {
 	DataReaders out;
-	if (base.type == Type::INDEX_ONLY || in.empty() || in.size() > MAX_SEGMENT || base.item < in.size()) {
+	if (base.type == Type::INDEX_ONLY || base.type == Type::FINGERPRINT_SET || in.empty() || in.size() > MAX_SEGMENT || base.item < in.size()) {
 		return out;
 	}
 	auto dirty = std::make_shared<MemBlock>((base.item+7U)/8U);
 	if (!*dirty) throw std::bad_alloc();
 	memset(dirty->addr(), 0, dirty->size());
+	if (base.keys != nullptr) {
+		return PrepareVarKeyRebuild(base, in, dirty);
+	}
 
 	if (in.size() == 1) {
 		Shard shard;
@@ -1279,12 +3041,8 @@ static DataReaders PrepareForRebuild(const PackView& base, const DataReaders& in
 		reader->reset();
 		try {
 			BatchFindPos(base, reader->total(),
-						 [reader, &base](uint8_t *buf)  {
-							 auto key = reader->read(true).key;
-							 if (key.ptr == nullptr || key.len != base.key_len) {
-								 throw BuildException();
-							 }
-							 Assign(buf, key.ptr, base.key_len);
+						 [reader, &base](uint8_t *buf, unsigned n) {
+							 ReadKeys(*reader, base.key_len, buf, n);
 						 },
 						 [&shard, &base, &dirty](uint64_t pos) {
 							 if (pos < base.item) {
@@ -1321,12 +3079,8 @@ static DataReaders PrepareForRebuild(const PackView& base, const DataReaders& in
 			std::vector<size_t> temp(shards.size(), 0);
 			try {
 				BatchFindPos(base, reader->total(),
-							 [reader, &base](uint8_t *buf){
-								 auto key = reader->read(true).key;
-								 if (key.ptr == nullptr || key.len != base.key_len) {
-									 throw BuildException();
-								 }
-								 Assign(buf, key.ptr, base.key_len);
+							 [reader, &base](uint8_t *buf, unsigned n) {
+								 ReadKeys(*reader, base.key_len, buf, n);
 							 },
 							 [&shards, &temp, &base, &dirty](uint64_t pos) {
 								 if (pos < base.item) {
@@ -1375,17 +3129,14 @@ BuildStatus Rebuild(const PackView& base, const DataReaders& in, IDataWriter& ou
 	if (input.empty()) {
 		return BUILD_STATUS_BAD_INPUT;
 	}
-	auto spot2 = std::chrono::steady_clock::now();
-	if (g_trace_build_time) {
-		Logger::Printf("prepare: %.3fs\n", DurationS(spot1, spot2));
-	}
+	ReportPhase(PickObserver(nullptr), PHASE_PREPARE, spot1, std::chrono::steady_clock::now());
 	switch (base.type) {
 		case Type::KEY_SET:
-			return BuildSet(input, out, retry);
+			return BuildSet(input, out, retry, base.layout);
 		case Type::KV_INLINE:
-			return BuildDict(input, out, retry);
+			return BuildDict(input, out, retry, base.layout);
 		case Type::KV_SEPARATED:
-			return BuildDictWithVariedValue(input, out, retry);
+			return BuildDictWithVariedValue(input, out, retry, base.layout);
 		default:
 			return BUILD_STATUS_BAD_INPUT;
 	}
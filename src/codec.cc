@@ -0,0 +1,163 @@
+//==============================================================================
+// Skew Hash and Displace Algorithm.
+// Copyright (C) 2020  Ruan Kunliang
+//
+// This library is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the Free
+// Software Foundation; either version 2.1 of the License, or (at your option)
+// any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+// details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with the This Library; if not, see <https://www.gnu.org/licenses/>.
+//==============================================================================
+
+#include <cstring>
+#include "common.h"
+#include "codec.h"
+
+namespace shd {
+
+static constexpr unsigned MIN_MATCH = 4;
+static constexpr unsigned HASH_BITS = 12;
+
+static FORCE_INLINE uint32_t Load32(const uint8_t* p) {
+	uint32_t x;
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+static FORCE_INLINE uint32_t HashSeq(uint32_t seq) {
+	return (seq * 2654435761U) >> (32U - HASH_BITS);
+}
+
+static FORCE_INLINE bool PutLength(uint8_t*& op, const uint8_t* oend, size_t len) {
+	for (; len >= 255U; len -= 255U) {
+		if (op >= oend) return false;
+		*op++ = 255U;
+	}
+	if (op >= oend) return false;
+	*op++ = len;
+	return true;
+}
+
+//literals then an optional match, match_len == 0 means the last sequence
+static FORCE_INLINE bool PutSequence(uint8_t*& op, const uint8_t* oend, const uint8_t* lit, size_t lit_len,
+									 size_t offset, size_t match_len) {
+	if (op >= oend) return false;
+	auto token = op++;
+	*token = (lit_len < 15U? lit_len : 15U) << 4U;
+	if (lit_len >= 15U && !PutLength(op, oend, lit_len-15U)) {
+		return false;
+	}
+	if (lit_len > static_cast<size_t>(oend-op)) {
+		return false;
+	}
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+	if (match_len == 0) {
+		return true;
+	}
+	if (oend-op < 2) return false;
+	*op++ = offset;
+	*op++ = offset >> 8U;
+	match_len -= MIN_MATCH;
+	*token |= match_len < 15U? match_len : 15U;
+	return match_len < 15U || PutLength(op, oend, match_len-15U);
+}
+
+size_t LzCompress(const uint8_t* src, size_t n, uint8_t* dst, size_t cap) noexcept {
+	uint32_t table[1U<<HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	const uint8_t* const end = src + n;
+	const uint8_t* anchor = src;
+	const uint8_t* ip = src;
+	uint8_t* op = dst;
+	const uint8_t* const oend = dst + cap;
+	unsigned misses = 0;
+	while (end-ip >= (ptrdiff_t)MIN_MATCH) {
+		const auto seq = Load32(ip);
+		auto& slot = table[HashSeq(seq)];
+		const auto ref = src + slot;
+		slot = ip - src;
+		if (ref >= ip || static_cast<size_t>(ip-ref) > LZ_MAX_DISTANCE || Load32(ref) != seq) {
+			ip += 1U + (misses++ >> 6U);	//skip faster over data that does not compress
+			continue;
+		}
+		misses = 0;
+		size_t len = MIN_MATCH;
+		while (ip+len < end && ip[len] == ref[len]) {
+			len++;
+		}
+		if (!PutSequence(op, oend, anchor, ip-anchor, ip-ref, len)) {
+			return 0;
+		}
+		ip += len;
+		anchor = ip;
+	}
+	if (!PutSequence(op, oend, anchor, end-anchor, 0, 0)) {
+		return 0;
+	}
+	return op - dst;
+}
+
+static FORCE_INLINE bool GetLength(const uint8_t*& ip, const uint8_t* iend, size_t& len) {
+	uint8_t b;
+	do {
+		if (ip >= iend) return false;
+		b = *ip++;
+		len += b;
+	} while (b == 255U);
+	return true;
+}
+
+bool LzDecompress(const uint8_t* src, size_t n, uint8_t* dst, size_t raw) noexcept {
+	const uint8_t* ip = src;
+	const uint8_t* const iend = src + n;
+	uint8_t* op = dst;
+	uint8_t* const oend = dst + raw;
+	while (ip < iend) {
+		const unsigned token = *ip++;
+		size_t lit_len = token >> 4U;
+		if (lit_len == 15U && !GetLength(ip, iend, lit_len)) {
+			return false;
+		}
+		if (lit_len > static_cast<size_t>(iend-ip) || lit_len > static_cast<size_t>(oend-op)) {
+			return false;
+		}
+		memcpy(op, ip, lit_len);
+		op += lit_len;
+		ip += lit_len;
+		if (ip == iend) {
+			break;
+		}
+		if (iend-ip < 2) return false;
+		const size_t offset = ip[0] | ((size_t)ip[1] << 8U);
+		ip += 2;
+		size_t match_len = token & 15U;
+		if (match_len == 15U && !GetLength(ip, iend, match_len)) {
+			return false;
+		}
+		match_len += MIN_MATCH;
+		if (offset == 0 || offset > static_cast<size_t>(op-dst) || match_len > static_cast<size_t>(oend-op)) {
+			return false;
+		}
+		const uint8_t* ref = op - offset;
+		if (offset >= match_len) {
+			memcpy(op, ref, match_len);
+			op += match_len;
+		} else {
+			for (size_t i = 0; i < match_len; i++) {	//overlapped copy repeats the pattern
+				*op++ = *ref++;
+			}
+		}
+	}
+	return op == oend;
+}
+
+} // shd
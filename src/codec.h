@@ -0,0 +1,43 @@
+//==============================================================================
+// Skew Hash and Displace Algorithm.
+// Copyright (C) 2020  Ruan Kunliang
+//
+// This library is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the Free
+// Software Foundation; either version 2.1 of the License, or (at your option)
+// any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+// details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with the This Library; if not, see <https://www.gnu.org/licenses/>.
+//==============================================================================
+
+#pragma once
+#ifndef SHD_CODEC_H_
+#define SHD_CODEC_H_
+
+#include <cstddef>
+#include <cstdint>
+
+// A small LZ77 codec for value blocks, byte oriented like LZ4.
+// A sequence is: token, [literal length], literals, offset(2B), [match length].
+// The token holds literal length in high 4 bits and match length-4 in low 4 bits,
+// 15 means more length bytes follow, each adds up to 255.
+// The last sequence carries literals only.
+
+namespace shd {
+
+static constexpr size_t LZ_MAX_DISTANCE = 0xffff;
+
+// Returns compressed size, or 0 if output does not fit in cap.
+extern size_t LzCompress(const uint8_t* src, size_t n, uint8_t* dst, size_t cap) noexcept;
+
+// Output must be exactly raw bytes, any broken input is rejected.
+extern bool LzDecompress(const uint8_t* src, size_t n, uint8_t* dst, size_t raw) noexcept;
+
+} // shd
+#endif // SHD_CODEC_H_
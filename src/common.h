@@ -21,10 +21,15 @@
 #define SHD_COMMON_H_
 
 #include <cstdint>
+#include <cstring>
 
 #if defined(_MSC_VER) && !defined(__clang__)
 #include <intrin.h>
 #endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SHD_STREAM_STORE 1
+#endif
 
 namespace shd {
 
@@ -34,6 +39,20 @@ struct V128 {
 };
 
 extern V128 HashTo128(const uint8_t* msg, unsigned len, uint64_t seed=0);
+//same as calling HashTo128 on each message, n is not limited
+extern void HashTo128(const uint8_t* const msgs[], unsigned n, unsigned len, uint64_t seed, V128 out[]);
+
+//modulus for lanes, inv is UINT64_MAX / n
+struct LaneModulus {
+	uint64_t n;
+	uint64_t inv;
+};
+//true when BatchMod runs in SIMD lanes, otherwise it divides one by one
+extern bool HasBatchMod() noexcept;
+//out[i] = x[i] % m.n, n is not limited
+extern void BatchMod(const uint64_t x[], unsigned n, const LaneModulus& m, uint64_t out[]);
+
+extern unsigned GetHugePageShift() noexcept;
 
 } // shd
 
@@ -81,4 +100,32 @@ static FORCE_INLINE void PrefetchForWrite(const void* ptr) {
 #endif
 }
 
+//Copy bypassing cache for output not read soon, StreamFence before others read it.
+static FORCE_INLINE void StreamCopy(void* dst, const void* src, size_t n) {
+#ifdef SHD_STREAM_STORE
+	auto d = static_cast<uint8_t*>(dst);
+	auto s = static_cast<const uint8_t*>(src);
+	const size_t head = (16U - ((uintptr_t)d & 15U)) & 15U;
+	if (n < head + 16U) {
+		memcpy(d, s, n);
+		return;
+	}
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+	for (; n >= 16U; n -= 16U, d += 16U, s += 16U) {
+		_mm_stream_si128((__m128i*)d, _mm_loadu_si128((const __m128i*)s));
+	}
+	memcpy(d, s, n);
+#else
+	memcpy(dst, src, n);
+#endif
+}
+static FORCE_INLINE void StreamFence() {
+#ifdef SHD_STREAM_STORE
+	_mm_sfence();
+#endif
+}
+
 #endif // SHD_COMMON_H_
@@ -0,0 +1,341 @@
+//==============================================================================
+// Skew Hash and Displace Algorithm.
+// Copyright (C) 2020  Ruan Kunliang
+//
+// This library is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the Free
+// Software Foundation; either version 2.1 of the License, or (at your option)
+// any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+// details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with the This Library; if not, see <https://www.gnu.org/licenses/>.
+//==============================================================================
+
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>
+#include "internal.h"
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace shd {
+
+static void PinThread(std::thread& thread, unsigned idx) noexcept {
+#if defined(_WIN32)
+	DWORD_PTR proc_mask = 0, sys_mask = 0;
+	if (!GetProcessAffinityMask(GetCurrentProcess(), &proc_mask, &sys_mask) || proc_mask == 0) {
+		return;
+	}
+	std::vector<unsigned> cpus;
+	for (unsigned i = 0; i < sizeof(DWORD_PTR)*8U; i++) {
+		if (proc_mask & ((DWORD_PTR)1 << i)) {
+			cpus.push_back(i);
+		}
+	}
+	SetThreadAffinityMask(thread.native_handle(), (DWORD_PTR)1 << cpus[idx % cpus.size()]);
+#elif defined(__linux__)
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		return;
+	}
+	std::vector<unsigned> cpus;
+	for (unsigned i = 0; i < CPU_SETSIZE; i++) {
+		if (CPU_ISSET(i, &allowed)) {
+			cpus.push_back(i);
+		}
+	}
+	if (cpus.empty()) {
+		return;
+	}
+	cpu_set_t one;
+	CPU_ZERO(&one);
+	CPU_SET(cpus[idx % cpus.size()], &one);
+	pthread_setaffinity_np(thread.native_handle(), sizeof(one), &one);
+#else
+	(void)thread;
+	(void)idx;
+#endif
+}
+
+//Chunks are dealt out as contiguous ranges, one per participant. The owner
+//takes from head and thieves take from tail, both by CAS on the same word.
+struct alignas(64) ChunkRange {
+	std::atomic<uint64_t> span{0};	//tail << 32 | head
+
+	void reset(uint32_t head, uint32_t tail) noexcept {
+		span.store(((uint64_t)tail << 32U) | head, std::memory_order_relaxed);
+	}
+	bool take_head(unsigned& chunk) noexcept {
+		auto s = span.load(std::memory_order_relaxed);
+		while ((uint32_t)s < (uint32_t)(s >> 32U)) {
+			if (span.compare_exchange_weak(s, s+1, std::memory_order_relaxed)) {
+				chunk = (uint32_t)s;
+				return true;
+			}
+		}
+		return false;
+	}
+	bool take_tail(unsigned& chunk) noexcept {
+		auto s = span.load(std::memory_order_relaxed);
+		while ((uint32_t)s < (uint32_t)(s >> 32U)) {
+			if (span.compare_exchange_weak(s, s-(1ULL<<32U), std::memory_order_relaxed)) {
+				chunk = (uint32_t)(s >> 32U) - 1U;
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+//Plain wait is exported at GLIBCXX_3.4.30 by GCC 12, while a timed wait is
+//inlined, so the library still loads with an older libstdc++. The timeout is
+//long enough that idle workers are not woken by it.
+template <typename Pred>
+static void WaitFor(std::condition_variable& cond, std::unique_lock<std::mutex>& lock, const Pred& pred) {
+	while (!cond.wait_for(lock, std::chrono::hours(24), pred)) {}
+}
+
+struct BatchExecutor::Pool {
+	std::vector<std::thread> threads;
+	std::unique_ptr<ChunkRange[]> ranges;	//one more for the calling thread
+	unsigned parts = 1;
+
+	std::mutex submit;
+	std::mutex mtx;
+	std::condition_variable wake;
+	std::condition_variable done;
+	uint64_t epoch = 0;
+	unsigned active = 0;
+	bool open = false;
+	bool quit = false;
+	const std::function<unsigned(unsigned)>* task = nullptr;
+	std::atomic<unsigned> hit{0};
+
+	void work(unsigned self) {
+		unsigned sum = 0;
+		unsigned chunk;
+		while (ranges[self].take_head(chunk)) {
+			sum += (*task)(chunk);
+		}
+		for (unsigned i = 1; i < parts; i++) {
+			auto& victim = ranges[(self+i)%parts];
+			while (victim.take_tail(chunk)) {
+				sum += (*task)(chunk);
+			}
+		}
+		hit.fetch_add(sum, std::memory_order_relaxed);
+	}
+
+	void loop(unsigned self) {
+		uint64_t seen = 0;
+		std::unique_lock<std::mutex> lock(mtx);
+		while (true) {
+			WaitFor(wake, lock, [this, seen]{ return quit || epoch != seen; });
+			if (quit) {
+				return;
+			}
+			seen = epoch;
+			if (!open) {
+				continue;	//woke up too late, job is already done
+			}
+			active++;
+			lock.unlock();
+			work(self);
+			lock.lock();
+			if (--active == 0) {
+				done.notify_all();
+			}
+		}
+	}
+};
+
+BatchExecutor::BatchExecutor(unsigned workers, bool pin) : m_pool(std::make_unique<Pool>()) {
+	if (workers == 0) {
+		workers = std::max(std::thread::hardware_concurrency(), 1U);
+	}
+	workers--;	//the calling thread is a worker too
+	m_pool->parts = workers + 1;
+	m_pool->ranges = std::make_unique<ChunkRange[]>(m_pool->parts);
+	m_pool->threads.reserve(workers);
+	for (unsigned i = 0; i < workers; i++) {
+		m_pool->threads.emplace_back(&Pool::loop, m_pool.get(), i);
+		if (pin) {
+			PinThread(m_pool->threads.back(), i);
+		}
+	}
+}
+
+BatchExecutor::~BatchExecutor() noexcept {
+	{
+		std::lock_guard<std::mutex> lock(m_pool->mtx);
+		m_pool->quit = true;
+	}
+	m_pool->wake.notify_all();
+	for (auto& t : m_pool->threads) {
+		t.join();
+	}
+}
+
+unsigned BatchExecutor::workers() const noexcept {
+	return m_pool->parts;
+}
+
+unsigned BatchExecutor::_run(unsigned chunks, const std::function<unsigned(unsigned)>& task) {
+	auto& pool = *m_pool;
+	if (chunks <= 1 || pool.parts == 1) {
+		unsigned hit = 0;
+		for (unsigned i = 0; i < chunks; i++) {
+			hit += task(i);
+		}
+		return hit;
+	}
+
+	std::lock_guard<std::mutex> guard(pool.submit);
+	for (unsigned i = 0; i < pool.parts; i++) {
+		pool.ranges[i].reset((uint64_t)chunks*i/pool.parts, (uint64_t)chunks*(i+1)/pool.parts);
+	}
+	pool.hit.store(0, std::memory_order_relaxed);
+	{
+		std::lock_guard<std::mutex> lock(pool.mtx);
+		pool.task = &task;
+		pool.open = true;
+		pool.epoch++;
+	}
+	pool.wake.notify_all();
+	pool.work(pool.parts-1);
+
+	//every chunk is taken now, wait for those still running
+	std::unique_lock<std::mutex> lock(pool.mtx);
+	pool.open = false;
+	WaitFor(pool.done, lock, [&pool]{ return pool.active == 0; });
+	pool.task = nullptr;
+	return pool.hit.load(std::memory_order_relaxed);
+}
+
+//keep buffers touched by one chunk within L2
+static unsigned ChunkSize(size_t bytes_per_key) noexcept {
+	constexpr size_t TARGET = 64U*1024U;
+	return std::clamp<size_t>(TARGET / std::max<size_t>(bytes_per_key, 1U), 256U, 4096U);
+}
+
+static FORCE_INLINE unsigned ChunkCount(unsigned batch, unsigned chunk) noexcept {
+	return batch / chunk + (batch % chunk != 0);
+}
+
+void BatchExecutor::batch_locate(PerfectHashtable& table, unsigned batch, const uint8_t* __restrict keys,
+								 uint8_t key_len, uint64_t* __restrict out) {
+	const auto chunk = ChunkSize(key_len + sizeof(uint64_t));
+	_run(ChunkCount(batch, chunk), [&](unsigned i)->unsigned {
+		const unsigned off = i * chunk;
+		table.batch_locate(std::min(chunk, batch-off), keys + (size_t)off*key_len, key_len, out + off);
+		return 0;
+	});
+}
+
+unsigned BatchExecutor::batch_search(const PerfectHashtable& table, unsigned batch, const uint8_t* const keys[],
+									 const uint8_t* out[], const PerfectHashtable* patch) {
+	const auto chunk = ChunkSize(table.key_len() + sizeof(void*)*2);
+	return _run(ChunkCount(batch, chunk), [&](unsigned i)->unsigned {
+		const unsigned off = i * chunk;
+		return table.batch_search(std::min(chunk, batch-off), keys + off, out + off, patch);
+	});
+}
+
+unsigned BatchExecutor::batch_search(const PerfectHashtable& table, unsigned batch, const uint8_t* const keys[],
+									 Slice out[]) {
+	if (table.layout() & LAYOUT_COMPRESS_VALUE) {
+		return table.batch_search(batch, keys, out);	//slices are bound to the searching thread
+	}
+	const auto chunk = ChunkSize(table.key_len() + sizeof(void*) + sizeof(Slice));
+	return _run(ChunkCount(batch, chunk), [&](unsigned i)->unsigned {
+		const unsigned off = i * chunk;
+		return table.batch_search(std::min(chunk, batch-off), keys + off, out + off);
+	});
+}
+
+unsigned BatchExecutor::batch_search(const PerfectHashtable& table, unsigned batch, const Slice keys[], Slice out[]) {
+	if (table.layout() & LAYOUT_COMPRESS_VALUE) {
+		return table.batch_search(batch, keys, out);
+	}
+	const auto chunk = ChunkSize(table.key_len() + sizeof(Slice)*2);
+	return _run(ChunkCount(batch, chunk), [&](unsigned i)->unsigned {
+		const unsigned off = i * chunk;
+		return table.batch_search(std::min(chunk, batch-off), keys + off, out + off);
+	});
+}
+
+unsigned BatchExecutor::batch_fetch(const PerfectHashtable& table, unsigned batch, const uint8_t* __restrict keys,
+									uint8_t* __restrict data, const uint8_t* __restrict dft_val,
+									const PerfectHashtable* patch) {
+	const size_t key_len = table.key_len();
+	const size_t val_len = table.val_len();
+	const auto chunk = ChunkSize(key_len + val_len);
+	return _run(ChunkCount(batch, chunk), [&](unsigned i)->unsigned {
+		const unsigned off = i * chunk;
+		return table.batch_fetch(std::min(chunk, batch-off), keys + off*key_len, data + off*val_len,
+								 dft_val, patch);
+	});
+}
+
+unsigned BatchExecutor::batch_try_fetch(const PerfectHashtable& table, unsigned batch, const uint8_t* __restrict keys,
+										uint8_t* __restrict data, unsigned* __restrict miss,
+										const PerfectHashtable* patch) {
+	//a chunk that fails leaves no miss count, so reject what batch_try_fetch rejects
+	if (table.type() != PerfectHashtable::KV_INLINE || (table.layout() & LAYOUT_VAR_KEY)
+		|| keys == nullptr || data == nullptr
+		|| (patch != nullptr && (!*patch || patch->type() != table.type() || (patch->layout() & LAYOUT_VAR_KEY)
+			|| patch->key_len() != table.key_len() || patch->val_len() != table.val_len()))) {
+		return 0;
+	}
+	const size_t key_len = table.key_len();
+	const size_t val_len = table.val_len();
+	const auto chunk = ChunkSize(key_len + val_len);
+	const auto chunks = ChunkCount(batch, chunk);
+	//each chunk writes misses into its own part of the list, then they are packed in order
+	std::vector<unsigned> misses(miss == nullptr? 0 : chunks);
+	const auto hit = _run(chunks, [&](unsigned i)->unsigned {
+		const unsigned off = i * chunk;
+		const unsigned n = std::min(chunk, batch-off);
+		auto part = miss == nullptr? nullptr : miss + off;
+		const auto cnt = table.batch_try_fetch(n, keys + off*key_len, data + off*val_len, part, patch);
+		if (part != nullptr) {
+			misses[i] = n - cnt;
+			for (unsigned j = 0; j < misses[i]; j++) {
+				part[j] += off;
+			}
+		}
+		return cnt;
+	});
+	if (miss != nullptr) {
+		unsigned total = 0;
+		for (unsigned i = 0; i < chunks; i++) {
+			memmove(miss + total, miss + i*chunk, misses[i]*sizeof(unsigned));
+			total += misses[i];
+		}
+	}
+	return hit;
+}
+
+} //shd
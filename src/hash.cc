@@ -17,50 +17,16 @@
 //==============================================================================
 
 #include "internal.h"
+#include "hash.h"
 
 namespace shd {
 
-static FORCE_INLINE uint64_t Rot64(uint64_t x, unsigned k) {
-	return (x << k) | (x >> (64U - k));
-}
-
-static FORCE_INLINE void Mix(uint64_t& h0, uint64_t& h1, uint64_t& h2, uint64_t& h3) {
-	h2 = Rot64(h2,50);  h2 += h3;  h0 ^= h2;
-	h3 = Rot64(h3,52);  h3 += h0;  h1 ^= h3;
-	h0 = Rot64(h0,30);  h0 += h1;  h2 ^= h0;
-	h1 = Rot64(h1,41);  h1 += h2;  h3 ^= h1;
-	h2 = Rot64(h2,54);  h2 += h3;  h0 ^= h2;
-	h3 = Rot64(h3,48);  h3 += h0;  h1 ^= h3;
-	h0 = Rot64(h0,38);  h0 += h1;  h2 ^= h0;
-	h1 = Rot64(h1,37);  h1 += h2;  h3 ^= h1;
-	h2 = Rot64(h2,62);  h2 += h3;  h0 ^= h2;
-	h3 = Rot64(h3,34);  h3 += h0;  h1 ^= h3;
-	h0 = Rot64(h0,5);   h0 += h1;  h2 ^= h0;
-	h1 = Rot64(h1,36);  h1 += h2;  h3 ^= h1;
-}
-
-static FORCE_INLINE void End(uint64_t& h0, uint64_t& h1, uint64_t& h2, uint64_t& h3) {
-	h3 ^= h2;  h2 = Rot64(h2,15);  h3 += h2;
-	h0 ^= h3;  h3 = Rot64(h3,52);  h0 += h3;
-	h1 ^= h0;  h0 = Rot64(h0,26);  h1 += h0;
-	h2 ^= h1;  h1 = Rot64(h1,51);  h2 += h1;
-	h3 ^= h2;  h2 = Rot64(h2,28);  h3 += h2;
-	h0 ^= h3;  h3 = Rot64(h3,9);   h0 += h3;
-	h1 ^= h0;  h0 = Rot64(h0,47);  h1 += h0;
-	h2 ^= h1;  h1 = Rot64(h1,54);  h2 += h1;
-	h3 ^= h2;  h2 = Rot64(h2,32);  h3 += h2;
-	h0 ^= h3;  h3 = Rot64(h3,25);  h0 += h3;
-	h1 ^= h0;  h0 = Rot64(h0,63);  h1 += h0;
-}
-
 //SpookyHash
 V128 HashTo128(const uint8_t* msg, unsigned len, uint64_t seed) {
-	constexpr uint64_t magic = 0xdeadbeefdeadbeefULL;
-
 	uint64_t a = seed;
 	uint64_t b = seed;
-	uint64_t c = magic;
-	uint64_t d = magic;
+	uint64_t c = SPOOKY_MAGIC;
+	uint64_t d = SPOOKY_MAGIC;
 
 	for (auto end = msg + (len&~0x1fU); msg < end; msg += 32) {
 		auto x = (const uint64_t*)msg;
@@ -79,50 +45,95 @@ V128 HashTo128(const uint8_t* msg, unsigned len, uint64_t seed) {
 		msg += 16;
 	}
 
-	d += ((uint64_t)len) << 56U;
-	switch (len & 0xfU) {
-		case 15:
-			d += ((uint64_t)msg[14]) << 48U;
-		case 14:
-			d += ((uint64_t)msg[13]) << 40U;
-		case 13:
-			d += ((uint64_t)msg[12]) << 32U;
-		case 12:
-			d += *(uint32_t*)(msg+8);
-			c += *(uint64_t*)msg;
-			break;
-		case 11:
-			d += ((uint64_t)msg[10]) << 16U;
-		case 10:
-			d += ((uint64_t)msg[9]) << 8U;
-		case 9:
-			d += (uint64_t)msg[8];
-		case 8:
-			c += *(uint64_t*)msg;
-			break;
-		case 7:
-			c += ((uint64_t)msg[6]) << 48U;
-		case 6:
-			c += ((uint64_t)msg[5]) << 40U;
-		case 5:
-			c += ((uint64_t)msg[4]) << 32U;
-		case 4:
-			c += *(uint32_t*)msg;
-			break;
-		case 3:
-			c += ((uint64_t)msg[2]) << 16U;
-		case 2:
-			c += ((uint64_t)msg[1]) << 8U;
-		case 1:
-			c += (uint64_t)msg[0];
-			break;
-		case 0:
-			c += magic;
-			d += magic;
-	}
+	Tail(msg, len, c, d);
 	End(a, b, c, d);
 
 	return {a, b};
 }
 
+using BatchHashFunc = void (*)(const uint8_t* const msgs[], unsigned n, unsigned len, uint64_t seed, V128 out[]);
+
+static void HashTo128Scalar(const uint8_t* const msgs[], unsigned n, unsigned len, uint64_t seed, V128 out[]) {
+	for (unsigned i = 0; i < n; i++) {
+		out[i] = HashTo128(msgs[i], len, seed);
+	}
+}
+
+#ifdef SHD_SIMD_DISPATCH
+#if defined(_MSC_VER) && !defined(__clang__)
+static bool DetectAVX(bool avx512) noexcept {
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) {
+		return false;
+	}
+	__cpuid(info, 1);
+	constexpr int osxsave = 1 << 27;
+	if ((info[2] & osxsave) == 0) {
+		return false;
+	}
+	const auto xcr0 = _xgetbv(0);
+	if ((xcr0 & 0x6U) != 0x6U || (avx512 && (xcr0 & 0xe0U) != 0xe0U)) {
+		return false;
+	}
+	__cpuidex(info, 7, 0);
+	return avx512? (info[1] & (1 << 16)) != 0 : (info[1] & (1 << 5)) != 0;
+}
+#else
+static bool DetectAVX(bool avx512) noexcept {
+	__builtin_cpu_init();
+	return avx512? __builtin_cpu_supports("avx512f") : __builtin_cpu_supports("avx2");
+}
+#endif
+#endif
+
+static BatchHashFunc PickBatchHash() noexcept {
+#ifdef SHD_SIMD_DISPATCH
+	if (DetectAVX(true)) {
+		return HashTo128AVX512;
+	}
+	if (DetectAVX(false)) {
+		return HashTo128AVX2;
+	}
+#endif
+	return HashTo128Scalar;
+}
+
+static const BatchHashFunc SHD_BATCH_HASH = PickBatchHash();
+
+void HashTo128(const uint8_t* const msgs[], unsigned n, unsigned len, uint64_t seed, V128 out[]) {
+	SHD_BATCH_HASH(msgs, n, len, seed, out);
+}
+
+using BatchModFunc = void (*)(const uint64_t x[], unsigned n, const LaneModulus& m, uint64_t out[]);
+
+//scalar code does better with Divisor, so there is no scalar kernel
+static BatchModFunc PickBatchMod() noexcept {
+#ifdef SHD_SIMD_DISPATCH
+	if (DetectAVX(true)) {
+		return BatchModAVX512;
+	}
+	if (DetectAVX(false)) {
+		return BatchModAVX2;
+	}
+#endif
+	return nullptr;
+}
+
+static const BatchModFunc SHD_BATCH_MOD = PickBatchMod();
+
+bool HasBatchMod() noexcept {
+	return SHD_BATCH_MOD != nullptr;
+}
+
+void BatchMod(const uint64_t x[], unsigned n, const LaneModulus& m, uint64_t out[]) {
+	if (SHD_BATCH_MOD != nullptr) {
+		SHD_BATCH_MOD(x, n, m, out);
+		return;
+	}
+	for (unsigned i = 0; i < n; i++) {
+		out[i] = x[i] % m.n;
+	}
+}
+
 } //shd
@@ -0,0 +1,254 @@
+//==============================================================================
+// Skew Hash and Displace Algorithm.
+// Copyright (C) 2020  Ruan Kunliang
+//
+// This library is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the Free
+// Software Foundation; either version 2.1 of the License, or (at your option)
+// any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+// details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with the This Library; if not, see <https://www.gnu.org/licenses/>.
+//==============================================================================
+
+#pragma once
+#ifndef SHD_HASH_H_
+#define SHD_HASH_H_
+
+#include <cstring>
+#include "common.h"
+
+// Shared by scalar and multi-lane SpookyHash, and by the multi-lane modulo of
+// L2 positions. Kernels built with extra ISA flags include this header too,
+// so nothing here may pull in std templates.
+
+namespace shd {
+
+static constexpr uint64_t SPOOKY_MAGIC = 0xdeadbeefdeadbeefULL;
+
+template <unsigned K>
+static FORCE_INLINE uint64_t Rot(uint64_t x) {
+	return (x << K) | (x >> (64U - K));
+}
+
+template <typename W>
+static FORCE_INLINE void Mix(W& h0, W& h1, W& h2, W& h3) {
+	h2 = Rot<50>(h2);  h2 += h3;  h0 ^= h2;
+	h3 = Rot<52>(h3);  h3 += h0;  h1 ^= h3;
+	h0 = Rot<30>(h0);  h0 += h1;  h2 ^= h0;
+	h1 = Rot<41>(h1);  h1 += h2;  h3 ^= h1;
+	h2 = Rot<54>(h2);  h2 += h3;  h0 ^= h2;
+	h3 = Rot<48>(h3);  h3 += h0;  h1 ^= h3;
+	h0 = Rot<38>(h0);  h0 += h1;  h2 ^= h0;
+	h1 = Rot<37>(h1);  h1 += h2;  h3 ^= h1;
+	h2 = Rot<62>(h2);  h2 += h3;  h0 ^= h2;
+	h3 = Rot<34>(h3);  h3 += h0;  h1 ^= h3;
+	h0 = Rot<5>(h0);   h0 += h1;  h2 ^= h0;
+	h1 = Rot<36>(h1);  h1 += h2;  h3 ^= h1;
+}
+
+template <typename W>
+static FORCE_INLINE void End(W& h0, W& h1, W& h2, W& h3) {
+	h3 ^= h2;  h2 = Rot<15>(h2);  h3 += h2;
+	h0 ^= h3;  h3 = Rot<52>(h3);  h0 += h3;
+	h1 ^= h0;  h0 = Rot<26>(h0);  h1 += h0;
+	h2 ^= h1;  h1 = Rot<51>(h1);  h2 += h1;
+	h3 ^= h2;  h2 = Rot<28>(h2);  h3 += h2;
+	h0 ^= h3;  h3 = Rot<9>(h3);   h0 += h3;
+	h1 ^= h0;  h0 = Rot<47>(h0);  h1 += h0;
+	h2 ^= h1;  h1 = Rot<54>(h1);  h2 += h1;
+	h3 ^= h2;  h2 = Rot<32>(h2);  h3 += h2;
+	h0 ^= h3;  h3 = Rot<25>(h3);  h0 += h3;
+	h1 ^= h0;  h0 = Rot<63>(h0);  h1 += h0;
+}
+
+static FORCE_INLINE uint64_t Load64(const uint8_t* p) {
+	uint64_t x;
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+//msg points behind the last 16B block
+static FORCE_INLINE void Tail(const uint8_t* msg, unsigned len, uint64_t& c, uint64_t& d) {
+	d += ((uint64_t)len) << 56U;
+	switch (len & 0xfU) {
+		case 15:
+			d += ((uint64_t)msg[14]) << 48U;
+		case 14:
+			d += ((uint64_t)msg[13]) << 40U;
+		case 13:
+			d += ((uint64_t)msg[12]) << 32U;
+		case 12:
+			d += *(uint32_t*)(msg+8);
+			c += *(uint64_t*)msg;
+			break;
+		case 11:
+			d += ((uint64_t)msg[10]) << 16U;
+		case 10:
+			d += ((uint64_t)msg[9]) << 8U;
+		case 9:
+			d += (uint64_t)msg[8];
+		case 8:
+			c += *(uint64_t*)msg;
+			break;
+		case 7:
+			c += ((uint64_t)msg[6]) << 48U;
+		case 6:
+			c += ((uint64_t)msg[5]) << 40U;
+		case 5:
+			c += ((uint64_t)msg[4]) << 32U;
+		case 4:
+			c += *(uint32_t*)msg;
+			break;
+		case 3:
+			c += ((uint64_t)msg[2]) << 16U;
+		case 2:
+			c += ((uint64_t)msg[1]) << 8U;
+		case 1:
+			c += (uint64_t)msg[0];
+			break;
+		case 0:
+			c += SPOOKY_MAGIC;
+			d += SPOOKY_MAGIC;
+	}
+}
+
+//W wraps WIDTH 64-bit lanes, all messages share the same length
+template <typename W>
+static FORCE_INLINE void HashLanes(const uint8_t* const msgs[], unsigned len, uint64_t seed, V128 out[]) {
+	constexpr unsigned N = W::WIDTH;
+	uint64_t tmp[N];
+	auto load = [msgs, &tmp](size_t off)->W {
+		for (unsigned j = 0; j < N; j++) {
+			tmp[j] = Load64(msgs[j]+off);
+		}
+		return W::Load(tmp);
+	};
+
+	W a = W::Splat(seed);
+	W b = a;
+	W c = W::Splat(SPOOKY_MAGIC);
+	W d = c;
+
+	size_t off = 0;	//keep address arithmetic in 64 bits for gathers
+	for (; off+32U <= len; off += 32U) {
+		c += load(off);
+		d += load(off+8U);
+		Mix(a, b, c, d);
+		a += load(off+16U);
+		b += load(off+24U);
+	}
+	if (len & 0x10U) {
+		c += load(off);
+		d += load(off+8U);
+		Mix(a, b, c, d);
+		off += 16U;
+	}
+
+	uint64_t tc[N];
+	for (unsigned j = 0; j < N; j++) {
+		tc[j] = 0;
+		tmp[j] = 0;
+		Tail(msgs[j]+off, len, tc[j], tmp[j]);
+	}
+	c += W::Load(tc);
+	d += W::Load(tmp);
+	End(a, b, c, d);
+
+	a.store(tc);
+	b.store(tmp);
+	for (unsigned j = 0; j < N; j++) {
+		out[j] = {tc[j], tmp[j]};
+	}
+}
+
+//handle any n with full lanes, the last message fills unused lanes
+template <typename W>
+static FORCE_INLINE void HashGroup(const uint8_t* const msgs[], unsigned n, unsigned len, uint64_t seed, V128 out[]) {
+	constexpr unsigned N = W::WIDTH;
+	unsigned i = 0;
+	for (; i+N <= n; i += N) {
+		HashLanes<W>(msgs+i, len, seed, out+i);
+	}
+	if (i < n) {
+		const uint8_t* pad[N];
+		V128 res[N];
+		for (unsigned j = 0; j < N; j++) {
+			pad[j] = msgs[i+j < n? i+j : n-1];
+		}
+		HashLanes<W>(pad, len, seed, res);
+		for (unsigned j = 0; i+j < n; j++) {
+			out[i+j] = res[j];
+		}
+	}
+}
+
+//high 64 bits of a*b, from four 32x32 products
+template <typename W>
+static FORCE_INLINE W MulHi(const W& a, const W& b) {
+	const W a1 = a.shr32();
+	const W b1 = b.shr32();
+	W t = W::Mul32(a1, b);
+	t += W::Mul32(a, b).shr32();
+	W w = t.low32();
+	w += W::Mul32(a, b1);
+	W out = W::Mul32(a1, b1);
+	out += t.shr32();
+	out += w.shr32();
+	return out;
+}
+
+//low 64 bits of a*b
+template <typename W>
+static FORCE_INLINE W MulLo(const W& a, const W& b) {
+	W cross = W::Mul32(a.shr32(), b);
+	cross += W::Mul32(a, b.shr32());
+	W out = W::Mul32(a, b);
+	out += cross.shl32();
+	return out;
+}
+
+//Quotient from inv = UINT64_MAX / n falls short by 2 at most, so the
+//remainder is below 3n and two subtractions fix it.
+template <typename W>
+static FORCE_INLINE void ModLanes(const uint64_t x[], const LaneModulus& m, uint64_t out[]) {
+	const W n = W::Splat(m.n);
+	const W v = W::Load(x);
+	W r = v - MulLo(MulHi(v, W::Splat(m.inv)), n);
+	r = r.sub_if_ge(n);
+	r = r.sub_if_ge(n);
+	r.store(out);
+}
+
+template <typename W>
+static FORCE_INLINE void ModGroup(const uint64_t x[], unsigned n, const LaneModulus& m, uint64_t out[]) {
+	constexpr unsigned N = W::WIDTH;
+	unsigned i = 0;
+	for (; i+N <= n; i += N) {
+		ModLanes<W>(x+i, m, out+i);
+	}
+	if (i < n) {
+		uint64_t pad[N];
+		uint64_t res[N];
+		for (unsigned j = 0; j < N; j++) {
+			pad[j] = i+j < n? x[i+j] : 0;
+		}
+		ModLanes<W>(pad, m, res);
+		for (unsigned j = 0; i+j < n; j++) {
+			out[i+j] = res[j];
+		}
+	}
+}
+
+extern void HashTo128AVX2(const uint8_t* const msgs[], unsigned n, unsigned len, uint64_t seed, V128 out[]);
+extern void HashTo128AVX512(const uint8_t* const msgs[], unsigned n, unsigned len, uint64_t seed, V128 out[]);
+extern void BatchModAVX2(const uint64_t x[], unsigned n, const LaneModulus& m, uint64_t out[]);
+extern void BatchModAVX512(const uint64_t x[], unsigned n, const LaneModulus& m, uint64_t out[]);
+
+} // shd
+#endif // SHD_HASH_H_
@@ -0,0 +1,84 @@
+//==============================================================================
+// Skew Hash and Displace Algorithm.
+// Copyright (C) 2020  Ruan Kunliang
+//
+// This library is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the Free
+// Software Foundation; either version 2.1 of the License, or (at your option)
+// any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+// details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with the This Library; if not, see <https://www.gnu.org/licenses/>.
+//==============================================================================
+
+#include "hash.h"
+
+#ifdef SHD_SIMD_DISPATCH
+#include <immintrin.h>
+
+namespace shd {
+
+struct Lane4 {
+	static constexpr unsigned WIDTH = 4;
+	__m256i v;
+
+	static FORCE_INLINE Lane4 Splat(uint64_t x) {
+		return {_mm256_set1_epi64x(static_cast<long long>(x))};
+	}
+	static FORCE_INLINE Lane4 Load(const uint64_t x[]) {
+		return {_mm256_loadu_si256(reinterpret_cast<const __m256i*>(x))};
+	}
+	FORCE_INLINE void store(uint64_t x[]) const {
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(x), v);
+	}
+	FORCE_INLINE Lane4& operator+=(const Lane4& o) {
+		v = _mm256_add_epi64(v, o.v);
+		return *this;
+	}
+	FORCE_INLINE Lane4& operator^=(const Lane4& o) {
+		v = _mm256_xor_si256(v, o.v);
+		return *this;
+	}
+	FORCE_INLINE Lane4 operator-(const Lane4& o) const {
+		return {_mm256_sub_epi64(v, o.v)};
+	}
+	FORCE_INLINE Lane4 shr32() const {
+		return {_mm256_srli_epi64(v, 32)};
+	}
+	FORCE_INLINE Lane4 shl32() const {
+		return {_mm256_slli_epi64(v, 32)};
+	}
+	FORCE_INLINE Lane4 low32() const {
+		return {_mm256_blend_epi32(v, _mm256_setzero_si256(), 0xaa)};
+	}
+	static FORCE_INLINE Lane4 Mul32(const Lane4& a, const Lane4& b) {
+		return {_mm256_mul_epu32(a.v, b.v)};
+	}
+	//unsigned compare by flipping sign bits
+	FORCE_INLINE Lane4 sub_if_ge(const Lane4& n) const {
+		const auto sign = _mm256_set1_epi64x(static_cast<long long>(1ULL << 63U));
+		const auto lt = _mm256_cmpgt_epi64(_mm256_xor_si256(n.v, sign), _mm256_xor_si256(v, sign));
+		return {_mm256_sub_epi64(v, _mm256_andnot_si256(lt, n.v))};
+	}
+};
+
+template <unsigned K>
+static FORCE_INLINE Lane4 Rot(Lane4 x) {
+	return {_mm256_or_si256(_mm256_slli_epi64(x.v, K), _mm256_srli_epi64(x.v, 64U - K))};
+}
+
+void HashTo128AVX2(const uint8_t* const msgs[], unsigned n, unsigned len, uint64_t seed, V128 out[]) {
+	HashGroup<Lane4>(msgs, n, len, seed, out);
+}
+
+void BatchModAVX2(const uint64_t x[], unsigned n, const LaneModulus& m, uint64_t out[]) {
+	ModGroup<Lane4>(x, n, m, out);
+}
+
+} // shd
+#endif
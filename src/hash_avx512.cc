@@ -0,0 +1,81 @@
+//==============================================================================
+// Skew Hash and Displace Algorithm.
+// Copyright (C) 2020  Ruan Kunliang
+//
+// This library is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the Free
+// Software Foundation; either version 2.1 of the License, or (at your option)
+// any later version.
+//
+// This library is distributed in the hope that it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+// details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with the This Library; if not, see <https://www.gnu.org/licenses/>.
+//==============================================================================
+
+#include "hash.h"
+
+#ifdef SHD_SIMD_DISPATCH
+#include <immintrin.h>
+
+namespace shd {
+
+struct Lane8 {
+	static constexpr unsigned WIDTH = 8;
+	__m512i v;
+
+	static FORCE_INLINE Lane8 Splat(uint64_t x) {
+		return {_mm512_set1_epi64(static_cast<long long>(x))};
+	}
+	static FORCE_INLINE Lane8 Load(const uint64_t x[]) {
+		return {_mm512_loadu_si512(x)};
+	}
+	FORCE_INLINE void store(uint64_t x[]) const {
+		_mm512_storeu_si512(x, v);
+	}
+	FORCE_INLINE Lane8& operator+=(const Lane8& o) {
+		v = _mm512_add_epi64(v, o.v);
+		return *this;
+	}
+	FORCE_INLINE Lane8& operator^=(const Lane8& o) {
+		v = _mm512_xor_si512(v, o.v);
+		return *this;
+	}
+	FORCE_INLINE Lane8 operator-(const Lane8& o) const {
+		return {_mm512_sub_epi64(v, o.v)};
+	}
+	FORCE_INLINE Lane8 shr32() const {
+		return {_mm512_srli_epi64(v, 32)};
+	}
+	FORCE_INLINE Lane8 shl32() const {
+		return {_mm512_slli_epi64(v, 32)};
+	}
+	FORCE_INLINE Lane8 low32() const {
+		return {_mm512_and_si512(v, _mm512_set1_epi64(0xffffffffLL))};
+	}
+	static FORCE_INLINE Lane8 Mul32(const Lane8& a, const Lane8& b) {
+		return {_mm512_mul_epu32(a.v, b.v)};
+	}
+	FORCE_INLINE Lane8 sub_if_ge(const Lane8& n) const {
+		return {_mm512_mask_sub_epi64(v, _mm512_cmpge_epu64_mask(v, n.v), v, n.v)};
+	}
+};
+
+template <unsigned K>
+static FORCE_INLINE Lane8 Rot(Lane8 x) {
+	return {_mm512_rol_epi64(x.v, K)};
+}
+
+void HashTo128AVX512(const uint8_t* const msgs[], unsigned n, unsigned len, uint64_t seed, V128 out[]) {
+	HashGroup<Lane8>(msgs, n, len, seed, out);
+}
+
+void BatchModAVX512(const uint64_t x[], unsigned n, const LaneModulus& m, uint64_t out[]) {
+	ModGroup<Lane8>(x, n, m, out);
+}
+
+} // shd
+#endif
@@ -21,6 +21,9 @@
 #define SHD_INTERNAL_H_
 
 #include <cstring>
+#include <atomic>
+#include <memory>
+#include <vector>
 #include <functional>
 #if defined(_MSC_VER) && !defined(__clang__)
 #include <intrin.h>
@@ -28,6 +31,7 @@
 //#define SHD_PACK_SIZE 4
 #include <shd.h>
 #include "common.h"
+#include "pipeline.h"
 
 namespace shd {
 
@@ -57,11 +61,14 @@ static FORCE_INLINE bool operator==(const V96& a, const V96& b) {
 	return ax.u.l64 == bx.u.l64 && ax.u.h32 == bx.u.h32;
 }
 
-static FORCE_INLINE V96 GenID(uint32_t seed, const uint8_t* key, uint8_t len) {
+static FORCE_INLINE V96 ToID(const V128& code) {
 	V128X tmp;
-	tmp.v = HashTo128(key, len, seed);
+	tmp.v = code;
 	return tmp.u.l96;
 }
+static FORCE_INLINE V96 GenID(uint32_t seed, const uint8_t* key, uint8_t len) {
+	return ToID(HashTo128(key, len, seed));
+}
 static FORCE_INLINE uint16_t L0Hash(const V96& id) {
 	return id.u[0];
 }
@@ -76,6 +83,15 @@ static FORCE_INLINE uint64_t L2Hash(const V96& id, uint8_t sd8) {
 	return tmp.v.l ^ tmp.v.h;
 }
 
+//A segment failed to build is retried alone with a salt. It moves keys to other
+//cells and bits, but keeps segment, fingerprint and key tag. Salt 0 changes nothing,
+//and salting twice with the same salt restores the id.
+static constexpr uint8_t SEGMENT_SALT_FLAG = 0x08;	//marked in Header.type
+static FORCE_INLINE V96 SaltID(V96 id, uint32_t salt) {
+	id.u[1] ^= (((uint64_t)id.u[2] * salt) * 0x9E3779B97F4A7C15ULL) >> 32U;
+	return id;
+}
+
 static FORCE_INLINE unsigned PopCount32(uint32_t x) {
 	static_assert(sizeof(int)==sizeof(uint32_t));
 	#if defined(_MSC_VER) && !defined(__clang__)
@@ -214,6 +230,82 @@ static FORCE_INLINE constexpr uint32_t BitmapSize(uint32_t item) {
 	return SectionSize(item) * (BITMAP_SECTION_SIZE/8U);
 }
 
+//In local layout, bitmap position of a key stays in a section pair (64B) picked
+//by id alone, so the pair can be fetched along with the cell.
+static constexpr uint8_t LOCAL_L2_FLAG = 0x80;	//marked in Header.type
+static constexpr unsigned L2_PAIR_SIZE = BITMAP_SECTION_SIZE * 2U;
+
+static FORCE_INLINE constexpr uint32_t L2Pairs(uint32_t item) {
+	return (L2Size(item) + (L2_PAIR_SIZE-1)) / L2_PAIR_SIZE;
+}
+static FORCE_INLINE constexpr uint32_t SectionSize(uint32_t item, bool local) {
+	return local? L2Pairs(item)*2U : SectionSize(item);
+}
+static FORCE_INLINE constexpr uint32_t BitmapSize(uint32_t item, bool local) {
+	return SectionSize(item, local) * (BITMAP_SECTION_SIZE/8U);
+}
+
+static FORCE_INLINE uint32_t L2Pair(const V96& id, uint32_t pairs) {
+	return ((uint64_t)id.u[2] * pairs) >> 32U;
+}
+//sd8 only touches the high half of L2Hash, multiplication spreads it down
+static FORCE_INLINE uint64_t LocalL2Pos(const V96& id, uint8_t sd8, uint32_t pairs) {
+	const uint64_t x = L2Hash(id, sd8) * 0x9E3779B97F4A7C15ULL;
+	return (uint64_t)L2Pair(id, pairs) * L2_PAIR_SIZE + (((x >> 32U) * L2_PAIR_SIZE) >> 32U);
+}
+
+//In split layout, keys and values of KV_INLINE live in two arrays, both 64B aligned.
+static constexpr uint8_t SPLIT_KV_FLAG = 0x40;	//marked in Header.type
+
+static FORCE_INLINE constexpr uint64_t SplitValueOffset(uint64_t item, uint8_t key_len) {
+	return (item*key_len + 63U) & ~63ULL;
+}
+
+//Fingerprint avoids the bits which decide segment and cell, then keeps the
+//low 8/16/32 bits. A stranger passes with chance about 2^-bits.
+static FORCE_INLINE uint32_t Fingerprint(const V96& id) {
+	const uint64_t x = ((((uint64_t)id.u[2]) << 32U) | (id.u[0] >> 16U)) * 0x9E3779B97F4A7C15ULL;
+	return x >> 32U;
+}
+static FORCE_INLINE constexpr bool IsFingerprintSize(unsigned size) {
+	return size == 1 || size == 2 || size == 4;
+}
+static FORCE_INLINE void WriteFingerprint(uint8_t* field, uint32_t fp, unsigned size) {
+	memcpy(field, &fp, size);	//little endian
+}
+static FORCE_INLINE bool MatchFingerprint(const uint8_t* field, uint32_t fp, unsigned size) {
+	uint32_t tmp = 0;
+	memcpy(&tmp, field, size);
+	return tmp == (size == 4? fp : fp & ((1U << (size*8U)) - 1U));
+}
+
+//With variable length key, a line starts with a reference into the key arena
+//instead of the key itself. The tag comes from id, so most strangers of the
+//same length are told apart before touching the arena.
+static constexpr uint8_t VAR_KEY_FLAG = 0x10;	//marked in Header.type
+static constexpr uint8_t KEY_REF_SIZE = 8;	//offset:40, len:8, tag:16
+static constexpr unsigned KEY_REF_OFFSET_BITS = 40;
+static constexpr uint64_t MAX_KEY_ARENA = (1ULL<<KEY_REF_OFFSET_BITS)-1;
+
+struct KeyRef {
+	uint64_t offset;
+	uint8_t len;
+	uint16_t tag;
+};
+
+static FORCE_INLINE uint16_t KeyTag(const V96& id) {
+	return Fingerprint(id) >> 16U;
+}
+static FORCE_INLINE KeyRef ReadKeyRef(const uint8_t* field) {
+	uint64_t x;
+	memcpy(&x, field, sizeof(x));
+	return {x & MAX_KEY_ARENA, (uint8_t)(x >> KEY_REF_OFFSET_BITS), (uint16_t)(x >> 48U)};
+}
+static FORCE_INLINE void WriteKeyRef(uint8_t* field, const KeyRef& ref) {
+	const uint64_t x = ref.offset | ((uint64_t)ref.len << KEY_REF_OFFSET_BITS) | ((uint64_t)ref.tag << 48U);
+	memcpy(field, &x, sizeof(x));
+}
+
 //optimize for common short cases
 static FORCE_INLINE bool Equal(const uint8_t* a, const uint8_t* b, uint8_t len) {
 	if (len == sizeof(uint64_t)) {
@@ -249,24 +341,71 @@ static FORCE_INLINE void WriteOffsetField(uint8_t* field, size_t offset) {
 }
 
 
+//Values of KV_SEPARATED may be packed into compressed blocks, each holds
+//VALUE_BLOCK_SIZE bytes of the raw stream, so offset field of a line reads
+//as (block << VALUE_BLOCK_SHIFT | offset in block).
+static constexpr uint8_t COMPRESS_VALUE_FLAG = 0x20;	//marked in Header.type
+static constexpr unsigned VALUE_BLOCK_SHIFT = 16;
+static constexpr size_t VALUE_BLOCK_SIZE = 1ULL << VALUE_BLOCK_SHIFT;
+
+struct BlockTrailer {
+	uint64_t raw_size = 0;
+	uint64_t block_cnt = 0;
+	uint32_t block_shift = 0;
+	uint32_t magic = 0;
+};
+
+struct ValueBlocks {
+	const uint8_t* data = nullptr;	//compressed blocks
+	const uint8_t* ends = nullptr;	//uint64_t[cnt], end of each block in data
+	uint64_t cnt = 0;
+	uint64_t raw_size = 0;
+	uint64_t uid = 0;
+};
+
+//Compress what is written into blocks, finish() appends block ends and trailer.
+class BlockWriter : public IDataWriter {
+public:
+	explicit BlockWriter(IDataWriter& out);
+	bool operator!() const noexcept override { return !m_out; }
+	bool flush() override;
+	bool write(const void* data, size_t n) override;
+	bool finish();
+
+private:
+	IDataWriter& m_out;
+	std::unique_ptr<uint8_t[]> m_raw;
+	std::unique_ptr<uint8_t[]> m_packed;
+	size_t m_fill = 0;
+	uint64_t m_done = 0;
+	uint64_t m_raw_size = 0;
+	std::vector<uint64_t> m_ends;
+
+	bool _dump();
+};
+
 using Type = PerfectHashtable::Type;
 
 struct Header {
 	uint32_t magic = SHD_MAGIC;
-	uint8_t type = Type::INDEX_ONLY;
+	uint8_t type = Type::INDEX_ONLY;	//may carry layout flags
 	uint8_t key_len = 0;
-	uint16_t val_len = 0;
+	uint16_t val_len = 0;	//fingerprint size for FINGERPRINT_SET
 	uint32_t seed = 0;
 	uint32_t item = 0;
 	uint16_t item_high = 0;
 	uint16_t seg_cnt = 0;
 	//uint32_t parts[seg_cnt] = 0;
+	//uint32_t salts[seg_cnt] = 0;		only with SEGMENT_SALT_FLAG
 
 	// uint8_t cells[]
-	// 32B align
+	// 32B align, 64B for local layout
 	// BitmapSection sections[]
 
 	// key_val[item] or key_off[item]		sizeof(key_off)-key_len is val_len
+	// or 64B align, key[item], 64B align, val[item] for split layout
+	// with variable length key, key is replaced by KeyRef and key_len is 0,
+	// then uint64_t arena_size, uint8_t keys[arena_size] follow
 	// separated_value[], dynamic length, length mark is embedded
 };
 
@@ -276,19 +415,30 @@ struct SegmentView {
 	Divisor<uint64_t> l1bd;
 	Divisor<uint64_t> l2sz;
 	uint64_t offset = 0; //item offset
+	uint32_t l2pairs = 0; //only for local layout
+	uint32_t salt = 0;
 };
 
+struct HotCache;
+
 struct PackView {
 	Type type = Type::INDEX_ONLY;
-	uint8_t key_len = 0;
+	uint8_t key_len = 0;	//KEY_REF_SIZE for variable length key
 	uint16_t val_len = 0;
-	uint32_t line_size = 0; //key_len+val_len
+	uint32_t line_size = 0; //key_len+val_len, or val_len for FINGERPRINT_SET
 	uint32_t seed = 0;
 	Divisor<uint16_t> l0sz;
+	uint8_t level = DEFAULT_PIPELINE_LEVEL;	//see WithPipelineLevel
+	IndexLayout layout = LAYOUT_SPREAD;
+	HotCache* hot = nullptr;
 	uint64_t item = 0;
 	const uint8_t* content = nullptr;
+	const uint8_t* values = nullptr;	//only for split layout
+	const uint8_t* keys = nullptr;	//key arena, only for variable length key
+	uint64_t keys_size = 0;
 	const uint8_t* extend = nullptr;
 	const uint8_t* space_end = nullptr;
+	ValueBlocks blocks;	//only for compressed value
 #if defined(_WIN32)
 	// MSVC does not support the zero-length flexible-array extension.
 	SegmentView segments[1];
@@ -297,30 +447,113 @@ struct PackView {
 #endif
 };
 
+static FORCE_INLINE uint32_t LineSize(Type type, uint8_t key_len, uint16_t val_len) {
+	return type == Type::FINGERPRINT_SET? val_len : key_len + (uint32_t)val_len;
+}
+
+static FORCE_INLINE const uint8_t* KeyAt(const PackView& pack, uint64_t pos) {
+	return pack.content + pos*(pack.values != nullptr? pack.key_len : pack.line_size);
+}
+static FORCE_INLINE const uint8_t* ValueAt(const PackView& pack, uint64_t pos, const uint8_t* key) {
+	return pack.values != nullptr? pack.values + pos*pack.val_len : key + pack.key_len;
+}
+
+//key of a line with variable length key, invalid if the reference is broken
+static FORCE_INLINE Slice VarKeyAt(const PackView& pack, const uint8_t* line) {
+	const auto ref = ReadKeyRef(line);
+	if (UNLIKELY(ref.offset + ref.len > pack.keys_size)) {
+		return {};
+	}
+	return {pack.keys + ref.offset, ref.len};
+}
+
+//Set-associative copy of hot lines, read only once built. A probe touches one
+//group of tags and at most one line, so hits skip the rest of the pipeline.
+struct HotCache {
+	static constexpr unsigned WAYS = 8;
+	uint32_t set_mask = 0;
+	uint32_t line_size = 0;
+	uint8_t key_len = 0;
+	const uint32_t* tags = nullptr;	//[set][way], 0 means empty
+	const uint8_t* lines = nullptr;	//[set][way]
+	alignas(64) uint64_t lookup = 0;	//keep counters away from read only fields
+	uint64_t hit = 0;
+};
+
+static FORCE_INLINE uint32_t HotTag(const V96& id) {
+	return (id.u[0] ^ id.u[1]) | 1U;
+}
+
+static FORCE_INLINE const uint8_t* FindHot(const HotCache& cache, const V96& id, const uint8_t* key) {
+	const uint32_t set = id.u[2] & cache.set_mask;
+	const auto tag = HotTag(id);
+	const auto tags = cache.tags + set*HotCache::WAYS;
+	for (unsigned w = 0; w < HotCache::WAYS; w++) {
+		if (tags[w] == tag) {
+			auto line = cache.lines + (set*HotCache::WAYS + w) * (size_t)cache.line_size;
+			if (LIKELY(Equal(key, line, cache.key_len))) {
+				return line;
+			}
+		}
+	}
+	return nullptr;
+}
+
+#ifdef SHD_TEST_HOOKS
+//the next build of this segment fails as out of chance
+extern std::atomic<uint32_t> g_fail_segment_once;
+#endif
+
+//only for KEY_SET and KV_INLINE, the most frequent keys found in pack are kept
+extern HotCache* CreateHotCache(const PackView& pack, unsigned n, const uint8_t* keys,
+								unsigned capacity, MemBlock& mem);
+
 extern std::unique_ptr<uint8_t[]> CreatePackView(const uint8_t* addr, size_t size);
 extern Slice SeparatedValue(const uint8_t* pt, const uint8_t* end);
 extern Slice SeparatedValueAt(const PackView& pack, const uint8_t* field);
 
+// Blocks follow the extend pointer and end with a trailer.
+extern bool LoadValueBlocks(const uint8_t* begin, const uint8_t* end, ValueBlocks& out);
+// Output lives in a thread local buffer till ResetValueArena in the same thread.
+extern Slice CompressedValueAt(const ValueBlocks& blocks, uint64_t offset) noexcept;
+extern void ResetValueArena() noexcept;
+
 // May return index.item.
 extern uint64_t CalcPos(const PackView& index, const uint8_t* key, uint8_t key_len);
+// May return index.item.
+extern uint64_t CalcPos(const PackView& index, const V96& id);
+// Only for FINGERPRINT_SET, returns matched fingerprint field or nullptr.
+extern const uint8_t* SearchFingerprint(const PackView& index, const uint8_t* key);
+// Only for variable length key, returns matched line or nullptr.
+extern const uint8_t* SearchVarKey(const PackView& index, const uint8_t* key, uint8_t key_len);
 
 static constexpr unsigned MINI_BATCH = 32;
 static constexpr unsigned DOUBLE_COPY_LINE_SIZE_LIMIT = 160;
 
+// Reader fills a window of n lines or keys at once, keys of the window are hashed together.
+// Ids of the batch in reading order may be given to skip hashing, fingerprints
+// need no reader then.
 extern void BatchDataMapping(const PackView& index, uint8_t* space, size_t batch,
-							 const std::function<void(uint8_t*)>& reader);
-extern void BatchFindPos(const PackView& pack, size_t batch, const std::function<void(uint8_t*)>& reader,
+							 const std::function<void(uint8_t*, unsigned)>& reader, const V96* ids=nullptr);
+extern void BatchFingerprintMapping(const PackView& index, uint8_t* space, size_t batch,
+									const std::function<void(uint8_t*, unsigned)>& reader, const V96* ids=nullptr);
+extern void BatchFindPos(const PackView& pack, size_t batch, const std::function<void(uint8_t*, unsigned)>& reader,
 						 const std::function<void(uint64_t)>& output, const uint8_t* bitmap);
 
 // Each output may equal index.item.
 extern void BatchLocate(const PackView& index, unsigned batch, const uint8_t* __restrict keys,
 						uint8_t key_len, uint64_t* __restrict out);
 extern unsigned BatchSearch(const PackView& pack, unsigned batch, const uint8_t* const keys[], const uint8_t* out[]);
+// Compressed values are appended to the thread local arena, caller resets it.
+extern unsigned BatchSearch(const PackView& pack, unsigned batch, const uint8_t* const keys[], Slice out[]);
+// Only for variable length key, same arena rule as above.
+extern unsigned BatchSearch(const PackView& pack, unsigned batch, const Slice keys[], Slice out[]);
 extern unsigned BatchFetch(const PackView& pack, const uint8_t* __restrict dft_val, unsigned batch,
 						   const uint8_t* __restrict keys, uint8_t* __restrict data, unsigned* __restrict miss);
-extern unsigned BatchSearch(const PackView& base, const PackView& patch, unsigned batch,
+// Layers are searched in order, the first hit wins.
+extern unsigned BatchSearch(const PackView* const layers[], unsigned depth, unsigned batch,
 							const uint8_t* const keys[], const uint8_t* out[]);
-extern unsigned BatchFetch(const PackView& base, const PackView& patch, const uint8_t* __restrict dft_val,
+extern unsigned BatchFetch(const PackView* const layers[], unsigned depth, const uint8_t* __restrict dft_val,
 						   unsigned batch, const uint8_t* __restrict keys, uint8_t* __restrict data,
 						   unsigned* __restrict miss);
 
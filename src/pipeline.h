@@ -90,6 +90,8 @@ void GenCode(unsigned depth) {
 #include <type_traits>
 #include "common.h"
 
+// In every variant p1 is called with index 0, 1, ..., n-1 in order.
+
 template <unsigned Bubble, typename P1, typename P2>
 static FORCE_INLINE void
 Pipeline(size_t n, const P1& p1, const P2& p2) {
@@ -218,6 +220,173 @@ Pipeline(size_t n, const P1& p1, const P2& p2, const P3& p3, const P4& p4) {
 	}
 }
 
+template <unsigned Bubble, typename P1, typename P2, typename P3, typename P4, typename P5>
+static FORCE_INLINE void
+Pipeline(size_t n, const P1& p1, const P2& p2, const P3& p3, const P4& p4, const P5& p5) {
+	using S1 = std::result_of_t<P1(size_t)>;
+	using S2 = std::result_of_t<P2(S1,size_t)>;
+	using S3 = std::result_of_t<P3(S2,size_t)>;
+	using S4 = std::result_of_t<P4(S3,size_t)>;
+	constexpr unsigned M = Bubble + 1;
+	if (n < M*4) {
+		union {
+			S1 s1; S2 s2; S3 s3; S4 s4;
+		} ctx[M*4-1];
+		for (size_t i = 0; i < n; i++) ctx[i].s1 = p1(i);
+		for (size_t i = 0; i < n; i++) ctx[i].s2 = p2(ctx[i].s1, i);
+		for (size_t i = 0; i < n; i++) ctx[i].s3 = p3(ctx[i].s2, i);
+		for (size_t i = 0; i < n; i++) ctx[i].s4 = p4(ctx[i].s3, i);
+		for (size_t i = 0; i < n; i++) p5(ctx[i].s4, i);
+		return;
+	}
+	S1 s1[M];
+	S2 s2[M];
+	S3 s3[M];
+	S4 s4[M];
+	for (unsigned j = 0; j < M; j++) {
+		s1[j] = p1(M*0+j);
+	}
+	for (unsigned j = 0; j < M; j++) {
+		s2[j] = p2(s1[j], M*0+j);
+		s1[j] = p1(M*1+j);
+	}
+	for (unsigned j = 0; j < M; j++) {
+		s3[j] = p3(s2[j], M*0+j);
+		s2[j] = p2(s1[j], M*1+j);
+		s1[j] = p1(M*2+j);
+	}
+	for (unsigned j = 0; j < M; j++) {
+		s4[j] = p4(s3[j], M*0+j);
+		s3[j] = p3(s2[j], M*1+j);
+		s2[j] = p2(s1[j], M*2+j);
+		s1[j] = p1(M*3+j);
+	}
+	unsigned k = 0;
+	for (size_t i = M*4; i < n; i++) {
+		p5(s4[k], i-M*4);
+		s4[k] = p4(s3[k], i-M*3);
+		s3[k] = p3(s2[k], i-M*2);
+		s2[k] = p2(s1[k], i-M*1);
+		s1[k] = p1(i);
+		if (++k >= M) k = 0;
+	}
+	for (unsigned j = 0; j < M; j++) {
+		p5(s4[k], n-M*4+j);
+		s4[k] = p4(s3[k], n-M*3+j);
+		s3[k] = p3(s2[k], n-M*2+j);
+		s2[k] = p2(s1[k], n-M*1+j);
+		if (++k >= M) k = 0;
+	}
+	for (unsigned j = 0; j < M; j++) {
+		p5(s4[k], n-M*3+j);
+		s4[k] = p4(s3[k], n-M*2+j);
+		s3[k] = p3(s2[k], n-M*1+j);
+		if (++k >= M) k = 0;
+	}
+	for (unsigned j = 0; j < M; j++) {
+		p5(s4[k], n-M*2+j);
+		s4[k] = p4(s3[k], n-M*1+j);
+		if (++k >= M) k = 0;
+	}
+	for (unsigned j = 0; j < M; j++) {
+		p5(s4[k], n-M*1+j);
+		if (++k >= M) k = 0;
+	}
+}
+
+template <unsigned Bubble, typename P1, typename P2, typename P3, typename P4, typename P5, typename P6>
+static FORCE_INLINE void
+Pipeline(size_t n, const P1& p1, const P2& p2, const P3& p3, const P4& p4, const P5& p5, const P6& p6) {
+	using S1 = std::result_of_t<P1(size_t)>;
+	using S2 = std::result_of_t<P2(S1,size_t)>;
+	using S3 = std::result_of_t<P3(S2,size_t)>;
+	using S4 = std::result_of_t<P4(S3,size_t)>;
+	using S5 = std::result_of_t<P5(S4,size_t)>;
+	constexpr unsigned M = Bubble + 1;
+	if (n < M*5) {
+		union {
+			S1 s1; S2 s2; S3 s3; S4 s4; S5 s5; 
+		} ctx[M*5-1];
+		for (size_t i = 0; i < n; i++) ctx[i].s1 = p1(i);
+		for (size_t i = 0; i < n; i++) ctx[i].s2 = p2(ctx[i].s1, i);
+		for (size_t i = 0; i < n; i++) ctx[i].s3 = p3(ctx[i].s2, i);
+		for (size_t i = 0; i < n; i++) ctx[i].s4 = p4(ctx[i].s3, i);
+		for (size_t i = 0; i < n; i++) ctx[i].s5 = p5(ctx[i].s4, i);
+		for (size_t i = 0; i < n; i++) p6(ctx[i].s5, i);
+		return;
+	}
+	S1 s1[M];
+	S2 s2[M];
+	S3 s3[M];
+	S4 s4[M];
+	S5 s5[M];
+	for (unsigned j = 0; j < M; j++) {
+		s1[j] = p1(M*0+j);
+	}
+	for (unsigned j = 0; j < M; j++) {
+		s2[j] = p2(s1[j], M*0+j);
+		s1[j] = p1(M*1+j);
+	}
+	for (unsigned j = 0; j < M; j++) {
+		s3[j] = p3(s2[j], M*0+j);
+		s2[j] = p2(s1[j], M*1+j);
+		s1[j] = p1(M*2+j);
+	}
+	for (unsigned j = 0; j < M; j++) {
+		s4[j] = p4(s3[j], M*0+j);
+		s3[j] = p3(s2[j], M*1+j);
+		s2[j] = p2(s1[j], M*2+j);
+		s1[j] = p1(M*3+j);
+	}
+	for (unsigned j = 0; j < M; j++) {
+		s5[j] = p5(s4[j], M*0+j);
+		s4[j] = p4(s3[j], M*1+j);
+		s3[j] = p3(s2[j], M*2+j);
+		s2[j] = p2(s1[j], M*3+j);
+		s1[j] = p1(M*4+j);
+	}
+	unsigned k = 0;
+	for (size_t i = M*5; i < n; i++) {
+		p6(s5[k], i-M*5);
+		s5[k] = p5(s4[k], i-M*4);
+		s4[k] = p4(s3[k], i-M*3);
+		s3[k] = p3(s2[k], i-M*2);
+		s2[k] = p2(s1[k], i-M*1);
+		s1[k] = p1(i);
+		if (++k >= M) k = 0;
+	}
+	for (unsigned j = 0; j < M; j++) {
+		p6(s5[k], n-M*5+j);
+		s5[k] = p5(s4[k], n-M*4+j);
+		s4[k] = p4(s3[k], n-M*3+j);
+		s3[k] = p3(s2[k], n-M*2+j);
+		s2[k] = p2(s1[k], n-M*1+j);
+		if (++k >= M) k = 0;
+	}
+	for (unsigned j = 0; j < M; j++) {
+		p6(s5[k], n-M*4+j);
+		s5[k] = p5(s4[k], n-M*3+j);
+		s4[k] = p4(s3[k], n-M*2+j);
+		s3[k] = p3(s2[k], n-M*1+j);
+		if (++k >= M) k = 0;
+	}
+	for (unsigned j = 0; j < M; j++) {
+		p6(s5[k], n-M*3+j);
+		s5[k] = p5(s4[k], n-M*2+j);
+		s4[k] = p4(s3[k], n-M*1+j);
+		if (++k >= M) k = 0;
+	}
+	for (unsigned j = 0; j < M; j++) {
+		p6(s5[k], n-M*2+j);
+		s5[k] = p5(s4[k], n-M*1+j);
+		if (++k >= M) k = 0;
+	}
+	for (unsigned j = 0; j < M; j++) {
+		p6(s5[k], n-M*1+j);
+		if (++k >= M) k = 0;
+	}
+}
+
 template <unsigned Bubble, typename P1, typename P2, typename P3, typename P4, typename P5, typename P6, typename P7>
 static FORCE_INLINE void
 Pipeline(size_t n, const P1& p1, const P2& p2, const P3& p3, const P4& p4, const P5& p5, const P6& p6, const P7& p7) {
@@ -331,4 +500,38 @@ Pipeline(size_t n, const P1& p1, const P2& p2, const P3& p3, const P4& p4, const
 		if (++k >= M) k = 0;
 	}
 }
+
+//Bubble is fixed at compile time, so a few levels are instantiated and one is
+//picked at runtime. Each caller maps level to its own bubble size.
+static constexpr unsigned PIPELINE_LEVELS = 5;
+static constexpr unsigned DEFAULT_PIPELINE_LEVEL = 2;
+
+//footprint is the size of randomly accessed memory, anonymous means it comes
+//from MemBlock, which tries huge pages from 64MB
+static inline unsigned GuessPipelineLevel(size_t footprint, bool anonymous) noexcept {
+	if (footprint <= (1ULL << 20U)) {
+		return 0;	//about L2, latency is short
+	} else if (footprint <= (32ULL << 20U)) {
+		return 1;	//about LLC
+	}
+	const bool huge_page = anonymous && footprint >= (64ULL << 20U) && shd::GetHugePageShift() != 0;
+	if (huge_page || footprint <= (1ULL << 30U)) {
+		return DEFAULT_PIPELINE_LEVEL;
+	}
+	return 3;	//TLB misses on 4K pages add a page walk
+}
+
+//fn gets std::integral_constant<unsigned,level>
+template <typename Fn>
+static FORCE_INLINE auto WithPipelineLevel(unsigned level, const Fn& fn) {
+	static_assert(PIPELINE_LEVELS == 5, "cases should match levels");
+	switch (level) {
+		case 0: return fn(std::integral_constant<unsigned, 0>());
+		case 1: return fn(std::integral_constant<unsigned, 1>());
+		case 3: return fn(std::integral_constant<unsigned, 3>());
+		case 4: return fn(std::integral_constant<unsigned, 4>());
+		default: return fn(std::integral_constant<unsigned, DEFAULT_PIPELINE_LEVEL>());
+	}
+}
+
 #endif //SHD_PIPELINE_H_
@@ -19,6 +19,8 @@
 #include <cassert>
 #include <cstring>
 #include <memory>
+#include <vector>
+#include <algorithm>
 #include "internal.h"
 #include "pipeline.h"
 
@@ -37,31 +39,76 @@ struct Step2 {
 };
 
 struct Step3 {
-	const uint8_t* line;
+	const uint8_t* line;	//key
+	const uint8_t* val;
 };
 
-static FORCE_INLINE Step1 Calc1(const PackView& index, const uint8_t* key, uint8_t key_len) {
+static FORCE_INLINE Step1 Calc1(const PackView& index, const V96& id) {
 	Step1 out;
-	out.id = GenID(index.seed, key, key_len);
-	out.seg = &index.segments[L0Hash(out.id) % index.l0sz];
+	out.seg = &index.segments[L0Hash(id) % index.l0sz];
+	out.id = SaltID(id, out.seg->salt);
 	out.l1pos = SkewMap(L1Hash(out.id), out.seg->l1bd);
 	return out;
 }
 
-static FORCE_INLINE Step1 Process1(const PackView& index, const uint8_t* key, uint8_t key_len) {
-	Step1 out = Calc1(index, key, key_len);
+static FORCE_INLINE Step1 Calc1(const PackView& index, const uint8_t* key, uint8_t key_len) {
+	return Calc1(index, GenID(index.seed, key, key_len));
+}
+
+static FORCE_INLINE Step1 Process1(const PackView& index, const V96& id) {
+	Step1 out = Calc1(index, id);
 	PrefetchForNext(&out.seg->cells[out.l1pos]);
+	if (out.seg->l2pairs != 0) {
+		//the pair does not depend on the cell, one 64B line
+		PrefetchForNext(&out.seg->sections[L2Pair(out.id, out.seg->l2pairs)*2U]);
+	}
 	return out;
 }
 
+static FORCE_INLINE Step1 Process1(const PackView& index, const uint8_t* key, uint8_t key_len) {
+	return Process1(index, GenID(index.seed, key, key_len));
+}
+
 static FORCE_INLINE Step1 Process1(const PackView& pack, const uint8_t* key) {
 	return Process1(pack, key, pack.key_len);
 }
 
+static constexpr unsigned HASH_GROUP = 16;
+
+//Stage 1 of Pipeline visits keys in order, so ids can be made a group at a time
+template <typename KeyAt>
+class IDGroup {
+public:
+	IDGroup(uint32_t seed, unsigned batch, uint8_t key_len, const KeyAt& key_at) noexcept
+		: m_key_at(key_at), m_batch(batch), m_seed(seed), m_key_len(key_len) {}
+
+	V96 operator()(unsigned i) noexcept {
+		const auto j = i % HASH_GROUP;
+		if (j == 0) {
+			const uint8_t* keys[HASH_GROUP];
+			const auto n = std::min(HASH_GROUP, m_batch-i);
+			for (unsigned k = 0; k < n; k++) {
+				keys[k] = m_key_at(i+k);
+			}
+			HashTo128(keys, n, m_key_len, m_seed, m_codes);
+		}
+		return ToID(m_codes[j]);
+	}
+
+private:
+	V128 m_codes[HASH_GROUP];
+	const KeyAt& m_key_at;
+	const unsigned m_batch;
+	const uint32_t m_seed;
+	const uint8_t m_key_len;
+};
+
 static FORCE_INLINE Step2 Calc2(const Step1& in) {
 	Step2 out;
 	out.seg = in.seg;
-	const auto bit_pos = L2Hash(in.id, in.seg->cells[in.l1pos]) % in.seg->l2sz;
+	const auto sd8 = in.seg->cells[in.l1pos];
+	const auto bit_pos = in.seg->l2pairs != 0? LocalL2Pos(in.id, sd8, in.seg->l2pairs)
+											 : L2Hash(in.id, sd8) % in.seg->l2sz;
 	out.section = bit_pos / BITMAP_SECTION_SIZE;
 	out.bit_off = bit_pos % BITMAP_SECTION_SIZE;
 	return out;
@@ -91,241 +138,691 @@ uint64_t CalcPos(const PackView& index, const uint8_t* key, uint8_t key_len) {
 	return CalcPos(Calc2(Calc1(index, key, key_len)));
 }
 
+uint64_t CalcPos(const PackView& index, const V96& id) {
+	return CalcPos(Calc2(Calc1(index, id)));
+}
+
+const uint8_t* SearchFingerprint(const PackView& index, const uint8_t* key) {
+	const auto id = GenID(index.seed, key, index.key_len);
+	const auto pos = CalcPos(Calc2(Calc1(index, id)));
+	if (UNLIKELY(pos >= index.item)) {
+		return nullptr;
+	}
+	auto field = index.content + pos*index.line_size;
+	return MatchFingerprint(field, Fingerprint(id), index.line_size)? field : nullptr;
+}
+
+const uint8_t* SearchVarKey(const PackView& index, const uint8_t* key, uint8_t key_len) {
+	const auto id = GenID(index.seed, key, key_len);
+	const auto pos = CalcPos(Calc2(Calc1(index, id)));
+	if (UNLIKELY(pos >= index.item)) {
+		return nullptr;
+	}
+	auto line = index.content + pos*index.line_size;
+	const auto ref = ReadKeyRef(line);
+	if (ref.tag != KeyTag(id) || ref.len != key_len || ref.offset + ref.len > index.keys_size
+		|| memcmp(index.keys + ref.offset, key, key_len) != 0) {
+		return nullptr;
+	}
+	return line;
+}
+
 #ifndef CACHE_BLOCK_SIZE
 #define CACHE_BLOCK_SIZE 64U
 #endif
 static_assert(CACHE_BLOCK_SIZE >= 64U && (CACHE_BLOCK_SIZE&(CACHE_BLOCK_SIZE-1)) == 0);
 
+//in split layout, value is left to PrefetchValue after key matches
 static FORCE_INLINE Step3 Process3(const PackView& pack, const Step2& in, bool fetch_val=false) {
 	const auto pos = CalcPos(in);
 	Step3 out;
 	if (LIKELY(pos < pack.item)) {
-		out.line = pack.content + pos*pack.line_size;
+		out.line = KeyAt(pack, pos);
+		out.val = ValueAt(pack, pos, out.line);
 		PrefetchForNext(out.line);
 		auto off = (uintptr_t)out.line & (CACHE_BLOCK_SIZE-1);
 		auto blk = (const void*)(((uintptr_t)out.line & ~(uintptr_t)(CACHE_BLOCK_SIZE-1)) + CACHE_BLOCK_SIZE);
 		if (off + pack.key_len > CACHE_BLOCK_SIZE) {
 			PrefetchForNext(blk);
-		} else if (fetch_val && off + pack.line_size > CACHE_BLOCK_SIZE) {
+		} else if (fetch_val && pack.values == nullptr && off + pack.line_size > CACHE_BLOCK_SIZE) {
 			PrefetchForFuture(blk);
 		}
 	} else {
 		out.line = nullptr;
+		out.val = nullptr;
 	}
 	return out;
 }
 
-void BatchLocate(const PackView& index, unsigned batch, const uint8_t* __restrict keys,
-				 uint8_t key_len, uint64_t* __restrict out) {
-	Pipeline<8>(batch,
-				[&index, keys, key_len](unsigned i) -> Step1 {
-					return Process1(index, keys+i*key_len, key_len);
+static FORCE_INLINE void PrefetchValue(const uint8_t* val, unsigned len) {
+	auto blk = (uintptr_t)val & ~(uintptr_t)(CACHE_BLOCK_SIZE-1);
+	for (; blk < (uintptr_t)val + len; blk += CACHE_BLOCK_SIZE) {
+		PrefetchForNext((const void*)blk);
+	}
+}
+
+//extra stage of split layout, nullptr for miss
+struct ValueLine {
+	const uint8_t* val;
+};
+
+static FORCE_INLINE ValueLine ProcessMatch(const PackView& pack, const Step3& in, const uint8_t* key) {
+	if (UNLIKELY(in.line == nullptr) || !Equal(key, in.line, pack.key_len)) {
+		return {nullptr};
+	}
+	PrefetchValue(in.val, pack.val_len);
+	return {in.val};
+}
+
+//a hot cache hit carries its line through, later stages just pass it on
+struct HotStep1 {
+	Step1 s;
+	const uint8_t* hot;
+};
+
+struct HotStep2 {
+	Step2 s;
+	const uint8_t* hot;
+};
+
+struct ColdPath {};
+
+struct HotPath {
+	const HotCache& cache;
+	unsigned& hit;
+};
+
+static FORCE_INLINE Step1 Stage1(const PackView& pack, const V96& id, const uint8_t*, const ColdPath&) {
+	return Process1(pack, id);
+}
+
+static FORCE_INLINE HotStep1 Stage1(const PackView& pack, const V96& id, const uint8_t* key, const HotPath& path) {
+	HotStep1 out{};
+	out.hot = FindHot(path.cache, id, key);
+	if (out.hot != nullptr) {
+		path.hit++;
+	} else {
+		out.s = Process1(pack, id);
+	}
+	return out;
+}
+
+static FORCE_INLINE HotStep2 Process2(const HotStep1& in) {
+	HotStep2 out{};
+	out.hot = in.hot;
+	if (in.hot == nullptr) {
+		out.s = Process2(in.s);
+	}
+	return out;
+}
+
+static FORCE_INLINE Step3 Process3(const PackView& pack, const HotStep2& in, bool fetch_val=false) {
+	if (in.hot != nullptr) {
+		return {in.hot, in.hot + pack.key_len};
+	}
+	return Process3(pack, in.s, fetch_val);
+}
+
+//fn(level, path) is instantiated for every pipeline level, with or without hot cache
+template <typename Fn>
+static FORCE_INLINE void Dispatch(const PackView& pack, unsigned batch, const Fn& fn) {
+	if (pack.hot == nullptr) {
+		WithPipelineLevel(pack.level, [&fn](auto level) { fn(level, ColdPath()); });
+		return;
+	}
+	unsigned hit = 0;
+	const HotPath path = {*pack.hot, hit};
+	WithPipelineLevel(pack.level, [&fn, &path](auto level) { fn(level, path); });
+	AddRelaxed(pack.hot->lookup, (uint64_t)batch);
+	AddRelaxed(pack.hot->hit, (uint64_t)hit);
+}
+
+//bubble per pipeline level, DEFAULT_PIPELINE_LEVEL keeps the well tested sizes
+static constexpr unsigned LOCATE_BUBBLE[PIPELINE_LEVELS] = {2, 4, 8, 12, 16};
+static constexpr unsigned SEARCH_BUBBLE[PIPELINE_LEVELS] = {1, 3, 7, 10, 14};
+static constexpr unsigned FETCH_BUBBLE[PIPELINE_LEVELS] = {1, 3, 6, 9, 12};
+
+struct FingerprintStep2 {
+	Step2 s;
+	uint32_t fp;
+};
+
+struct FingerprintStep3 {
+	const uint8_t* field;
+	uint32_t fp;
+};
+
+//fingerprint is taken from id before Step2 drops it
+template <typename KeyAt, typename Hit, typename Miss>
+static FORCE_INLINE void FingerprintSearch(const PackView& pack, unsigned n, const KeyAt& key_at,
+										   const Hit& hit, const Miss& miss) {
+	IDGroup ids(pack.seed, n, pack.key_len, key_at);
+	WithPipelineLevel(pack.level, [&](auto level) {
+		Pipeline<SEARCH_BUBBLE[decltype(level)::value]>(n,
+				[&pack, &ids](unsigned i) -> Step1 {
+					return Process1(pack, ids(i));
 				},
-				[](const Step1& in, unsigned) -> Step2 {
-					return Process2(in);
+				[](const Step1& in, unsigned) -> FingerprintStep2 {
+					return {Process2(in), Fingerprint(in.id)};
+				},
+				[&pack](const FingerprintStep2& in, unsigned) -> FingerprintStep3 {
+					const auto pos = CalcPos(in.s);
+					if (UNLIKELY(pos >= pack.item)) {
+						return {nullptr, 0};
+					}
+					auto field = pack.content + pos*pack.line_size;
+					PrefetchForNext(field);
+					return {field, in.fp};
 				},
-				[&out](const Step2& in, unsigned i) {
-					out[i] = CalcPos(in);
+				[&pack, &hit, &miss](const FingerprintStep3& in, unsigned i) {
+					if (LIKELY(in.field != nullptr) && MatchFingerprint(in.field, in.fp, pack.line_size)) {
+						hit(i, in.field);
+					} else {
+						miss(i);
+					}
 				}
-	);
+		);
+	});
+}
+
+void BatchLocate(const PackView& index, unsigned batch, const uint8_t* __restrict keys,
+				 uint8_t key_len, uint64_t* __restrict out) {
+	auto key_at = [keys, key_len](unsigned i) { return keys+i*key_len; };
+	IDGroup ids(index.seed, batch, key_len, key_at);
+	WithPipelineLevel(index.level, [&](auto level) {
+		Pipeline<LOCATE_BUBBLE[decltype(level)::value]>(batch,
+					[&index, &ids](unsigned i) -> Step1 {
+						return Process1(index, ids(i));
+					},
+					[](const Step1& in, unsigned) -> Step2 {
+						return Process2(in);
+					},
+					[&out](const Step2& in, unsigned i) {
+						out[i] = CalcPos(in);
+					}
+		);
+	});
 }
 
 unsigned BatchSearch(const PackView& pack, unsigned batch, const uint8_t* const keys[], const uint8_t* out[]) {
-	if (pack.type != Type::KV_INLINE && pack.type != Type::KEY_SET) {
+	unsigned hit = 0;
+	auto key_at = [keys](unsigned i) { return keys[i]; };
+	if (pack.type == Type::FINGERPRINT_SET) {
+		FingerprintSearch(pack, batch, key_at,
+				[out, &hit](unsigned i, const uint8_t* field) {
+					hit++;
+					out[i] = field;
+				},
+				[out](unsigned i) {
+					out[i] = nullptr;
+				});
+		return hit;
+	}
+	if ((pack.type != Type::KV_INLINE && pack.type != Type::KEY_SET) || pack.keys != nullptr) {
 		return 0;
 	}
-	unsigned hit = 0;
-	Pipeline<7>(batch,
-			 [&pack, keys](unsigned i) -> Step1 {
-				 return Process1(pack, keys[i]);
-			 },
-			 [](const Step1& in, unsigned) -> Step2 {
-				 return Process2(in);
-			 },
-			 [&pack](const Step2& in, unsigned) -> Step3 {
-				 return Process3(pack, in);
-			 },
-			 [&pack, &hit, keys, out](const Step3& in, unsigned i) {
-				 if (LIKELY(in.line != nullptr) && Equal(keys[i], in.line, pack.key_len)) {
-					 hit++;
-					 out[i] = in.line + pack.key_len;
-				 } else {
-					 out[i] = nullptr;
+	IDGroup ids(pack.seed, batch, pack.key_len, key_at);
+	Dispatch(pack, batch, [&](auto level, const auto& path) {
+		Pipeline<SEARCH_BUBBLE[decltype(level)::value]>(batch,
+				 [&pack, &ids, &path, keys](unsigned i) {
+					 return Stage1(pack, ids(i), keys[i], path);
+				 },
+				 [](const auto& in, unsigned) {
+					 return Process2(in);
+				 },
+				 [&pack](const auto& in, unsigned) -> Step3 {
+					 return Process3(pack, in);
+				 },
+				 [&pack, &hit, keys, out](const Step3& in, unsigned i) {
+					 if (LIKELY(in.line != nullptr) && Equal(keys[i], in.line, pack.key_len)) {
+						 hit++;
+						 out[i] = in.val;
+					 } else {
+						 out[i] = nullptr;
+					 }
 				 }
-			 }
-	);
+		);
+	});
 	return hit;
 }
 
-unsigned BatchFetch(const PackView& pack, const uint8_t* __restrict dft_val, unsigned batch,
-				  const uint8_t* __restrict keys, uint8_t* __restrict data, unsigned* __restrict miss) {
-	if (pack.type != Type::KV_INLINE) {
+struct ValueMark {
+	const uint8_t* pt;
+};
+
+static FORCE_INLINE ValueMark PrefetchMark(const PackView& pack, const uint8_t* field) {
+	const auto offset = ReadOffsetField(field);
+	if (UNLIKELY(offset >= static_cast<size_t>(pack.space_end-pack.extend))) {
+		return {nullptr};
+	}
+	auto pt = pack.extend + offset;
+	PrefetchForNext(pt);
+	//length mark takes up to 5 bytes, value may start in next block
+	constexpr unsigned MARK_LIMIT = MAX_VALUE_LEN_BIT / 7U;
+	if (((uintptr_t)pt & (CACHE_BLOCK_SIZE-1)) + MARK_LIMIT >= CACHE_BLOCK_SIZE) {
+		PrefetchForNext((const void*)(((uintptr_t)pt & ~(uintptr_t)(CACHE_BLOCK_SIZE-1)) + CACHE_BLOCK_SIZE));
+	}
+	return {pt};
+}
+
+static FORCE_INLINE ValueMark ProcessMark(const PackView& pack, const Step3& in, const uint8_t* key) {
+	if (UNLIKELY(in.line == nullptr) || !Equal(key, in.line, pack.key_len)) {
+		return {nullptr};
+	}
+	return PrefetchMark(pack, in.val);
+}
+
+unsigned BatchSearch(const PackView& pack, unsigned batch, const uint8_t* const keys[], Slice out[]) {
+	if (pack.keys != nullptr) {
 		return 0;
 	}
 	unsigned hit = 0;
-	Pipeline<6>(batch,
-				[&pack, keys](unsigned i) -> Step1 {
-					auto key = keys+i*pack.key_len;
-					return Process1(pack, key);
-				},
-				[](const Step1& in, unsigned) -> Step2 {
-					return Process2(in);
-				},
-				[&pack](const Step2& in, unsigned) -> Step3 {
-					return Process3(pack, in, true);
+	auto key_at = [keys](unsigned i) { return keys[i]; };
+	if (pack.type == Type::FINGERPRINT_SET) {
+		FingerprintSearch(pack, batch, key_at,
+				[out, &hit](unsigned i, const uint8_t* field) {
+					hit++;
+					out[i] = {field, 0};
 				},
-				[&pack, &hit, keys, data, dft_val, &miss](const Step3& in, unsigned i) {
-					auto key = keys + i*pack.key_len;
-					auto out = data + i*pack.val_len;
-					auto src = in.line + pack.key_len;
-					if (LIKELY(in.line != nullptr) && Equal(key, in.line, pack.key_len)) {
-						hit++;
-					} else if (dft_val != nullptr) {
-						src = dft_val;
-					} else if (miss != nullptr) {
-						*miss++ = i;
-						return;
-					} else {
-						return;
+				[out](unsigned i) {
+					out[i] = {};
+				});
+		return hit;
+	}
+	IDGroup ids(pack.seed, batch, pack.key_len, key_at);
+	if (pack.type == Type::KV_INLINE || pack.type == Type::KEY_SET) {
+		Dispatch(pack, batch, [&](auto level, const auto& path) {
+			Pipeline<SEARCH_BUBBLE[decltype(level)::value]>(batch,
+					[&pack, &ids, &path, keys](unsigned i) {
+						return Stage1(pack, ids(i), keys[i], path);
+					},
+					[](const auto& in, unsigned) {
+						return Process2(in);
+					},
+					[&pack](const auto& in, unsigned) -> Step3 {
+						return Process3(pack, in);
+					},
+					[&pack, &hit, keys, out](const Step3& in, unsigned i) {
+						if (LIKELY(in.line != nullptr) && Equal(keys[i], in.line, pack.key_len)) {
+							hit++;
+							out[i] = {in.val, pack.val_len};
+						} else {
+							out[i] = {};
+						}
 					}
-					memcpy(out, src, pack.val_len);
-				}
-	);
+			);
+		});
+	} else if (pack.type == Type::KV_SEPARATED && pack.blocks.cnt != 0) {
+		//decompression dominates, blocks are reused through the thread local cache
+		WithPipelineLevel(pack.level, [&](auto level) {
+			Pipeline<SEARCH_BUBBLE[decltype(level)::value]>(batch,
+					[&pack, &ids](unsigned i) -> Step1 {
+						return Process1(pack, ids(i));
+					},
+					[](const Step1& in, unsigned) -> Step2 {
+						return Process2(in);
+					},
+					[&pack](const Step2& in, unsigned) -> Step3 {
+						return Process3(pack, in, true);
+					},
+					[&pack, &hit, keys, out](const Step3& in, unsigned i) {
+						if (LIKELY(in.line != nullptr) && Equal(keys[i], in.line, pack.key_len)) {
+							out[i] = CompressedValueAt(pack.blocks, ReadOffsetField(in.val));
+							hit += out[i].valid();
+						} else {
+							out[i] = {};
+						}
+					}
+			);
+		});
+	} else if (pack.type == Type::KV_SEPARATED) {
+		WithPipelineLevel(pack.level, [&](auto level) {
+			Pipeline<FETCH_BUBBLE[decltype(level)::value]>(batch,
+					[&pack, &ids](unsigned i) -> Step1 {
+						return Process1(pack, ids(i));
+					},
+					[](const Step1& in, unsigned) -> Step2 {
+						return Process2(in);
+					},
+					[&pack](const Step2& in, unsigned) -> Step3 {
+						return Process3(pack, in, true);
+					},
+					[&pack, keys](const Step3& in, unsigned i) -> ValueMark {
+						return ProcessMark(pack, in, keys[i]);
+					},
+					[&pack, &hit, out](const ValueMark& in, unsigned i) {
+						if (LIKELY(in.pt != nullptr)) {
+							out[i] = SeparatedValue(in.pt, pack.space_end);
+							hit += out[i].valid();
+						} else {
+							out[i] = {};
+						}
+					}
+			);
+		});
+	}
 	return hit;
 }
 
-template <typename T>
-struct Relay {
-	const uint8_t* v;
-	T s;
+//variable length key takes two more steps: reference in line, then key in arena
+struct VarKeyStep2 {
+	Step2 s;
+	uint16_t tag;
 };
 
-using Step4 = Relay<Step1>;
-using Step5 = Relay<Step2>;
-using Step6 = Relay<Step3>;
+struct VarKeyStep3 {
+	const uint8_t* line;
+	uint16_t tag;
+};
 
-unsigned BatchSearch(const PackView& base, const PackView& patch,
-					 unsigned batch, const uint8_t* const keys[], const uint8_t* out[]) {
-	if ((base.type != Type::KV_INLINE && base.type != Type::KEY_SET)
-		|| base.type != patch.type || base.key_len != patch.key_len
-		|| base.val_len != patch.val_len) {
-		return 0;
+//key is nullptr when length or tag differs
+struct VarKeyStep4 {
+	const uint8_t* key;
+	const uint8_t* line;
+};
+
+static FORCE_INLINE VarKeyStep3 ProcessRef(const PackView& pack, const VarKeyStep2& in) {
+	const auto pos = CalcPos(in.s);
+	if (UNLIKELY(pos >= pack.item)) {
+		return {nullptr, 0};
 	}
+	auto line = pack.content + pos*pack.line_size;
+	PrefetchForNext(line);
+	auto off = (uintptr_t)line & (CACHE_BLOCK_SIZE-1);
+	auto blk = (const void*)(((uintptr_t)line & ~(uintptr_t)(CACHE_BLOCK_SIZE-1)) + CACHE_BLOCK_SIZE);
+	if (off + pack.line_size > CACHE_BLOCK_SIZE) {
+		PrefetchForNext(blk);
+	}
+	return {line, in.tag};
+}
 
+static FORCE_INLINE VarKeyStep4 ProcessRefMatch(const PackView& pack, const VarKeyStep3& in, const Slice& key) {
+	if (UNLIKELY(in.line == nullptr)) {
+		return {nullptr, nullptr};
+	}
+	const auto ref = ReadKeyRef(in.line);
+	if (ref.tag != in.tag || ref.len != key.len || UNLIKELY(ref.offset + ref.len > pack.keys_size)) {
+		return {nullptr, nullptr};
+	}
+	auto pt = pack.keys + ref.offset;
+	PrefetchValue(pt, ref.len);
+	return {pt, in.line};
+}
+
+static FORCE_INLINE bool MatchVarKey(const VarKeyStep4& in, const Slice& key) {
+	return in.key != nullptr && memcmp(in.key, key.ptr, key.len) == 0;
+}
+
+unsigned BatchSearch(const PackView& pack, unsigned batch, const Slice keys[], Slice out[]) {
+	if (pack.keys == nullptr) {
+		return 0;
+	}
 	unsigned hit = 0;
-	Pipeline<4>(batch,
-			[&patch, keys](unsigned i) -> Step1 {
-				return Process1(patch, keys[i]);
-			},
-			[](const Step1& in, unsigned) -> Step2 {
-				return Process2(in);
-			},
-			[&patch](const Step2& in, unsigned) -> Step3 {
-				return Process3(patch, in);
-			},
-			[&base, &patch, keys](const Step3& in, unsigned i) -> Step4 {
-				if (LIKELY(in.line != nullptr) && Equal(keys[i], in.line, patch.key_len)) {
-					return {in.line + patch.key_len, Step1{}};
-				} else {
-					return {nullptr, Process1(base, keys[i])};
-				}
-			},
-			[](const Step4& in, unsigned) -> Step5 {
-				if (in.v != nullptr) {
-					return {in.v, Step2{}};
-				} else {
-					return {nullptr, Process2(in.s)};
-				}
-			},
-			[&base](const Step5& in, unsigned) -> Step6 {
-				if (in.v != nullptr) {
-					return {in.v, Step3{}};
-				} else {
-					return {nullptr, Process3(base, in.s)};
-				}
-			},
-			[&base, &hit, keys, out](const Step6& in, unsigned i) {
-				if (in.v != nullptr) {
-					hit++;
-					out[i] = in.v;
-				} else if (LIKELY(in.s.line != nullptr) && Equal(keys[i], in.s.line, base.key_len)) {
-					hit++;
-					out[i] = in.s.line + base.key_len;
-				} else {
-					out[i] = nullptr;
-				}
-			}
-	);
+	auto stage1 = [&pack, keys](unsigned i) -> Step1 {
+		return Process1(pack, keys[i].ptr, keys[i].len);	//too long key is cut here, but never matches
+	};
+	auto stage2 = [](const Step1& in, unsigned) -> VarKeyStep2 {
+		return {Process2(in), KeyTag(in.id)};
+	};
+	auto stage3 = [&pack](const VarKeyStep2& in, unsigned) -> VarKeyStep3 {
+		return ProcessRef(pack, in);
+	};
+	auto stage4 = [&pack, keys](const VarKeyStep3& in, unsigned i) -> VarKeyStep4 {
+		return ProcessRefMatch(pack, in, keys[i]);
+	};
+	WithPipelineLevel(pack.level, [&](auto level) {
+		constexpr unsigned Bubble = FETCH_BUBBLE[decltype(level)::value];
+		if (pack.type != Type::KV_SEPARATED) {
+			Pipeline<Bubble>(batch, stage1, stage2, stage3, stage4,
+					[&pack, &hit, keys, out](const VarKeyStep4& in, unsigned i) {
+						if (MatchVarKey(in, keys[i])) {
+							hit++;
+							out[i] = {in.line + KEY_REF_SIZE, pack.val_len};
+						} else {
+							out[i] = {};
+						}
+					}
+			);
+		} else if (pack.blocks.cnt != 0) {
+			Pipeline<Bubble>(batch, stage1, stage2, stage3, stage4,
+					[&pack, &hit, keys, out](const VarKeyStep4& in, unsigned i) {
+						if (MatchVarKey(in, keys[i])) {
+							out[i] = CompressedValueAt(pack.blocks, ReadOffsetField(in.line + KEY_REF_SIZE));
+							hit += out[i].valid();
+						} else {
+							out[i] = {};
+						}
+					}
+			);
+		} else {
+			Pipeline<Bubble>(batch, stage1, stage2, stage3, stage4,
+					[&pack, keys](const VarKeyStep4& in, unsigned i) -> ValueMark {
+						if (!MatchVarKey(in, keys[i])) {
+							return {nullptr};
+						}
+						return PrefetchMark(pack, in.line + KEY_REF_SIZE);
+					},
+					[&pack, &hit, out](const ValueMark& in, unsigned i) {
+						if (LIKELY(in.pt != nullptr)) {
+							out[i] = SeparatedValue(in.pt, pack.space_end);
+							hit += out[i].valid();
+						} else {
+							out[i] = {};
+						}
+					}
+			);
+		}
+	});
 	return hit;
 }
 
-unsigned BatchFetch(const PackView& base, const PackView& patch, const uint8_t* __restrict dft_val, unsigned batch,
+unsigned BatchFetch(const PackView& pack, const uint8_t* __restrict dft_val, unsigned batch,
 				  const uint8_t* __restrict keys, uint8_t* __restrict data, unsigned* __restrict miss) {
-	if (base.type != Type::KV_INLINE || base.type != patch.type
-		|| base.key_len != patch.key_len || base.val_len != patch.val_len) {
+	if (pack.type != Type::KV_INLINE || pack.keys != nullptr) {
+		return 0;
+	}
+	unsigned hit = 0;
+	auto key_at = [keys, &pack](unsigned i) { return keys+i*pack.key_len; };
+	auto put = [&pack, &hit, data, dft_val, &miss](const uint8_t* src, unsigned i) {
+		if (LIKELY(src != nullptr)) {
+			hit++;
+		} else if (dft_val != nullptr) {
+			src = dft_val;
+		} else if (miss != nullptr) {
+			*miss++ = i;
+			return;
+		} else {
+			return;
+		}
+		memcpy(data + i*pack.val_len, src, pack.val_len);
+	};
+	IDGroup ids(pack.seed, batch, pack.key_len, key_at);
+	Dispatch(pack, batch, [&](auto level, const auto& path) {
+		auto stage1 = [&pack, &ids, &path, &key_at](unsigned i) {
+			return Stage1(pack, ids(i), key_at(i), path);
+		};
+		auto stage2 = [](const auto& in, unsigned) {
+			return Process2(in);
+		};
+		auto stage3 = [&pack](const auto& in, unsigned) -> Step3 {
+			return Process3(pack, in, true);
+		};
+		if (pack.values == nullptr) {
+			Pipeline<FETCH_BUBBLE[decltype(level)::value]>(batch, stage1, stage2, stage3,
+					[&pack, &key_at, &put](const Step3& in, unsigned i) {
+						const bool match = LIKELY(in.line != nullptr) && Equal(key_at(i), in.line, pack.key_len);
+						put(match? in.val : nullptr, i);
+					}
+			);
+		} else {
+			Pipeline<FETCH_BUBBLE[decltype(level)::value]>(batch, stage1, stage2, stage3,
+					[&pack, &key_at](const Step3& in, unsigned i) -> ValueLine {
+						return ProcessMatch(pack, in, key_at(i));
+					},
+					[&put](const ValueLine& in, unsigned i) {
+						put(in.val, i);
+					}
+			);
+		}
+	});
+	return hit;
+}
+
+//run one layer over n pending keys, then hit(i, val) or miss(i) in order
+template <bool FetchVal, typename KeyAt, typename Hit, typename Miss>
+static FORCE_INLINE void LayerSearch(const PackView& pack, unsigned n, const KeyAt& key_at,
+									 const Hit& hit, const Miss& miss) {
+	if constexpr (!FetchVal) {
+		if (pack.type == Type::FINGERPRINT_SET) {
+			FingerprintSearch(pack, n, key_at, hit, miss);
+			return;
+		}
+	}
+	IDGroup ids(pack.seed, n, pack.key_len, key_at);
+	Dispatch(pack, n, [&](auto level, const auto& path) {
+		constexpr unsigned Bubble = FetchVal? FETCH_BUBBLE[decltype(level)::value]
+											: SEARCH_BUBBLE[decltype(level)::value];
+		auto stage1 = [&pack, &ids, &path, &key_at](unsigned i) {
+			return Stage1(pack, ids(i), key_at(i), path);
+		};
+		auto stage2 = [](const auto& in, unsigned) {
+			return Process2(in);
+		};
+		auto stage3 = [&pack](const auto& in, unsigned) -> Step3 {
+			return Process3(pack, in, FetchVal);
+		};
+		if (!FetchVal || pack.values == nullptr) {
+			Pipeline<Bubble>(n, stage1, stage2, stage3,
+					[&pack, &key_at, &hit, &miss](const Step3& in, unsigned i) {
+						if (LIKELY(in.line != nullptr) && Equal(key_at(i), in.line, pack.key_len)) {
+							hit(i, in.val);
+						} else {
+							miss(i);
+						}
+					}
+			);
+		} else {
+			Pipeline<Bubble>(n, stage1, stage2, stage3,
+					[&pack, &key_at](const Step3& in, unsigned i) -> ValueLine {
+						return ProcessMatch(pack, in, key_at(i));
+					},
+					[&hit, &miss](const ValueLine& in, unsigned i) {
+						if (in.val != nullptr) {
+							hit(i, in.val);
+						} else {
+							miss(i);
+						}
+					}
+			);
+		}
+	});
+}
+
+//variable length key has no place in fixed size key list
+static bool Compatible(const PackView* const layers[], unsigned depth) {
+	if (layers[0]->keys != nullptr) {
+		return false;
+	}
+	for (unsigned i = 1; i < depth; i++) {
+		if (layers[i]->type != layers[0]->type || layers[i]->key_len != layers[0]->key_len
+			|| layers[i]->val_len != layers[0]->val_len || layers[i]->keys != nullptr) {
+			return false;
+		}
+	}
+	return true;
+}
+
+//Keys resolved by an upper layer are dropped from the pending list, so lower
+//layers only pipeline what is still missing.
+static constexpr unsigned CHAIN_CHUNK = 1024;
+
+unsigned BatchSearch(const PackView* const layers[], unsigned depth, unsigned batch,
+					 const uint8_t* const keys[], const uint8_t* out[]) {
+	if (depth == 0 || (layers[0]->type != Type::KV_INLINE && layers[0]->type != Type::KEY_SET
+			&& layers[0]->type != Type::FINGERPRINT_SET)
+		|| !Compatible(layers, depth)) {
 		return 0;
 	}
 
 	unsigned hit = 0;
-	Pipeline<3>(batch,
-			[&patch, keys](unsigned i) -> Step1 {
-				auto key = keys+i*patch.key_len;
-				return Process1(patch, key);
-			},
-			[](const Step1& in, unsigned) -> Step2 {
-				return Process2(in);
-			},
-			[&patch](const Step2& in, unsigned) -> Step3 {
-				return Process3(patch, in, true);
-			},
-			[&base, &patch, keys](const Step3& in, unsigned i) -> Step4 {
-				auto key = keys + i*base.key_len;
-				if (LIKELY(in.line != nullptr) && Equal(key, in.line, patch.key_len)) {
-					return {in.line + patch.key_len, Step1{}};
-				} else {
-					return {nullptr, Process1(base, key)};
-				}
-			},
-			[](const Step4& in, unsigned) -> Step5 {
-				if (in.v != nullptr) {
-					return {in.v, Step2{}};
-				} else {
-					return {nullptr, Process2(in.s)};
-				}
-			},
-			[&base](const Step5& in, unsigned) -> Step6 {
-				if (in.v != nullptr) {
-					return {in.v, Step3{}};
-				} else {
-					return {nullptr, Process3(base, in.s, true)};
-				}
-			},
-			[&base, &hit, keys, data, dft_val, &miss](const Step6& in, unsigned i) {
-				auto key = keys + i*base.key_len;
-				auto out = data + i*base.val_len;
-				auto src = in.v;
-				if (src != nullptr) {
-					hit++;
-				} else if (LIKELY(in.s.line != nullptr) && Equal(key, in.s.line, base.key_len)) {
-					hit++;
-					src = in.s.line + base.key_len;
-				} else if (dft_val != nullptr) {
-					src = dft_val;
-				} else if (miss != nullptr) {
-					*miss++ = i;
-					return;
-				} else {
-					return;
-				}
-				memcpy(out, src, base.val_len);
+	unsigned todo[CHAIN_CHUNK];
+	for (unsigned off = 0; off < batch; off += CHAIN_CHUNK) {
+		unsigned n = std::min(CHAIN_CHUNK, batch-off);
+		for (unsigned i = 0; i < n; i++) {
+			todo[i] = off + i;
+		}
+		for (unsigned k = 0; k < depth && n != 0; k++) {
+			unsigned m = 0;
+			LayerSearch<false>(*layers[k], n,
+					[keys, &todo](unsigned i) { return keys[todo[i]]; },
+					[out, &todo, &hit](unsigned i, const uint8_t* val) {
+						hit++;
+						out[todo[i]] = val;
+					},
+					[&todo, &m](unsigned i) {
+						todo[m++] = todo[i];
+					});
+			n = m;
+		}
+		for (unsigned i = 0; i < n; i++) {
+			out[todo[i]] = nullptr;
+		}
+	}
+	return hit;
+}
+
+unsigned BatchFetch(const PackView* const layers[], unsigned depth, const uint8_t* __restrict dft_val,
+					unsigned batch, const uint8_t* __restrict keys, uint8_t* __restrict data,
+					unsigned* __restrict miss) {
+	if (depth == 0 || layers[0]->type != Type::KV_INLINE || !Compatible(layers, depth)) {
+		return 0;
+	}
+
+	const auto key_len = layers[0]->key_len;
+	const auto val_len = layers[0]->val_len;
+	unsigned hit = 0;
+	unsigned todo[CHAIN_CHUNK];
+	for (unsigned off = 0; off < batch; off += CHAIN_CHUNK) {
+		unsigned n = std::min(CHAIN_CHUNK, batch-off);
+		for (unsigned i = 0; i < n; i++) {
+			todo[i] = off + i;
+		}
+		for (unsigned k = 0; k < depth && n != 0; k++) {
+			unsigned m = 0;
+			LayerSearch<true>(*layers[k], n,
+					[keys, key_len, &todo](unsigned i) { return keys + todo[i]*key_len; },
+					[data, val_len, &todo, &hit](unsigned i, const uint8_t* val) {
+						hit++;
+						memcpy(data + todo[i]*val_len, val, val_len);
+					},
+					[&todo, &m](unsigned i) {
+						todo[m++] = todo[i];
+					});
+			n = m;
+		}
+		for (unsigned i = 0; i < n; i++) {
+			if (dft_val != nullptr) {
+				memcpy(data + todo[i]*val_len, dft_val, val_len);
+			} else if (miss != nullptr) {
+				*miss++ = todo[i];
 			}
-	);
+		}
+	}
 	return hit;
 }
 
 static constexpr unsigned WINDOW_SIZE = 32;
 
-void BatchFindPos(const PackView& pack, size_t batch, const std::function<void(uint8_t*)>& reader,
+static FORCE_INLINE void HashWindow(const PackView& index, const uint8_t* keys, size_t stride, unsigned n,
+									V128 codes[]) {
+	const uint8_t* msgs[WINDOW_SIZE];
+	for (unsigned j = 0; j < n; j++) {
+		msgs[j] = keys + j*stride;
+	}
+	HashTo128(msgs, n, index.key_len, index.seed, codes);
+}
+
+void BatchFindPos(const PackView& pack, size_t batch, const std::function<void(uint8_t*, unsigned)>& reader,
 				const std::function<void(uint64_t)>& output, const uint8_t* bitmap) {
 	if (pack.type == Type::INDEX_ONLY) return;
 	auto buf = std::make_unique<uint8_t[]>(WINDOW_SIZE*pack.key_len);
@@ -339,12 +836,13 @@ void BatchFindPos(const PackView& pack, size_t batch, const std::function<void(u
 		} s3;
 	} state[WINDOW_SIZE];
 
+	V128 codes[WINDOW_SIZE];
 	for (size_t i = 0; i < batch; i += WINDOW_SIZE) {
-		auto m = std::min(static_cast<size_t>(WINDOW_SIZE), batch-i);
+		unsigned m = std::min(static_cast<size_t>(WINDOW_SIZE), batch-i);
+		reader(buf.get(), m);
+		HashWindow(pack, buf.get(), pack.key_len, m, codes);
 		for (unsigned j = 0; j < m; j++) {
-			auto key = buf.get() + j * pack.key_len;
-			reader(key);
-			state[j].s1 = Process1(pack, key);
+			state[j].s1 = Process1(pack, ToID(codes[j]));
 		}
 		for (unsigned j = 0; j < m; j++) {
 			state[j].s2 = Process2(state[j].s1);
@@ -355,7 +853,7 @@ void BatchFindPos(const PackView& pack, size_t batch, const std::function<void(u
 				state[j].s3 = {UINT64_MAX, nullptr};
 				continue;
 			}
-			auto line = pack.content + pos*pack.line_size;
+			auto line = KeyAt(pack, pos);
 			PrefetchForNext(line);
 			if (bitmap != nullptr) {
 				PrefetchBit(bitmap,pos);
@@ -374,27 +872,56 @@ void BatchFindPos(const PackView& pack, size_t batch, const std::function<void(u
 	}
 }
 
-void BatchDataMapping(const PackView& index, uint8_t* space, size_t batch, const std::function<void(uint8_t*)>& reader) {
+void BatchDataMapping(const PackView& index, uint8_t* space, size_t batch,
+					  const std::function<void(uint8_t*, unsigned)>& reader, const V96* ids) {
 	auto buf = std::make_unique<uint8_t[]>(WINDOW_SIZE*index.line_size);
+	//split layout puts keys at space and values behind them
+	const bool split = index.layout & LAYOUT_SPLIT_KV;
+	auto values = space + SplitValueOffset(index.item, index.key_len);
 
 	union {
 		Step1 s1;
 		Step2 s2;
 		struct {
 			uint8_t* line;
+			uint8_t* val;	//only for split layout
 		} s3;
 	} state[WINDOW_SIZE];
 
+	V128 codes[WINDOW_SIZE];
 	for (size_t i = 0; i < batch; i += WINDOW_SIZE) {
-		auto m = std::min(static_cast<size_t>(WINDOW_SIZE), batch - i);
-		for (unsigned j = 0; j < m; j++) {
-			auto line = buf.get() + j * index.line_size;
-			reader(line);
-			state[j].s1 = Process1(index, line);
+		unsigned m = std::min(static_cast<size_t>(WINDOW_SIZE), batch - i);
+		reader(buf.get(), m);
+		if (ids != nullptr) {
+			for (unsigned j = 0; j < m; j++) {
+				state[j].s1 = Process1(index, ids[i+j]);
+			}
+		} else {
+			HashWindow(index, buf.get(), index.line_size, m, codes);
+			for (unsigned j = 0; j < m; j++) {
+				state[j].s1 = Process1(index, ToID(codes[j]));
+			}
 		}
 		for (unsigned j = 0; j < m; j++) {
 			state[j].s2 = Process2(state[j].s1);
 		}
+		if (split) {
+			for (unsigned j = 0; j < m; j++) {
+				const auto pos = CalcPos(state[j].s2);
+				auto key = space + pos*index.key_len;
+				auto val = values + pos*index.val_len;
+				PrefetchForWrite(key);
+				PrefetchForWrite(val);
+				state[j].s3 = {key, val};
+			}
+			for (unsigned j = 0; j < m; j++) {
+				auto line = buf.get() + j * index.line_size;
+				auto& s = state[j].s3;
+				memcpy(s.line, line, index.key_len);
+				memcpy(s.val, line + index.key_len, index.val_len);
+			}
+			continue;
+		}
 		for (unsigned j = 0; j < m; j++) {
 			auto line = space + CalcPos(state[j].s2)*index.line_size;
 			PrefetchForWrite(line);
@@ -413,4 +940,126 @@ void BatchDataMapping(const PackView& index, uint8_t* space, size_t batch, const
 	}
 }
 
+void BatchFingerprintMapping(const PackView& index, uint8_t* space, size_t batch,
+							 const std::function<void(uint8_t*, unsigned)>& reader, const V96* ids) {
+	auto buf = std::make_unique<uint8_t[]>(WINDOW_SIZE*index.key_len);
+
+	union {
+		Step1 s1;
+		Step2 s2;
+		uint8_t* field;
+	} state[WINDOW_SIZE];
+	uint32_t fps[WINDOW_SIZE];
+
+	V128 codes[WINDOW_SIZE];
+	for (size_t i = 0; i < batch; i += WINDOW_SIZE) {
+		unsigned m = std::min(static_cast<size_t>(WINDOW_SIZE), batch - i);
+		if (ids == nullptr) {
+			reader(buf.get(), m);
+			HashWindow(index, buf.get(), index.key_len, m, codes);
+		}
+		for (unsigned j = 0; j < m; j++) {
+			const auto id = ids != nullptr? ids[i+j] : ToID(codes[j]);
+			fps[j] = Fingerprint(id);
+			state[j].s1 = Process1(index, id);
+		}
+		for (unsigned j = 0; j < m; j++) {
+			state[j].s2 = Process2(state[j].s1);
+		}
+		for (unsigned j = 0; j < m; j++) {
+			state[j].field = space + CalcPos(state[j].s2)*index.line_size;
+			PrefetchForWrite(state[j].field);
+		}
+		for (unsigned j = 0; j < m; j++) {
+			WriteFingerprint(state[j].field, fps[j], index.line_size);
+		}
+	}
+}
+
+HotCache* CreateHotCache(const PackView& pack, unsigned n, const uint8_t* keys, unsigned capacity, MemBlock& mem) {
+	if ((pack.type != Type::KV_INLINE && pack.type != Type::KEY_SET) || pack.keys != nullptr
+		|| keys == nullptr || n == 0 || capacity == 0) {
+		return nullptr;
+	}
+	auto key_at = [keys, &pack](unsigned i) { return keys + (size_t)i*pack.key_len; };
+
+	//sampled traffic may repeat keys, sort to count them
+	std::vector<unsigned> order(n);
+	for (unsigned i = 0; i < n; i++) {
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [&key_at, &pack](unsigned a, unsigned b) {
+		return memcmp(key_at(a), key_at(b), pack.key_len) < 0;
+	});
+	struct Candidate {
+		unsigned cnt;
+		unsigned idx;
+	};
+	std::vector<Candidate> candidates;
+	for (unsigned i = 0; i < n; ) {
+		unsigned j = i + 1;
+		while (j < n && Equal(key_at(order[i]), key_at(order[j]), pack.key_len)) {
+			j++;
+		}
+		candidates.push_back({j-i, order[i]});
+		i = j;
+	}
+	std::stable_sort(candidates.begin(), candidates.end(),
+					 [](const Candidate& a, const Candidate& b) { return a.cnt > b.cnt; });
+
+	size_t sets = 1;
+	while (sets*HotCache::WAYS < capacity) {
+		sets <<= 1U;
+	}
+	const size_t slots = sets * HotCache::WAYS;
+	MemBlock block(alignof(HotCache) + sizeof(HotCache) + slots*(sizeof(uint32_t) + pack.line_size));
+	if (!block) {
+		return nullptr;
+	}
+	auto base = (uint8_t*)(((uintptr_t)block.addr() + alignof(HotCache) - 1) & ~(uintptr_t)(alignof(HotCache) - 1));
+	auto cache = new(base) HotCache;
+	auto tags = (uint32_t*)(base + sizeof(HotCache));
+	auto lines = (uint8_t*)(tags + slots);
+	memset(tags, 0, slots*sizeof(uint32_t));
+	cache->set_mask = sets - 1;
+	cache->line_size = pack.line_size;
+	cache->key_len = pack.key_len;
+	cache->tags = tags;
+	cache->lines = lines;
+
+	unsigned filled = 0;
+	for (auto& c : candidates) {
+		if (filled >= capacity) {
+			break;
+		}
+		auto key = key_at(c.idx);
+		const auto pos = CalcPos(pack, key, pack.key_len);
+		if (pos >= pack.item) {
+			continue;
+		}
+		auto line = KeyAt(pack, pos);
+		if (!Equal(key, line, pack.key_len)) {
+			continue;
+		}
+		const auto id = GenID(pack.seed, key, pack.key_len);
+		const uint32_t set = id.u[2] & cache->set_mask;
+		for (unsigned w = 0; w < HotCache::WAYS; w++) {
+			const auto slot = set*HotCache::WAYS + w;
+			if (tags[slot] == 0) {	//colder keys are dropped when set is full
+				tags[slot] = HotTag(id);
+				auto dst = lines + slot*(size_t)pack.line_size;
+				memcpy(dst, line, pack.key_len);
+				memcpy(dst + pack.key_len, ValueAt(pack, pos, line), pack.val_len);
+				filled++;
+				break;
+			}
+		}
+	}
+	if (filled == 0) {
+		return nullptr;
+	}
+	mem = std::move(block);
+	return cache;
+}
+
 } //shd
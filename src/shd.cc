@@ -16,6 +16,10 @@
 // along with the This Library; if not, see <https://www.gnu.org/licenses/>.
 //==============================================================================
 
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
 #include "internal.h"
 #include "shd.h"
 
@@ -30,11 +34,29 @@ std::unique_ptr<uint8_t[]> CreatePackView(const uint8_t* addr, size_t size) {
 	if (header->magic != SHD_MAGIC) {
 		return nullptr;
 	}
-	switch (header->type) {
+	const bool local = header->type & LOCAL_L2_FLAG;
+	const bool split = header->type & SPLIT_KV_FLAG;
+	const bool compress = header->type & COMPRESS_VALUE_FLAG;
+	const bool var_key = header->type & VAR_KEY_FLAG;
+	const bool salted = header->type & SEGMENT_SALT_FLAG;
+	const auto type = header->type & ~(LOCAL_L2_FLAG | SPLIT_KV_FLAG | COMPRESS_VALUE_FLAG | VAR_KEY_FLAG
+		| SEGMENT_SALT_FLAG);
+	if ((split && type != PerfectHashtable::KV_INLINE) || (compress && type != PerfectHashtable::KV_SEPARATED)) {
+		return nullptr;
+	}
+	if (var_key && (split || header->key_len != 0 || type == PerfectHashtable::INDEX_ONLY
+			|| type == PerfectHashtable::FINGERPRINT_SET)) {
+		return nullptr;
+	}
+	const uint8_t key_len = var_key? KEY_REF_SIZE : header->key_len;
+	switch (type) {
 		case PerfectHashtable::KV_SEPARATED: if (header->val_len != OFFSET_FIELD_SIZE) return nullptr;
 		case PerfectHashtable::KV_INLINE: if (header->val_len == 0) return nullptr;
-		case PerfectHashtable::KEY_SET: if (header->key_len == 0) return nullptr;
+		case PerfectHashtable::KEY_SET: if (key_len == 0) return nullptr;
 		case PerfectHashtable::INDEX_ONLY: break;
+		case PerfectHashtable::FINGERPRINT_SET:
+			if (header->key_len == 0 || !IsFingerprintSize(header->val_len)) return nullptr;
+			break;
 		default: return nullptr;
 	}
 
@@ -44,6 +66,12 @@ std::unique_ptr<uint8_t[]> CreatePackView(const uint8_t* addr, size_t size) {
 	const auto parts = (const uint32_t*)(addr + addr_off);
 	addr_off += header->seg_cnt*4U;
 	if (size < addr_off) return nullptr;
+	const uint32_t* salts = nullptr;
+	if (salted) {
+		salts = (const uint32_t*)(addr + addr_off);
+		addr_off += header->seg_cnt*4U;
+		if (size < addr_off) return nullptr;
+	}
 
 #if defined(_WIN32)
 	auto view = std::make_unique<uint8_t[]>(sizeof(PackView) + sizeof(SegmentView) * (header->seg_cnt - 1U));
@@ -52,10 +80,12 @@ std::unique_ptr<uint8_t[]> CreatePackView(const uint8_t* addr, size_t size) {
 #endif
 	auto index = (PackView*)view.get();
 	*index = PackView{};
-	index->type = (Type)header->type;
-	index->key_len = header->key_len;
+	index->type = (Type)type;
+	index->layout = (local? LAYOUT_LOCAL_L2 : LAYOUT_SPREAD) | (split? LAYOUT_SPLIT_KV : LAYOUT_SPREAD)
+		| (compress? LAYOUT_COMPRESS_VALUE : LAYOUT_SPREAD) | (var_key? LAYOUT_VAR_KEY : LAYOUT_SPREAD);
+	index->key_len = key_len;
 	index->val_len = header->val_len;
-	index->line_size = ((uint32_t)index->key_len) + index->val_len;
+	index->line_size = LineSize(index->type, index->key_len, index->val_len);
 	index->seed = header->seed;
 	index->l0sz = header->seg_cnt;
 	index->item = ((((uint64_t)header->item_high)<<32U) | header->item);
@@ -66,6 +96,12 @@ std::unique_ptr<uint8_t[]> CreatePackView(const uint8_t* addr, size_t size) {
 		index->segments[i] = SegmentView{};
 		index->segments[i].l1bd = L1Band(parts[i]);
 		index->segments[i].l2sz = L2Size(parts[i]);
+		if (local) {
+			index->segments[i].l2pairs = L2Pairs(parts[i]);
+		}
+		if (salts != nullptr) {
+			index->segments[i].salt = salts[i];
+		}
 		index->segments[i].offset = total_item;
 		total_item += parts[i];
 		index->segments[i].cells = addr + addr_off;
@@ -75,21 +111,40 @@ std::unique_ptr<uint8_t[]> CreatePackView(const uint8_t* addr, size_t size) {
 	if (total_item != index->item) {
 		return nullptr;
 	}
-	addr_off = (addr_off+31U)&(~31U);
+	addr_off = local? (addr_off+63U)&(~63U) : (addr_off+31U)&(~31U);
 	if (size < addr_off) return nullptr;
 	for (unsigned i = 0; i < header->seg_cnt; i++) {
 		index->segments[i].sections = (const BitmapSection*)(addr + addr_off);
-		addr_off += SectionSize(parts[i]) * (size_t)sizeof(BitmapSection);
+		addr_off += SectionSize(parts[i], local) * (size_t)sizeof(BitmapSection);
 		if (size < addr_off) return nullptr;
 	}
 
-	if (header->type != PerfectHashtable::INDEX_ONLY) {
+	if (split) {
+		addr_off = (addr_off+63U)&(~63U);
+		index->content = addr + addr_off;
+		addr_off += SplitValueOffset(total_item, index->key_len);
+		index->values = addr + addr_off;
+		addr_off += index->val_len * total_item;
+		if (size < addr_off) return nullptr;
+	} else if (type != PerfectHashtable::INDEX_ONLY) {
 		index->content = addr + addr_off;
 		addr_off += index->line_size * total_item;
 		if (size < addr_off) return nullptr;
-		if (header->type == PerfectHashtable::KV_SEPARATED) {
+		if (var_key) {
+			if (size - addr_off < sizeof(uint64_t)) return nullptr;
+			memcpy(&index->keys_size, addr + addr_off, sizeof(uint64_t));
+			addr_off += sizeof(uint64_t);
+			if (size - addr_off < index->keys_size) return nullptr;
+			index->keys = addr + addr_off;
+			addr_off += index->keys_size;
+		}
+		if (type == PerfectHashtable::KV_SEPARATED) {
 			index->extend = addr + addr_off;
-			if (size < addr_off + total_item) return nullptr;
+			if (compress) {
+				if (!LoadValueBlocks(index->extend, addr + size, index->blocks)) return nullptr;
+			} else if (size < addr_off + total_item) {
+				return nullptr;
+			}
 		}
 	}
 	index->space_end = addr + size;
@@ -133,13 +188,20 @@ PerfectHashtable::PerfectHashtable(const std::string& path, LoadPolicy load_poli
 void PerfectHashtable::_post_init() noexcept {
 	auto index = (const PackView*)m_view.get();
 	m_type = index->type;
-	m_key_len = index->key_len;
-	if (index->type == KV_SEPARATED) {
+	m_key_len = index->keys != nullptr? 0 : index->key_len;
+	if (index->type == KV_SEPARATED || index->type == FINGERPRINT_SET) {
 		m_val_len = 0;
 	} else {
 		m_val_len = index->val_len;
 	}
 	m_item = index->item;
+	static_assert(PIPELINE_LEVELS == ::PIPELINE_LEVELS, "pipeline levels mismatch");
+	auto view = (PackView*)m_view.get();
+	if (!m_mem) {
+		view->level = GuessPipelineLevel(m_res.size(), false);
+	} else {
+		view->level = GuessPipelineLevel(m_mem.size(), true);
+	}
 }
 
 PerfectHashtable::PerfectHashtable(size_t size, const std::function<bool(uint8_t*)>& load) {
@@ -198,6 +260,9 @@ Slice SeparatedValue(const uint8_t* pt, const uint8_t* end) {
 
 Slice SeparatedValueAt(const PackView& pack, const uint8_t* field) {
 	const auto offset = ReadOffsetField(field);
+	if (pack.blocks.cnt != 0) {
+		return CompressedValueAt(pack.blocks, offset);
+	}
 	const auto extend_size = static_cast<size_t>(pack.space_end-pack.extend);
 	if (offset >= extend_size) {
 		return {};
@@ -207,21 +272,60 @@ Slice SeparatedValueAt(const PackView& pack, const uint8_t* field) {
 
 Slice PerfectHashtable::search(const uint8_t* key) const noexcept {
 	auto pack = (const PackView*)m_view.get();
-	if (UNLIKELY(pack == nullptr || key == nullptr || pack->type == INDEX_ONLY)) {
+	if (UNLIKELY(pack == nullptr || key == nullptr || pack->type == INDEX_ONLY || pack->keys != nullptr)) {
 		return {};
 	}
+	if (pack->type == FINGERPRINT_SET) {
+		return {SearchFingerprint(*pack, key), 0};
+	}
 	auto pos = CalcPos(*pack, key, pack->key_len);
-	auto line = pack->content + pos*pack->line_size;
+	auto line = KeyAt(*pack, pos);
 	if (UNLIKELY(pos >= pack->item) || !Equal(line, key, pack->key_len)) {
 		return {};
 	}
-	auto field = line + pack->key_len;
+	auto field = ValueAt(*pack, pos, line);
 	if (pack->type != KV_SEPARATED) {
 		return {field, pack->val_len};
 	}
+	ResetValueArena();
 	return SeparatedValueAt(*pack, field);
 }
 
+Slice PerfectHashtable::search(const uint8_t* key, uint8_t key_len) const noexcept {
+	auto pack = (const PackView*)m_view.get();
+	if (UNLIKELY(pack == nullptr || key == nullptr || key_len == 0)) {
+		return {};
+	}
+	if (pack->keys == nullptr) {
+		return key_len == m_key_len? search(key) : Slice{};
+	}
+	auto line = SearchVarKey(*pack, key, key_len);
+	if (line == nullptr) {
+		return {};
+	}
+	auto field = line + KEY_REF_SIZE;
+	if (pack->type != KV_SEPARATED) {
+		return {field, pack->val_len};
+	}
+	ResetValueArena();
+	return SeparatedValueAt(*pack, field);
+}
+
+unsigned PerfectHashtable::_chain(const PerfectHashtable* const patches[], unsigned depth,
+								  const PackView* layers[]) const noexcept {
+	if (m_view == nullptr || depth > MAX_PATCH_DEPTH || (depth != 0 && patches == nullptr)) {
+		return 0;
+	}
+	for (unsigned i = 0; i < depth; i++) {
+		if (patches[i] == nullptr || patches[i]->m_view == nullptr) {
+			return 0;
+		}
+		layers[i] = (const PackView*)patches[i]->m_view.get();
+	}
+	layers[depth] = (const PackView*)m_view.get();
+	return depth + 1;
+}
+
 unsigned PerfectHashtable::batch_search(unsigned batch, const uint8_t* const keys[], const uint8_t* out[],
 										const PerfectHashtable* patch) const noexcept {
 	auto base = (const PackView*)m_view.get();
@@ -230,13 +334,57 @@ unsigned PerfectHashtable::batch_search(unsigned batch, const uint8_t* const key
 	}
 	if (patch == nullptr) {
 		return BatchSearch(*base, batch, keys, out);
-	} else {
-		auto delta = (const PackView*)patch->m_view.get();
-		if (delta == nullptr) {
-			return 0;
+	}
+	return batch_search(batch, keys, out, &patch, 1);
+}
+
+unsigned PerfectHashtable::batch_search(unsigned batch, const uint8_t* const keys[], const uint8_t* out[],
+										const PerfectHashtable* const patches[], unsigned depth) const noexcept {
+	const PackView* layers[MAX_PATCH_DEPTH+1];
+	const auto n = _chain(patches, depth, layers);
+	if (n == 0 || keys == nullptr || out == nullptr) {
+		return 0;
+	}
+	return BatchSearch(layers, n, batch, keys, out);
+}
+
+unsigned PerfectHashtable::batch_search(unsigned batch, const uint8_t* const keys[], Slice out[]) const noexcept {
+	auto pack = (const PackView*)m_view.get();
+	if (pack == nullptr || keys == nullptr || out == nullptr) {
+		return 0;
+	}
+	ResetValueArena();
+	return BatchSearch(*pack, batch, keys, out);
+}
+
+unsigned PerfectHashtable::batch_search(unsigned batch, const Slice keys[], Slice out[]) const noexcept {
+	auto pack = (const PackView*)m_view.get();
+	if (pack == nullptr || keys == nullptr || out == nullptr) {
+		return 0;
+	}
+	ResetValueArena();
+	if (pack->keys != nullptr) {
+		return BatchSearch(*pack, batch, keys, out);
+	}
+	//key of other length is a miss, a blank key stands in for it
+	static const uint8_t blank[MAX_KEY_LEN] = {};
+	constexpr unsigned CHUNK = 256;
+	const uint8_t* ptrs[CHUNK];
+	unsigned hit = 0;
+	for (unsigned off = 0; off < batch; off += CHUNK) {
+		const auto n = std::min(CHUNK, batch-off);
+		for (unsigned i = 0; i < n; i++) {
+			ptrs[i] = keys[off+i].len == m_key_len? keys[off+i].ptr : blank;
+		}
+		hit += BatchSearch(*pack, n, ptrs, out+off);
+		for (unsigned i = 0; i < n; i++) {
+			if (keys[off+i].len != m_key_len && out[off+i].valid()) {
+				out[off+i] = {};
+				hit--;
+			}
 		}
-		return BatchSearch(*base, *delta, batch, keys, out);
 	}
+	return hit;
 }
 
 unsigned PerfectHashtable::batch_fetch(unsigned batch, const uint8_t* __restrict keys, uint8_t* __restrict data,
@@ -247,13 +395,19 @@ unsigned PerfectHashtable::batch_fetch(unsigned batch, const uint8_t* __restrict
 	}
 	if (patch == nullptr) {
 		return BatchFetch(*base, dft_val, batch, keys, data, nullptr);
-	} else {
-		auto delta = (const PackView*)patch->m_view.get();
-		if (delta == nullptr) {
-			return 0;
-		}
-		return BatchFetch(*base, *delta, dft_val, batch, keys, data, nullptr);
 	}
+	return batch_fetch(batch, keys, data, dft_val, &patch, 1);
+}
+
+unsigned PerfectHashtable::batch_fetch(unsigned batch, const uint8_t* __restrict keys, uint8_t* __restrict data,
+									   const uint8_t* __restrict dft_val, const PerfectHashtable* const patches[],
+									   unsigned depth) const noexcept {
+	const PackView* layers[MAX_PATCH_DEPTH+1];
+	const auto n = _chain(patches, depth, layers);
+	if (n == 0 || keys == nullptr || data == nullptr) {
+		return 0;
+	}
+	return BatchFetch(layers, n, dft_val, batch, keys, data, nullptr);
 }
 
 unsigned PerfectHashtable::batch_try_fetch(unsigned batch, const uint8_t* __restrict keys, uint8_t* __restrict data,
@@ -264,18 +418,141 @@ unsigned PerfectHashtable::batch_try_fetch(unsigned batch, const uint8_t* __rest
 	}
 	if (patch == nullptr) {
 		return BatchFetch(*base, nullptr, batch, keys, data, miss);
-	} else {
-		auto delta = (const PackView*)patch->m_view.get();
-		if (delta == nullptr) {
-			return 0;
+	}
+	return batch_try_fetch(batch, keys, data, miss, &patch, 1);
+}
+
+unsigned PerfectHashtable::batch_try_fetch(unsigned batch, const uint8_t* __restrict keys, uint8_t* __restrict data,
+										   unsigned* __restrict miss, const PerfectHashtable* const patches[],
+										   unsigned depth) const noexcept {
+	const PackView* layers[MAX_PATCH_DEPTH+1];
+	const auto n = _chain(patches, depth, layers);
+	if (n == 0 || keys == nullptr || data == nullptr) {
+		return 0;
+	}
+	return BatchFetch(layers, n, nullptr, batch, keys, data, miss);
+}
+
+unsigned PerfectHashtable::fingerprint_bits() const noexcept {
+	auto index = (const PackView*)m_view.get();
+	return index == nullptr || index->type != FINGERPRINT_SET? 0 : index->val_len * 8U;
+}
+
+IndexLayout PerfectHashtable::layout() const noexcept {
+	auto index = (const PackView*)m_view.get();
+	return index == nullptr? LAYOUT_SPREAD : index->layout;
+}
+
+unsigned PerfectHashtable::pipeline_level() const noexcept {
+	auto index = (const PackView*)m_view.get();
+	return index == nullptr? 0 : index->level;
+}
+
+bool PerfectHashtable::set_pipeline_level(unsigned level) noexcept {
+	auto index = (PackView*)m_view.get();
+	if (index == nullptr || level >= PIPELINE_LEVELS) {
+		return false;
+	}
+	index->level = level;
+	return true;
+}
+
+unsigned PerfectHashtable::tune_pipeline() {
+	auto pack = (PackView*)m_view.get();
+	if (pack == nullptr || pack->item == 0) {
+		return pipeline_level();
+	}
+	//keys are sampled from the table, index only table or fingerprint set just takes random keys
+	constexpr unsigned BATCH = 2048;
+	constexpr unsigned ROUND = 3;
+	constexpr unsigned TOTAL = BATCH * PIPELINE_LEVELS * ROUND;
+	const unsigned key_len = pack->type == INDEX_ONLY? sizeof(uint64_t) : pack->key_len;
+	std::vector<uint8_t> keys(TOTAL * key_len);
+	std::vector<Slice> var_keys(pack->keys != nullptr? TOTAL : 0);	//point into arena
+	std::mt19937_64 rng(pack->seed);
+	for (unsigned i = 0; i < TOTAL; i++) {
+		auto key = keys.data() + i*key_len;
+		if (pack->keys != nullptr) {
+			var_keys[i] = VarKeyAt(*pack, KeyAt(*pack, rng() % pack->item));
+		} else if (pack->type == INDEX_ONLY || pack->type == FINGERPRINT_SET) {
+			for (unsigned j = 0; j < key_len; j += sizeof(uint64_t)) {
+				const uint64_t x = rng();
+				memcpy(key + j, &x, std::min<size_t>(sizeof(x), key_len - j));
+			}
+		} else {
+			memcpy(key, KeyAt(*pack, rng() % pack->item), key_len);
+		}
+	}
+	std::vector<const uint8_t*> ptrs(BATCH);
+	std::vector<Slice> slices(BATCH);
+	std::vector<uint64_t> pos(BATCH);
+	std::vector<uint8_t> data(pack->type == KV_INLINE? BATCH*pack->val_len : 0);
+
+	std::chrono::steady_clock::duration best[PIPELINE_LEVELS];
+	std::fill(best, best+PIPELINE_LEVELS, std::chrono::steady_clock::duration::max());
+	for (unsigned r = 0; r < ROUND; r++) {
+		//rotate the order so no level always runs on a warm cache
+		for (unsigned j = 0; j < PIPELINE_LEVELS; j++) {
+			const unsigned level = (r + j) % PIPELINE_LEVELS;
+			const auto part = keys.data() + (r*PIPELINE_LEVELS+j)*BATCH*key_len;
+			for (unsigned i = 0; i < BATCH; i++) {
+				ptrs[i] = part + i*key_len;
+			}
+			pack->level = level;
+			ResetValueArena();
+			const auto start = std::chrono::steady_clock::now();
+			if (pack->keys != nullptr) {
+				BatchSearch(*pack, BATCH, var_keys.data() + (r*PIPELINE_LEVELS+j)*BATCH, slices.data());
+			} else if (pack->type == INDEX_ONLY) {
+				BatchLocate(*pack, BATCH, part, key_len, pos.data());
+			} else if (pack->type == KV_INLINE) {
+				BatchFetch(*pack, nullptr, BATCH, part, data.data(), nullptr);
+			} else {
+				BatchSearch(*pack, BATCH, ptrs.data(), slices.data());
+			}
+			best[level] = std::min(best[level], std::chrono::steady_clock::now() - start);
 		}
-		return BatchFetch(*base, *delta, nullptr, batch, keys, data, miss);
 	}
+	pack->level = std::min_element(best, best+PIPELINE_LEVELS) - best;
+	return pack->level;
+}
+
+bool PerfectHashtable::build_hot_cache(unsigned n, const uint8_t* keys, unsigned capacity) {
+	auto pack = (PackView*)m_view.get();
+	if (pack == nullptr) {
+		return false;
+	}
+	MemBlock mem;
+	auto cache = CreateHotCache(*pack, n, keys, capacity, mem);
+	if (cache == nullptr) {
+		return false;
+	}
+	pack->hot = cache;
+	m_hot = std::move(mem);
+	return true;
+}
+
+void PerfectHashtable::drop_hot_cache() noexcept {
+	auto pack = (PackView*)m_view.get();
+	if (pack != nullptr) {
+		pack->hot = nullptr;
+	}
+	m_hot = MemBlock();
+}
+
+PerfectHashtable::HotCacheStats PerfectHashtable::hot_cache_stats() const noexcept {
+	auto pack = (const PackView*)m_view.get();
+	HotCacheStats out;
+	if (pack != nullptr && pack->hot != nullptr) {
+		out.lookup = AddRelaxed(pack->hot->lookup, (uint64_t)0);
+		out.hit = AddRelaxed(pack->hot->hit, (uint64_t)0);
+	}
+	return out;
 }
 
 BuildStatus PerfectHashtable::derive(const DataReaders& in, IDataWriter& out, Retry retry) const {
 	auto base = (const PackView*)m_view.get();
-	if (base == nullptr || base->type == INDEX_ONLY) {
+	if (base == nullptr || base->type == INDEX_ONLY || base->type == FINGERPRINT_SET) {
 		return BUILD_STATUS_BAD_INPUT;
 	}
 	return Rebuild(*base, in, out, retry);
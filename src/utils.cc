@@ -155,6 +155,24 @@ bool WriteAll(int fd, const void* buf, size_t size) noexcept {
 }
 
 #if !defined(_WIN32)
+bool WriteAllAt(int fd, const void* buf, size_t size, size_t offset) noexcept {
+	auto data = static_cast<const uint8_t*>(buf);
+	size_t done = 0;
+	while (done < size) {
+		const auto chunk = std::min(size - done, BLOCK_SIZE);
+		const auto written = pwrite(fd, data + done, chunk, static_cast<off_t>(offset + done));
+		if (written > 0) {
+			done += static_cast<size_t>(written);
+			continue;
+		}
+		if (written < 0 && errno == EINTR) {
+			continue;
+		}
+		return false;
+	}
+	return true;
+}
+
 static unsigned DetectHugePageShift() noexcept {
 #if !defined(__linux__) || !defined(MAP_HUGETLB)
 	return 0;
@@ -423,13 +441,22 @@ MemMap::~MemMap() noexcept {
 }
 
 FileWriter::FileWriter(const char* path) {
+#if defined(_WIN32)
 	m_fd = OpenWrite(path);
+#else
+	//shared mapping needs read too, write only is enough for the rest
+	m_fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (m_fd < 0 && errno == EACCES) {
+		m_fd = OpenWrite(path);
+	}
+#endif
 	if (m_fd >= 0) {
 		m_buf = std::make_unique<uint8_t[]>(BUFSZ);
 	}
 }
 
 FileWriter::~FileWriter() noexcept {
+	_unmap();
 	if (m_fd >= 0) {
 		_flush();
 		Close(m_fd);
@@ -476,6 +503,7 @@ bool FileWriter::write(const void* data, size_t n) noexcept {
 	if (m_fd < 0) {
 		return false;
 	}
+	m_done += n;
 	if (m_off + n < BUFSZ) {
 		std::memcpy(m_buf.get() + m_off, data, n);
 		m_off += static_cast<unsigned>(n);
@@ -493,4 +521,80 @@ bool FileWriter::write(const void* data, size_t n) noexcept {
 	return true;
 }
 
+size_t FileWriter::reserve(size_t n) noexcept {
+#if defined(_WIN32)
+	(void)n;
+	return SIZE_MAX;
+#else
+	if (m_fd < 0 || !_flush() || lseek(m_fd, static_cast<off_t>(n), SEEK_CUR) < 0) {
+		return SIZE_MAX;
+	}
+	const auto offset = m_done;
+	m_done += n;
+	return offset;
+#endif
+}
+
+bool FileWriter::write_at(size_t offset, const void* data, size_t n) noexcept {
+#if defined(_WIN32)
+	(void)offset;
+	(void)data;
+	(void)n;
+	return false;
+#else
+	return m_fd >= 0 && WriteAllAt(m_fd, data, n, offset);
+#endif
+}
+
+void FileWriter::_unmap() noexcept {
+#if !defined(_WIN32)
+	if (m_map != nullptr) {
+		munmap(m_map, m_map_size);
+		m_map = nullptr;
+		m_map_size = 0;
+	}
+#endif
+}
+
+bool FileWriter::can_map() const noexcept {
+#if !defined(__linux__)
+	return false;
+#else
+	struct stat st{};
+	return m_fd >= 0 && fstat(m_fd, &st) == 0 && S_ISREG(st.st_mode)
+		&& (fcntl(m_fd, F_GETFL) & O_ACCMODE) == O_RDWR;
+#endif
+}
+
+uint8_t* FileWriter::map(size_t n) noexcept {
+#if !defined(__linux__)
+	(void)n;
+	return nullptr;
+#else
+	if (n == 0 || !can_map() || !_flush()) {
+		return nullptr;
+	}
+	_unmap();
+	const auto offset = m_done;
+	const auto head = offset % static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	//blocks must be taken now, a sparse file would fail later by SIGBUS
+	if (posix_fallocate(m_fd, static_cast<off_t>(offset), static_cast<off_t>(n)) != 0) {
+		return nullptr;
+	}
+	auto addr = mmap(nullptr, head + n, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd,
+					 static_cast<off_t>(offset - head));
+	if (addr == MAP_FAILED) {
+		return nullptr;
+	}
+	if (lseek(m_fd, static_cast<off_t>(n), SEEK_CUR) < 0) {
+		munmap(addr, head + n);
+		return nullptr;
+	}
+	m_map = static_cast<uint8_t*>(addr);
+	m_map_size = head + n;
+	m_done += n;
+	return m_map + head;
+#endif
+}
+
 } // namespace shd
@@ -19,6 +19,7 @@
 #pragma once
 
 #include <cstring>
+#include <algorithm>
 #include <utils.h>
 
 class EmbeddingGenerator : public shd::IDataReader {
@@ -46,16 +47,63 @@ public:
 		arr[3] = m_current ^ m_mask;
 		return {{(const uint8_t*)&m_current, sizeof(uint64_t)}, {m_val, VALUE_SIZE}};
 	}
+	unsigned read_batch(shd::Record out[], unsigned n, bool) override {
+		n = std::min(n, BATCH);
+		for (unsigned i = 0; i < n; i++) {
+			m_keys[i] = ++m_current;
+			auto arr = (uint64_t*)m_vals[i];
+			arr[0] = m_current ^ m_mask;
+			arr[1] = m_current ^ m_mask;
+			arr[2] = m_current ^ m_mask;
+			arr[3] = m_current ^ m_mask;
+			out[i] = {{(const uint8_t*)&m_keys[i], sizeof(uint64_t)}, {m_vals[i], VALUE_SIZE}};
+		}
+		return n;
+	}
 	static constexpr unsigned VALUE_SIZE = 32;	//fp16 * 16
 
 private:
+	static constexpr unsigned BATCH = 16;
 	uint64_t m_current;
 	uint8_t m_val[VALUE_SIZE];
+	uint64_t m_keys[BATCH];
+	uint8_t m_vals[BATCH][VALUE_SIZE];
 	const uint64_t m_begin;
 	const uint64_t m_total;
 	const uint64_t m_mask;
 };
 
+//fixed values wider than a cache line, as fp16 embeddings of 128 dims
+class WideValueGenerator : public shd::IDataReader {
+public:
+	static constexpr unsigned VALUE_SIZE = 256;
+	explicit WideValueGenerator(uint64_t begin, uint64_t total)
+		: m_current(begin-1), m_begin(begin), m_total(total)
+	{}
+	WideValueGenerator(const WideValueGenerator&) = delete;
+	WideValueGenerator& operator=(const WideValueGenerator&) = delete;
+
+	void reset() override {
+		m_current = m_begin-1;
+	}
+	size_t total() override {
+		return m_total;
+	}
+	shd::Record read(bool) override {
+		m_current++;
+		for (unsigned i = 0; i < VALUE_SIZE/sizeof(uint64_t); i++) {
+			m_val[i] = m_current * (i+1);
+		}
+		return {{(const uint8_t*)&m_current, sizeof(uint64_t)}, {(const uint8_t*)m_val, VALUE_SIZE}};
+	}
+
+private:
+	uint64_t m_current;
+	uint64_t m_val[VALUE_SIZE/sizeof(uint64_t)];
+	const uint64_t m_begin;
+	const uint64_t m_total;
+};
+
 class VariedValueGenerator : public shd::IDataReader {
 public:
 	explicit VariedValueGenerator(uint64_t begin, uint64_t total, unsigned shift=5U)
@@ -85,6 +133,93 @@ private:
 	const unsigned m_shift;
 };
 
+//values up to 96KB, odd keys get noise that does not compress
+class BulkValueGenerator : public shd::IDataReader {
+public:
+	static constexpr unsigned MAX_VALUE_SIZE = 96U*1024U;
+	explicit BulkValueGenerator(uint64_t begin, uint64_t total, unsigned big_every=64U)
+		: m_current(begin-1), m_begin(begin), m_total(total), m_big_every(big_every),
+		  m_val(new uint8_t[MAX_VALUE_SIZE])
+	{}
+	BulkValueGenerator(const BulkValueGenerator&) = delete;
+	BulkValueGenerator& operator=(const BulkValueGenerator&) = delete;
+	~BulkValueGenerator() noexcept override {
+		delete[] m_val;
+	}
+
+	void reset() override {
+		m_current = m_begin-1;
+	}
+	size_t total() override {
+		return m_total;
+	}
+	shd::Record read(bool) override {
+		m_current++;
+		const unsigned len = (m_current % m_big_every == 0)? MAX_VALUE_SIZE - m_current % 1024U
+												: (m_current * 7919U) % 1024U;
+		uint64_t x = m_current * 0x9E3779B97F4A7C15ULL + 1U;
+		for (unsigned i = 0; i < len; i++) {
+			if (m_current & 1U) {
+				x ^= x << 13U;
+				x ^= x >> 7U;
+				x ^= x << 17U;
+				m_val[i] = x;
+			} else {
+				m_val[i] = m_current + i % 16U;
+			}
+		}
+		return {{(const uint8_t*)&m_current, sizeof(uint64_t)}, {m_val, len}};
+	}
+
+private:
+	uint64_t m_current;
+	const uint64_t m_begin;
+	const uint64_t m_total;
+	const unsigned m_big_every;
+	uint8_t* m_val;
+};
+
+//decimal key padded to 1~100 bytes, so some keys are prefix of others
+class VarKeyGenerator : public shd::IDataReader {
+public:
+	static constexpr unsigned MAX_KEY_SIZE = 100;
+	explicit VarKeyGenerator(uint64_t begin, uint64_t total, uint64_t mask=0)
+		: m_current(begin-1), m_begin(begin), m_total(total), m_mask(mask)
+	{}
+	VarKeyGenerator(const VarKeyGenerator&) = delete;
+	VarKeyGenerator& operator=(const VarKeyGenerator&) = delete;
+
+	void reset() override {
+		m_current = m_begin-1;
+	}
+	size_t total() override {
+		return m_total;
+	}
+	shd::Record read(bool) override {
+		m_current++;
+		const unsigned len = MakeKey(m_current, m_key);
+		m_val = m_current ^ m_mask;
+		return {{m_key, len}, {(const uint8_t*)&m_val, sizeof(uint64_t)}};
+	}
+
+	static unsigned MakeKey(uint64_t n, uint8_t* key) {
+		unsigned len = 0;
+		for (auto x = n; len == 0 || x != 0; x /= 10U) {
+			key[len++] = '0' + x % 10U;
+		}
+		const unsigned total = std::max(len, (unsigned)(n * 7U % MAX_KEY_SIZE) + 1U);
+		memset(key+len, '-', total-len);
+		return total;
+	}
+
+private:
+	uint64_t m_current;
+	const uint64_t m_begin;
+	const uint64_t m_total;
+	const uint64_t m_mask;
+	uint64_t m_val = 0;
+	uint8_t m_key[MAX_KEY_SIZE];
+};
 
 class FakeWriter : public shd::IDataWriter {
 public:
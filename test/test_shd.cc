@@ -16,13 +16,17 @@
 // along with the This Library; if not, see <https://www.gnu.org/licenses/>.
 //==============================================================================
 
+#include <cstdio>
 #include <cstring>
 #include <memory>
+#include <mutex>
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <gtest/gtest.h>
 #include <shd.h>
 #include "test.h"
+#include "../src/internal.h"
 
 static constexpr unsigned PIECE = 1000;
 
@@ -149,6 +153,63 @@ TEST(SHD, KeySet) {
 	ASSERT_EQ(dict.batch_fetch(keys.size(), (const uint8_t*)keys.data(), (uint8_t*)out.data()), 0);
 }
 
+TEST(SHD, FingerprintSet) {
+	FakeWriter fake_output;
+	{
+		auto input = CreateReaders<EmbeddingGenerator>(1, EmbeddingGenerator::MASK0);
+		ASSERT_EQ(shd::BuildFingerprintSet(input, fake_output, 12), shd::BUILD_STATUS_BAD_INPUT);
+		ASSERT_EQ(shd::BuildFingerprintSet(input, fake_output, 64), shd::BUILD_STATUS_BAD_INPUT);
+	}
+	const std::string filename = "fingerprint.shd";
+	for (unsigned bits = 8; bits <= 32; bits *= 2) {
+		{
+			shd::FileWriter output(filename.c_str());
+			auto input = CreateReaders<EmbeddingGenerator>(2, EmbeddingGenerator::MASK0);
+			shd::BuildOptions options;
+			options.seeds = {bits};	//false positives below are counted on a fixed table
+			ASSERT_EQ(shd::BuildFingerprintSet(input, output, bits, options), shd::BUILD_STATUS_OK);
+		}
+		shd::PerfectHashtable set(filename);
+		ASSERT_FALSE(!set);
+		ASSERT_EQ(set.type(), shd::PerfectHashtable::FINGERPRINT_SET);
+		ASSERT_EQ(set.key_len(), sizeof(uint64_t));
+		ASSERT_EQ(set.val_len(), 0);
+		ASSERT_EQ(set.fingerprint_bits(), bits);
+		ASSERT_EQ(set.item(), PIECE*2);
+
+		constexpr unsigned STRANGER = PIECE*64;
+		std::vector<uint64_t> keys(PIECE*2 + STRANGER);
+		for (unsigned i = 0; i < keys.size(); i++) {
+			keys[i] = i;
+		}
+		std::vector<const uint8_t*> in(keys.size());
+		for (unsigned i = 0; i < keys.size(); i++) {
+			in[i] = (const uint8_t*)&keys[i];
+		}
+		std::vector<const uint8_t*> out(keys.size());
+		std::vector<shd::Slice> slices(keys.size());
+		const auto hit = set.batch_search(keys.size(), in.data(), out.data());
+		ASSERT_EQ(set.batch_search(keys.size(), in.data(), slices.data()), hit);
+		for (unsigned i = 0; i < keys.size(); i++) {
+			ASSERT_EQ(slices[i].ptr, out[i]);
+			ASSERT_EQ(set.search(in[i]).ptr, out[i]);
+			if (i < PIECE*2) {
+				ASSERT_NE(out[i], nullptr);
+			}
+		}
+		//false positive rate is about 2^-bits
+		const double expected = STRANGER / (double)(1ULL << bits);
+		ASSERT_LE(hit - PIECE*2, expected*2 + 4);
+		if (bits == 8) {
+			ASSERT_GE(hit - PIECE*2, expected/2);
+		}
+
+		shd::FileWriter output("fingerprint-new.shd");
+		auto input = CreateReaders<EmbeddingGenerator>(1, EmbeddingGenerator::MASK1);
+		ASSERT_EQ(set.derive(input, output), shd::BUILD_STATUS_BAD_INPUT);
+	}
+}
+
 TEST(SHD, SmallSet) {
 	shd::DataReaders input(1);
 	const uint64_t shift = 9999;
@@ -209,6 +270,216 @@ TEST(SHD, LocalizedShuffle) {
 	ASSERT_FALSE(table.search(reinterpret_cast<const uint8_t*>(&missing)).valid());
 }
 
+TEST(SHD, SegmentOption) {
+	auto seg_cnt = [](const char* path)->unsigned {
+		uint16_t cnt = 0;
+		auto fp = fopen(path, "rb");
+		if (fp != nullptr) {
+			if (fseek(fp, 18, SEEK_SET) != 0 || fread(&cnt, sizeof(cnt), 1, fp) != 1) {
+				cnt = 0;
+			}
+			fclose(fp);
+		}
+		return cnt;
+	};
+	static constexpr uint64_t TOTAL = 40000;
+	const std::string filename = "segment-option.shd";
+	shd::BuildOptions options;
+	options.segments = 4;
+	options.workers = 3;
+	{
+		shd::FileWriter output(filename.c_str());
+		shd::DataReaders input;
+		input.push_back(std::make_unique<EmbeddingGenerator>(0, TOTAL));
+		ASSERT_EQ(shd::BuildDict(input, output, options), shd::BUILD_STATUS_OK);
+	}
+	ASSERT_EQ(seg_cnt(filename.c_str()), 4U);
+	{
+		shd::PerfectHashtable dict(filename);
+		ASSERT_FALSE(!dict);
+		ASSERT_EQ(dict.item(), TOTAL);
+		EmbeddingGenerator checker(0, TOTAL+1);
+		for (uint64_t i = 0; i <= TOTAL; i++) {
+			auto rec = checker.read(false);
+			auto val = dict.search(rec.key.ptr);
+			if (i == TOTAL) {
+				ASSERT_FALSE(val.valid());
+				break;
+			}
+			ASSERT_TRUE(val.valid());
+			ASSERT_EQ(memcmp(val.ptr, rec.val.ptr, rec.val.len), 0);
+		}
+	}
+
+	//more readers than segments
+	auto input = CreateReaders<EmbeddingGenerator>(300, EmbeddingGenerator::MASK0);
+	FakeWriter fake_output;
+	ASSERT_EQ(shd::BuildSet(input, fake_output), shd::BUILD_STATUS_BAD_INPUT);
+	options.segments = shd::MAX_SEGMENT + 1U;
+	ASSERT_EQ(shd::BuildSet(input, fake_output, options), shd::BUILD_STATUS_BAD_INPUT);
+	options.segments = 2;
+	{
+		shd::FileWriter output(filename.c_str());
+		ASSERT_EQ(shd::BuildSet(input, output, options), shd::BUILD_STATUS_OK);
+	}
+	ASSERT_EQ(seg_cnt(filename.c_str()), 2U);
+	shd::PerfectHashtable set(filename);
+	ASSERT_FALSE(!set);
+	ASSERT_EQ(set.item(), PIECE*300);
+	for (uint64_t i = 0; i < PIECE*300; i++) {
+		ASSERT_TRUE(set.search((const uint8_t*)&i).valid());
+	}
+}
+
+class RecordingObserver : public shd::BuildObserver {
+public:
+	void on_phase(shd::BuildPhase phase, double seconds) override {
+		ASSERT_GE(seconds, 0.0);
+		phases.push_back(phase);
+	}
+	void on_segment(const shd::SegmentStats& stats) override {
+		std::lock_guard<std::mutex> guard(lock);
+		segments.push_back(stats);
+	}
+	void on_retry(shd::BuildStatus reason, unsigned segment) override {
+		retries.push_back(reason);
+		retried.push_back(segment);
+	}
+	void on_output(uint64_t bytes) override {
+		output = bytes;
+	}
+	void on_plan(const shd::MemoryPlan& plan) override {
+		plans.push_back(plan);
+	}
+	bool has(shd::BuildPhase phase) const {
+		return std::find(phases.begin(), phases.end(), phase) != phases.end();
+	}
+
+	std::mutex lock;
+	std::vector<shd::BuildPhase> phases;
+	std::vector<shd::SegmentStats> segments;
+	std::vector<shd::BuildStatus> retries;
+	std::vector<unsigned> retried;
+	std::vector<shd::MemoryPlan> plans;
+	uint64_t output = 0;
+};
+
+TEST(SHD, BuildObserver) {
+	static constexpr uint64_t TOTAL = 40000;
+	const std::string filename = "observed.shd";
+	RecordingObserver observer;
+	shd::BuildOptions options;
+	options.segments = 4;
+	options.workers = 2;
+	options.observer = &observer;
+	{
+		shd::FileWriter output(filename.c_str());
+		shd::DataReaders input;
+		input.push_back(std::make_unique<EmbeddingGenerator>(0, TOTAL/2));
+		input.push_back(std::make_unique<EmbeddingGenerator>(TOTAL/2, TOTAL/2));
+		ASSERT_EQ(shd::BuildDict(input, output, options), shd::BUILD_STATUS_OK);
+	}
+	for (auto phase : {shd::PHASE_GEN_ID, shd::PHASE_PARTITION, shd::PHASE_BUILD, shd::PHASE_L1_SORT,
+					   shd::PHASE_MAPPING, shd::PHASE_FILL, shd::PHASE_DUMP}) {
+		ASSERT_TRUE(observer.has(phase)) << shd::PhaseName(phase);
+	}
+	ASSERT_FALSE(observer.has(shd::PHASE_SPILL));
+
+	//the last try of each segment succeeds
+	std::vector<const shd::SegmentStats*> last(4, nullptr);
+	for (auto& one : observer.segments) {
+		ASSERT_LT(one.segment, 4U);
+		last[one.segment] = &one;
+	}
+	uint64_t total = 0;
+	for (auto one : last) {
+		ASSERT_NE(one, nullptr);
+		ASSERT_EQ(one->status, shd::BUILD_STATUS_OK);
+		ASSERT_GT(one->max_bucket, 0U);
+		uint64_t buckets = 0;
+		for (auto cnt : one->sd8_tries) {
+			buckets += cnt;
+		}
+		ASSERT_GT(buckets, 0U);
+		ASSERT_LE(buckets, one->size);
+		total += one->size;
+	}
+	ASSERT_EQ(total, TOTAL);
+	ASSERT_GE(observer.segments.size(), 4U);
+
+	auto fp = fopen(filename.c_str(), "rb");
+	ASSERT_NE(fp, nullptr);
+	fseek(fp, 0, SEEK_END);
+	const auto size = ftell(fp);
+	fclose(fp);
+	ASSERT_EQ(observer.output, (uint64_t)size);
+	shd::PerfectHashtable dict(filename);
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.item(), TOTAL);
+}
+
+#ifdef SHD_TEST_HOOKS
+TEST(SHD, SaltedSegment) {
+	const std::string filename = "salted.shd";
+	auto check = [](const shd::PerfectHashtable& dict, uint64_t begin, uint64_t mask) {
+		EmbeddingGenerator checker(begin, PIECE, mask);
+		for (unsigned i = 0; i < PIECE; i++) {
+			auto rec = checker.read(false);
+			auto val = dict.search(rec.key.ptr);
+			if (val.ptr == nullptr || memcmp(val.ptr, rec.val.ptr, rec.val.len) != 0) {
+				return false;
+			}
+		}
+		return true;
+	};
+	for (bool spill : {false, true}) {
+		RecordingObserver observer;
+		shd::BuildOptions options;
+		options.segments = 4;
+		options.workers = 2;
+		options.observer = &observer;
+		if (spill) {
+			options.spill_dir = ".";
+		}
+		shd::g_fail_segment_once = 2;	//segment 2 is built again with a salt
+		{
+			shd::FileWriter output(filename.c_str());
+			auto input = CreateReaders<EmbeddingGenerator>(200, EmbeddingGenerator::MASK0);
+			ASSERT_EQ(shd::BuildDict(input, output, options), shd::BUILD_STATUS_OK);
+		}
+		ASSERT_EQ(shd::g_fail_segment_once.load(), UINT32_MAX);
+		ASSERT_EQ(observer.retries, std::vector<shd::BuildStatus>{shd::BUILD_STATUS_OUT_OF_CHANCE});
+		ASSERT_EQ(observer.retried, std::vector<unsigned>{2U});
+		bool salted = false;
+		for (auto& one : observer.segments) {
+			salted |= one.segment == 2 && one.salt != 0 && one.status == shd::BUILD_STATUS_OK;
+		}
+		ASSERT_TRUE(salted);
+
+		shd::PerfectHashtable dict(filename);
+		ASSERT_FALSE(!dict);
+		ASSERT_EQ(dict.item(), PIECE*200);
+		for (unsigned i = 0; i < 200; i++) {
+			ASSERT_TRUE(check(dict, i*PIECE, EmbeddingGenerator::MASK0));
+		}
+
+		const std::string derived = "salted-new.shd";
+		{
+			shd::FileWriter output(derived.c_str());
+			auto input = CreateReaders<EmbeddingGenerator>(1, EmbeddingGenerator::MASK1);
+			ASSERT_EQ(dict.derive(input, output), shd::BUILD_STATUS_OK);
+		}
+		shd::PerfectHashtable next(derived);
+		ASSERT_FALSE(!next);
+		ASSERT_EQ(next.item(), PIECE*200);
+		ASSERT_TRUE(check(next, 0, EmbeddingGenerator::MASK1));
+		for (unsigned i = 1; i < 200; i++) {
+			ASSERT_TRUE(check(next, i*PIECE, EmbeddingGenerator::MASK0));
+		}
+	}
+}
+#endif
+
 TEST(SHD, InlinedDict) {
 	const std::string filename = "dict.shd";
 	{
@@ -258,6 +529,8 @@ TEST(SHD, InlinedDict) {
 
 	ASSERT_EQ(dict.batch_search(keys.size(), in.data(), out.data()), PIECE);
 	ASSERT_EQ(dict.batch_fetch(keys.size(), (const uint8_t*)keys.data(), buf.get(), dft_val.get()), PIECE);
+	std::vector<shd::Slice> slices(keys.size());
+	ASSERT_EQ(dict.batch_search(keys.size(), in.data(), slices.data()), PIECE);
 
 	checker.reset();
 	auto line = buf.get();
@@ -266,6 +539,9 @@ TEST(SHD, InlinedDict) {
 		ASSERT_NE(out[i*2], nullptr);
 		ASSERT_EQ(memcmp(out[i*2], val.ptr, val.len), 0);
 		ASSERT_EQ(out[i*2+1], nullptr);
+		ASSERT_EQ(slices[i*2].ptr, out[i*2]);
+		ASSERT_EQ(slices[i*2].len, val.len);
+		ASSERT_FALSE(slices[i*2+1].valid());
 		ASSERT_EQ(memcmp(line, val.ptr, val.len), 0);
 		ASSERT_EQ(memcmp(line+EmbeddingGenerator::VALUE_SIZE, dft_val.get(), val.len), 0);
 		line += EmbeddingGenerator::VALUE_SIZE*2;
@@ -301,11 +577,746 @@ TEST(SHD, VariedDict) {
 		ASSERT_EQ(val.len, 0);
 	}
 
+	std::vector<uint64_t> keys(PIECE*3);
+	std::vector<const uint8_t*> in(keys.size());
+	for (unsigned i = 0; i < keys.size(); i++) {
+		keys[i] = i;
+		in[i] = (const uint8_t*)&keys[i];
+	}
+	std::vector<shd::Slice> out(keys.size());
+	ASSERT_EQ(dict.batch_search(keys.size(), in.data(), out.data()), PIECE*2);
+	checker.reset();
+	for (unsigned i = 0; i < PIECE*3; i++) {
+		auto rec = checker.read(false);
+		if (i < PIECE*2) {
+			ASSERT_TRUE(out[i].valid());
+			ASSERT_EQ(out[i].len, rec.val.len);
+			ASSERT_EQ(memcmp(out[i].ptr, rec.val.ptr, rec.val.len), 0);
+		} else {
+			ASSERT_FALSE(out[i].valid());
+		}
+	}
+
 	auto junk = std::make_unique<uint8_t[]>(256U);
 	ASSERT_EQ(dict.batch_search(1, (const uint8_t**)junk.get(), (const uint8_t**)junk.get()), 0);
 	ASSERT_EQ(dict.batch_fetch(1, junk.get(), junk.get()), 0);
 }
 
+TEST(SHD, VariedDictParallelFill) {
+	static constexpr unsigned READER_SIZE = 5000;
+	const std::string filename = "var-dict-parallel.shd";
+	{
+		shd::FileWriter output(filename.c_str());
+		shd::DataReaders input;
+		for (unsigned i = 0; i < 3; i++) {
+			input.push_back(std::make_unique<VariedValueGenerator>(i*READER_SIZE, READER_SIZE));
+		}
+		ASSERT_EQ(shd::BuildDictWithVariedValue(input, output), shd::BUILD_STATUS_OK);
+	}
+	shd::PerfectHashtable dict(filename);
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.item(), READER_SIZE*3);
+	VariedValueGenerator checker(0, READER_SIZE*3);
+	for (unsigned i = 0; i < READER_SIZE*3; i++) {
+		auto rec = checker.read(false);
+		auto val = dict.search(rec.key.ptr);
+		ASSERT_TRUE(val.valid());
+		ASSERT_EQ(val.len, rec.val.len);
+		ASSERT_EQ(memcmp(val.ptr, rec.val.ptr, rec.val.len), 0);
+	}
+}
+
+TEST(SHD, CompressedValue) {
+	FakeWriter fake_output;
+	{
+		auto input = CreateReaders<EmbeddingGenerator>(1, EmbeddingGenerator::MASK0);
+		ASSERT_EQ(shd::BuildDict(input, fake_output, shd::DEFAULT_RETRY, shd::LAYOUT_COMPRESS_VALUE),
+				  shd::BUILD_STATUS_BAD_INPUT);
+	}
+	std::string filename = "zip-dict.shd";
+	{
+		shd::FileWriter output(filename.c_str());
+		auto input = CreateReaders<BulkValueGenerator>(2, 64U);
+		ASSERT_EQ(shd::BuildDictWithVariedValue(input, output, shd::DEFAULT_RETRY, shd::LAYOUT_COMPRESS_VALUE),
+				  shd::BUILD_STATUS_OK);
+	}
+	{
+		shd::PerfectHashtable dict(filename);
+		ASSERT_FALSE(!dict);
+		ASSERT_EQ(dict.layout(), shd::LAYOUT_COMPRESS_VALUE);
+
+		BulkValueGenerator checker(0, PIECE*3);
+		for (unsigned i = 0; i < PIECE*3; i++) {
+			auto rec = checker.read(false);
+			auto val = dict.search(rec.key.ptr);
+			if (i < PIECE*2) {
+				ASSERT_TRUE(val.valid());
+				ASSERT_EQ(val.len, rec.val.len);
+				ASSERT_EQ(memcmp(val.ptr, rec.val.ptr, rec.val.len), 0);
+			} else {
+				ASSERT_FALSE(val.valid());
+			}
+		}
+
+		//slices of a batch stay valid together
+		std::vector<uint64_t> keys(PIECE*3);
+		std::vector<const uint8_t*> in(keys.size());
+		for (unsigned i = 0; i < keys.size(); i++) {
+			keys[i] = (i * 7U) % keys.size();
+			in[i] = (const uint8_t*)&keys[i];
+		}
+		std::vector<shd::Slice> out(keys.size());
+		ASSERT_EQ(dict.batch_search(keys.size(), in.data(), out.data()), PIECE*2);
+		shd::BatchExecutor executor(2, false);
+		std::vector<shd::Slice> out2(keys.size());
+		ASSERT_EQ(executor.batch_search(dict, keys.size(), in.data(), out2.data()), PIECE*2);
+		for (unsigned i = 0; i < keys.size(); i++) {
+			if (keys[i] >= PIECE*2) {
+				ASSERT_FALSE(out[i].valid());
+				continue;
+			}
+			BulkValueGenerator one(keys[i], 1);
+			auto rec = one.read(false);
+			ASSERT_TRUE(out[i].valid());
+			ASSERT_EQ(out[i].len, rec.val.len);
+			ASSERT_EQ(memcmp(out[i].ptr, rec.val.ptr, rec.val.len), 0);
+			ASSERT_EQ(out2[i].len, rec.val.len);
+			ASSERT_EQ(memcmp(out2[i].ptr, rec.val.ptr, rec.val.len), 0);
+		}
+
+		filename = "zip-dict-new.shd";
+		shd::FileWriter output(filename.c_str());
+		auto input = CreateReaders<VariedValueGenerator>(1, 5U);
+		ASSERT_EQ(dict.derive(input, output), shd::BUILD_STATUS_OK);
+	}
+	shd::PerfectHashtable dict(filename);
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.layout(), shd::LAYOUT_COMPRESS_VALUE);
+	ASSERT_EQ(dict.item(), PIECE*2);
+	VariedValueGenerator checker0(0, PIECE);
+	BulkValueGenerator checker1(PIECE, PIECE);
+	for (unsigned i = 0; i < PIECE*2; i++) {
+		auto rec = i < PIECE? checker0.read(false) : checker1.read(false);
+		auto val = dict.search(rec.key.ptr);
+		ASSERT_TRUE(val.valid());
+		ASSERT_EQ(val.len, rec.val.len);
+		ASSERT_EQ(memcmp(val.ptr, rec.val.ptr, rec.val.len), 0);
+	}
+}
+
+TEST(SHD, VarKey) {
+	FakeWriter fake_output;
+	{
+		auto input = CreateReaders<VarKeyGenerator>(1, 0);
+		ASSERT_EQ(shd::BuildDict(input, fake_output, shd::DEFAULT_RETRY, shd::LAYOUT_VAR_KEY | shd::LAYOUT_SPLIT_KV),
+				  shd::BUILD_STATUS_BAD_INPUT);
+		ASSERT_EQ(shd::BuildFingerprintSet(input, fake_output, 16, shd::DEFAULT_RETRY, shd::LAYOUT_VAR_KEY),
+				  shd::BUILD_STATUS_BAD_INPUT);
+	}
+	{
+		shd::FileWriter output("var-key-set.shd");
+		auto input = CreateReaders<VarKeyGenerator>(2, 0);
+		ASSERT_EQ(shd::BuildSet(input, output, shd::DEFAULT_RETRY, shd::LAYOUT_VAR_KEY), shd::BUILD_STATUS_OK);
+	}
+	{
+		shd::FileWriter output("var-key-dict.shd");
+		auto input = CreateReaders<VarKeyGenerator>(2, 0);
+		ASSERT_EQ(shd::BuildDict(input, output, shd::DEFAULT_RETRY, shd::LAYOUT_VAR_KEY | shd::LAYOUT_LOCAL_L2),
+				  shd::BUILD_STATUS_OK);
+	}
+	{
+		shd::FileWriter output("var-key-zip.shd");
+		auto input = CreateReaders<VarKeyGenerator>(2, 0);
+		ASSERT_EQ(shd::BuildDictWithVariedValue(input, output, shd::DEFAULT_RETRY,
+												shd::LAYOUT_VAR_KEY | shd::LAYOUT_COMPRESS_VALUE),
+				  shd::BUILD_STATUS_OK);
+	}
+
+	uint8_t key[VarKeyGenerator::MAX_KEY_SIZE+1];
+	std::vector<uint8_t> arena(PIECE*3*(VarKeyGenerator::MAX_KEY_SIZE+1));
+	std::vector<shd::Slice> keys(PIECE*3);
+	for (unsigned i = 0; i < keys.size(); i++) {
+		auto pt = arena.data() + i*(VarKeyGenerator::MAX_KEY_SIZE+1);
+		keys[i] = {pt, VarKeyGenerator::MakeKey((i * 7U) % keys.size(), pt)};
+	}
+	shd::BatchExecutor executor(2, false);
+	for (auto name : {"var-key-set.shd", "var-key-dict.shd", "var-key-zip.shd"}) {
+		shd::PerfectHashtable table(name);
+		ASSERT_FALSE(!table);
+		ASSERT_EQ(table.key_len(), 0);
+		ASSERT_TRUE(table.layout() & shd::LAYOUT_VAR_KEY);
+		ASSERT_LT(table.tune_pipeline(), shd::PerfectHashtable::PIPELINE_LEVELS);
+		const bool has_val = table.type() != shd::PerfectHashtable::KEY_SET;
+
+		for (uint64_t i = 0; i < PIECE*3; i++) {
+			const auto len = VarKeyGenerator::MakeKey(i, key);
+			auto val = table.search(key, len);
+			if (i >= PIECE*2) {
+				ASSERT_FALSE(val.valid());
+				continue;
+			}
+			ASSERT_TRUE(val.valid());
+			if (has_val) {
+				ASSERT_EQ(val.len, sizeof(uint64_t));
+				ASSERT_EQ(*(const uint64_t*)val.ptr, i);
+			}
+			//neither a longer nor a shorter one is the key
+			key[len] = '-';
+			ASSERT_FALSE(table.search(key, len+1).valid());
+			if (key[len-1] == '-') {
+				ASSERT_FALSE(table.search(key, len-1).valid());
+			}
+		}
+		ASSERT_FALSE(table.search(key).valid());
+		const uint8_t* ptrs[1] = {key};
+		const uint8_t* out_ptr[1];
+		ASSERT_EQ(table.batch_search(1, ptrs, out_ptr), 0);
+
+		std::vector<shd::Slice> out(keys.size());
+		ASSERT_EQ(table.batch_search(keys.size(), keys.data(), out.data()), PIECE*2);
+		std::vector<shd::Slice> out2(keys.size());
+		ASSERT_EQ(executor.batch_search(table, keys.size(), keys.data(), out2.data()), PIECE*2);
+		for (unsigned i = 0; i < keys.size(); i++) {
+			const uint64_t n = (i * 7U) % keys.size();
+			ASSERT_EQ(out[i].valid(), n < PIECE*2);
+			ASSERT_EQ(out2[i].valid(), n < PIECE*2);
+			if (has_val && out[i].valid()) {
+				ASSERT_EQ(*(const uint64_t*)out[i].ptr, n);
+				ASSERT_EQ(*(const uint64_t*)out2[i].ptr, n);
+			}
+		}
+	}
+
+	{
+		shd::PerfectHashtable dict("var-key-dict.shd");
+		ASSERT_FALSE(!dict);
+		uint64_t data = 0;
+		ASSERT_EQ(dict.batch_fetch(1, key, (uint8_t*)&data), 0);
+		ASSERT_FALSE(dict.build_hot_cache(1, key, 1));
+
+		shd::FileWriter output("var-key-dict-new.shd");
+		auto input = CreateReaders<VarKeyGenerator>(2, EmbeddingGenerator::MASK0);
+		input[0] = std::make_unique<VarKeyGenerator>(PIECE, PIECE*2, EmbeddingGenerator::MASK0);
+		input[1] = std::make_unique<VarKeyGenerator>(PIECE*3, 10, EmbeddingGenerator::MASK0);
+		ASSERT_EQ(dict.derive(input, output), shd::BUILD_STATUS_OK);
+	}
+	shd::PerfectHashtable dict("var-key-dict-new.shd");
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.item(), PIECE*3+10);
+	for (uint64_t i = 0; i < PIECE*3+10; i++) {
+		const auto len = VarKeyGenerator::MakeKey(i, key);
+		auto val = dict.search(key, len);
+		ASSERT_TRUE(val.valid());
+		ASSERT_EQ(*(const uint64_t*)val.ptr, i < PIECE? i : i ^ EmbeddingGenerator::MASK0);
+	}
+
+	//fixed length table takes key of its own length only
+	{
+		shd::FileWriter output("fixed-key-set.shd");
+		auto input = CreateReaders<EmbeddingGenerator>(1, EmbeddingGenerator::MASK0);
+		ASSERT_EQ(shd::BuildSet(input, output), shd::BUILD_STATUS_OK);
+	}
+	shd::PerfectHashtable set("fixed-key-set.shd");
+	ASSERT_FALSE(!set);
+	uint64_t fixed[2] = {7, 7};
+	ASSERT_TRUE(set.search((const uint8_t*)fixed, sizeof(uint64_t)).valid());
+	ASSERT_FALSE(set.search((const uint8_t*)fixed, sizeof(uint64_t)-1).valid());
+	shd::Slice fixed_keys[3] = {{(const uint8_t*)fixed, 8}, {(const uint8_t*)fixed, 7}, {(const uint8_t*)fixed, 16}};
+	shd::Slice fixed_out[3];
+	ASSERT_EQ(set.batch_search(3, fixed_keys, fixed_out), 1);
+	ASSERT_TRUE(fixed_out[0].valid());
+	ASSERT_FALSE(fixed_out[1].valid());
+	ASSERT_FALSE(fixed_out[2].valid());
+}
+
+TEST(SHD, SpillBuild) {
+	FakeWriter fake_output;
+	shd::BuildOptions options;
+	options.spill_dir = ".";
+	options.memory_budget = 64U*1024U;	//several segments
+	{
+		auto input = CreateReaders<EmbeddingGenerator>(1, EmbeddingGenerator::MASK0);
+		options.memory_budget = 0;	//spill without planning
+		options.layout = shd::LAYOUT_SPLIT_KV;
+		ASSERT_EQ(shd::BuildDict(input, fake_output, options), shd::BUILD_STATUS_BAD_INPUT);
+		options.layout = shd::LAYOUT_SPREAD;
+		options.spill_dir = "no-such-dir";
+		ASSERT_EQ(shd::BuildDict(input, fake_output, options), shd::BUILD_STATUS_FAIL_TO_OUTPUT);
+		options.spill_dir = ".";
+		options.memory_budget = 64U*1024U;
+	}
+	{
+		shd::FileWriter output("spill-index.shd");
+		auto input = CreateReaders<EmbeddingGenerator>(8, EmbeddingGenerator::MASK0);
+		ASSERT_EQ(shd::BuildIndex(input, output, options), shd::BUILD_STATUS_OK);
+	}
+	{
+		shd::PerfectHashtable index("spill-index.shd");
+		ASSERT_FALSE(!index);
+		ASSERT_EQ(index.item(), PIECE*8);
+		std::vector<bool> used(PIECE*8, false);
+		for (uint64_t i = 0; i < PIECE*8; i++) {
+			auto pos = index.locate((const uint8_t*)&i, sizeof(i));
+			ASSERT_LT(pos, PIECE*8);
+			ASSERT_FALSE(used[pos]);
+			used[pos] = true;
+		}
+	}
+	{
+		shd::FileWriter output("spill-dict.shd");
+		auto input = CreateReaders<EmbeddingGenerator>(8, EmbeddingGenerator::MASK0);
+		options.layout = shd::LAYOUT_LOCAL_L2;
+		ASSERT_EQ(shd::BuildDict(input, output, options), shd::BUILD_STATUS_OK);
+		options.layout = shd::LAYOUT_SPREAD;
+	}
+	{
+		shd::PerfectHashtable dict("spill-dict.shd");
+		ASSERT_FALSE(!dict);
+		ASSERT_EQ(dict.layout(), shd::LAYOUT_LOCAL_L2);
+		ASSERT_EQ(dict.item(), PIECE*8);
+		EmbeddingGenerator checker(0, PIECE*9);
+		for (unsigned i = 0; i < PIECE*9; i++) {
+			auto rec = checker.read(false);
+			auto val = dict.search(rec.key.ptr);
+			if (i >= PIECE*8) {
+				ASSERT_FALSE(val.valid());
+				continue;
+			}
+			ASSERT_TRUE(val.valid());
+			ASSERT_EQ(val.len, rec.val.len);
+			ASSERT_EQ(memcmp(val.ptr, rec.val.ptr, rec.val.len), 0);
+		}
+	}
+	{
+		shd::FileWriter output("spill-fingerprint.shd");
+		auto input = CreateReaders<EmbeddingGenerator>(8, EmbeddingGenerator::MASK0);
+		ASSERT_EQ(shd::BuildFingerprintSet(input, output, 16, options), shd::BUILD_STATUS_OK);
+	}
+	{
+		shd::PerfectHashtable set("spill-fingerprint.shd");
+		ASSERT_FALSE(!set);
+		ASSERT_EQ(set.fingerprint_bits(), 16);
+		for (uint64_t i = 0; i < PIECE*8; i++) {
+			ASSERT_TRUE(set.search((const uint8_t*)&i).valid());
+		}
+	}
+	{
+		shd::FileWriter output("spill-var-key.shd");
+		auto input = CreateReaders<VarKeyGenerator>(8, 5U);
+		options.layout = shd::LAYOUT_VAR_KEY | shd::LAYOUT_COMPRESS_VALUE;
+		ASSERT_EQ(shd::BuildDictWithVariedValue(input, output, options), shd::BUILD_STATUS_OK);
+	}
+	shd::PerfectHashtable dict("spill-var-key.shd");
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.layout(), shd::LAYOUT_VAR_KEY | shd::LAYOUT_COMPRESS_VALUE);
+	ASSERT_EQ(dict.item(), PIECE*8);
+	uint8_t key[VarKeyGenerator::MAX_KEY_SIZE+1];
+	for (uint64_t i = 0; i < PIECE*9; i++) {
+		const auto len = VarKeyGenerator::MakeKey(i, key);
+		auto val = dict.search(key, len);
+		if (i >= PIECE*8) {
+			ASSERT_FALSE(val.valid());
+			continue;
+		}
+		ASSERT_TRUE(val.valid());
+		ASSERT_EQ(val.len, sizeof(uint64_t));
+		ASSERT_EQ(*(const uint64_t*)val.ptr, i ^ 5U);
+	}
+
+	//too few records for the segments asked, they share one as in memory
+	options.layout = shd::LAYOUT_SPREAD;
+	options.segments = 200;
+	{
+		shd::FileWriter output("spill-index.shd");
+		auto input = CreateReaders<EmbeddingGenerator>(1, EmbeddingGenerator::MASK0);
+		ASSERT_EQ(shd::BuildIndex(input, output, options), shd::BUILD_STATUS_OK);
+	}
+	shd::PerfectHashtable index("spill-index.shd");
+	ASSERT_FALSE(!index);
+	ASSERT_EQ(index.item(), PIECE);
+	for (uint64_t i = 0; i < PIECE; i++) {
+		ASSERT_LT(index.locate((const uint8_t*)&i, sizeof(i)), PIECE);
+	}
+}
+
+//passes records through, but a stream can not go back
+class OncePassReader : public shd::IDataReader {
+public:
+	explicit OncePassReader(std::unique_ptr<shd::IDataReader>&& src) : m_src(std::move(src)) {}
+
+	void reset() override {
+		rewound |= read_cnt != 0;
+		m_src->reset();
+	}
+	size_t total() override {
+		return m_src->total();
+	}
+	shd::Record read(bool key_only) override {
+		read_cnt++;
+		return m_src->read(key_only);
+	}
+
+	size_t read_cnt = 0;
+	bool rewound = false;
+private:
+	std::unique_ptr<shd::IDataReader> m_src;
+};
+
+TEST(SHD, SinglePass) {
+	const std::string filename = "single-pass.shd";
+	shd::BuildOptions options;
+	options.single_pass = true;
+	auto wrap = [](shd::DataReaders&& src) {
+		shd::DataReaders out;
+		for (auto& one : src) {
+			out.push_back(std::make_unique<OncePassReader>(std::move(one)));
+		}
+		return out;
+	};
+	auto check = [](const shd::DataReaders& input) {
+		for (auto& one : input) {
+			auto reader = dynamic_cast<OncePassReader*>(one.get());
+			ASSERT_FALSE(reader->rewound);
+			ASSERT_EQ(reader->read_cnt, reader->total());
+		}
+	};
+	{
+		shd::FileWriter output(filename.c_str());
+		auto input = wrap(CreateReaders<EmbeddingGenerator>(2, EmbeddingGenerator::MASK0));
+		ASSERT_EQ(shd::BuildDict(input, output, options), shd::BUILD_STATUS_OK);
+		check(input);
+	}
+	{
+		shd::PerfectHashtable dict(filename);
+		ASSERT_FALSE(!dict);
+		ASSERT_EQ(dict.item(), PIECE*2);
+		EmbeddingGenerator checker(0, PIECE*2);
+		for (unsigned i = 0; i < PIECE*2; i++) {
+			auto rec = checker.read(false);
+			auto val = dict.search(rec.key.ptr);
+			ASSERT_NE(val.ptr, nullptr);
+			ASSERT_EQ(memcmp(val.ptr, rec.val.ptr, rec.val.len), 0);
+		}
+	}
+	{
+		//a stage in memory takes its part of the budget
+		FakeWriter fake_output;
+		auto input = wrap(CreateReaders<EmbeddingGenerator>(2, EmbeddingGenerator::MASK0));
+		options.memory_budget = 16U*1024U;
+		ASSERT_EQ(shd::BuildDict(input, fake_output, options), shd::BUILD_STATUS_OUT_OF_MEMORY);
+		options.memory_budget = 0;
+	}
+
+	options.spill_dir = ".";	//staged in files
+	{
+		shd::FileWriter output(filename.c_str());
+		auto input = wrap(CreateReaders<VariedValueGenerator>(2, 5U));
+		ASSERT_EQ(shd::BuildDictWithVariedValue(input, output, options), shd::BUILD_STATUS_OK);
+		check(input);
+	}
+	shd::PerfectHashtable dict(filename);
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.item(), PIECE*2);
+	VariedValueGenerator checker(0, PIECE*2);
+	for (unsigned i = 0; i < PIECE*2; i++) {
+		auto rec = checker.read(false);
+		auto val = dict.search(rec.key.ptr);
+		ASSERT_NE(val.ptr, nullptr);
+		ASSERT_EQ(val.len, rec.val.len);
+		ASSERT_EQ(memcmp(val.ptr, rec.val.ptr, rec.val.len), 0);
+	}
+
+	//a stage in files does not make the build spill, split layout still works
+	RecordingObserver observer;
+	options.observer = &observer;
+	options.layout = shd::LAYOUT_SPLIT_KV;
+	{
+		shd::FileWriter output(filename.c_str());
+		auto input = wrap(CreateReaders<EmbeddingGenerator>(2, EmbeddingGenerator::MASK0));
+		ASSERT_EQ(shd::BuildDict(input, output, options), shd::BUILD_STATUS_OK);
+		check(input);
+	}
+	ASSERT_EQ(observer.plans.size(), 1U);
+	ASSERT_NE(observer.plans[0].strategy, shd::STRATEGY_SPILL);
+	shd::PerfectHashtable split(filename);
+	ASSERT_FALSE(!split);
+	EmbeddingGenerator split_checker(0, PIECE*2);
+	for (unsigned i = 0; i < PIECE*2; i++) {
+		auto rec = split_checker.read(false);
+		auto val = split.search(rec.key.ptr);
+		ASSERT_NE(val.ptr, nullptr);
+		ASSERT_EQ(memcmp(val.ptr, rec.val.ptr, rec.val.len), 0);
+	}
+}
+
+TEST(SHD, FillWithKeptIDs) {
+	const std::string filename = "kept-ids.shd";
+	RecordingObserver observer;
+	shd::BuildOptions options;
+	options.memory_budget = SIZE_MAX;	//the planner keeps ids for the fill phase
+	options.segments = 4;
+	options.workers = 2;
+	options.observer = &observer;
+	auto build = [&filename, &observer](const std::function<shd::BuildStatus(const shd::DataReaders&, shd::IDataWriter&)>& fn,
+							 shd::DataReaders&& input) {
+		observer.plans.clear();
+		shd::FileWriter output(filename.c_str());
+		const auto status = fn(input, output);
+		if (observer.plans.size() != 1U || !observer.plans[0].keep_ids) {
+			return shd::BUILD_STATUS_BAD_INPUT;
+		}
+		return status;
+	};
+	auto all_found = [](const shd::PerfectHashtable& table, uint64_t total) {
+		for (uint64_t i = 0; i < total; i++) {
+			if (table.search((const uint8_t*)&i).ptr == nullptr) {
+				return false;
+			}
+		}
+		return true;
+	};
+	ASSERT_EQ(build([&options](const shd::DataReaders& in, shd::IDataWriter& out) {
+		return shd::BuildSet(in, out, options);
+	}, CreateReaders<EmbeddingGenerator>(3, EmbeddingGenerator::MASK0)), shd::BUILD_STATUS_OK);
+	{
+		shd::PerfectHashtable set(filename);
+		ASSERT_FALSE(!set);
+		ASSERT_TRUE(all_found(set, PIECE*3));
+	}
+	ASSERT_EQ(build([&options](const shd::DataReaders& in, shd::IDataWriter& out) {
+		return shd::BuildFingerprintSet(in, out, 16, options);
+	}, CreateReaders<EmbeddingGenerator>(3, EmbeddingGenerator::MASK0)), shd::BUILD_STATUS_OK);
+	{
+		shd::PerfectHashtable set(filename);
+		ASSERT_FALSE(!set);
+		ASSERT_TRUE(all_found(set, PIECE*3));
+	}
+	for (auto layout : {shd::LAYOUT_SPREAD, shd::LAYOUT_SPLIT_KV}) {
+		options.layout = layout;
+		ASSERT_EQ(build([&options](const shd::DataReaders& in, shd::IDataWriter& out) {
+			return shd::BuildDict(in, out, options);
+		}, CreateReaders<EmbeddingGenerator>(3, EmbeddingGenerator::MASK0)), shd::BUILD_STATUS_OK);
+		shd::PerfectHashtable dict(filename);
+		ASSERT_FALSE(!dict);
+		EmbeddingGenerator checker(0, PIECE*3);
+		for (unsigned i = 0; i < PIECE*3; i++) {
+			auto rec = checker.read(false);
+			auto val = dict.search(rec.key.ptr);
+			ASSERT_NE(val.ptr, nullptr);
+			ASSERT_EQ(memcmp(val.ptr, rec.val.ptr, rec.val.len), 0);
+		}
+	}
+	options.layout = shd::LAYOUT_SPREAD;
+	ASSERT_EQ(build([&options](const shd::DataReaders& in, shd::IDataWriter& out) {
+		return shd::BuildDictWithVariedValue(in, out, options);
+	}, CreateReaders<VariedValueGenerator>(3, 5U)), shd::BUILD_STATUS_OK);
+	shd::PerfectHashtable dict(filename);
+	ASSERT_FALSE(!dict);
+	VariedValueGenerator checker(0, PIECE*3);
+	for (unsigned i = 0; i < PIECE*3; i++) {
+		auto rec = checker.read(false);
+		auto val = dict.search(rec.key.ptr);
+		ASSERT_NE(val.ptr, nullptr);
+		ASSERT_EQ(val.len, rec.val.len);
+		ASSERT_EQ(memcmp(val.ptr, rec.val.ptr, rec.val.len), 0);
+	}
+}
+
+TEST(SHD, WideLineDict) {
+	constexpr uint64_t TOTAL = 150000;	//large enough to fill by position order
+	const std::string filename = "wide-dict.shd";
+	for (bool budget : {false, true}) {
+		RecordingObserver observer;
+		shd::BuildOptions options;
+		options.observer = &observer;
+		if (budget) {
+			options.memory_budget = SIZE_MAX;	//enough to stage a copy of content
+		}
+		{
+			shd::FileWriter output(filename.c_str());
+			shd::DataReaders input;
+			for (uint64_t i = 0; i < 3; i++) {
+				input.push_back(std::make_unique<WideValueGenerator>(i*TOTAL/3, TOTAL/3));
+			}
+			ASSERT_EQ(shd::BuildDict(input, output, options), shd::BUILD_STATUS_OK);
+		}
+		ASSERT_EQ(observer.plans.size(), 1U);
+		ASSERT_EQ(observer.plans[0].stage_fill, budget);	//never without a budget
+		shd::PerfectHashtable dict(filename);
+		ASSERT_FALSE(!dict);
+		ASSERT_EQ(dict.item(), TOTAL);
+		ASSERT_EQ(dict.val_len(), WideValueGenerator::VALUE_SIZE);
+		WideValueGenerator checker(0, TOTAL+PIECE);
+		for (uint64_t i = 0; i < TOTAL+PIECE; i++) {
+			auto rec = checker.read(false);
+			auto val = dict.search(rec.key.ptr);
+			if (i >= TOTAL) {
+				ASSERT_EQ(val.ptr, nullptr);
+				continue;
+			}
+			ASSERT_NE(val.ptr, nullptr);
+			ASSERT_EQ(memcmp(val.ptr, rec.val.ptr, rec.val.len), 0);
+		}
+	}
+}
+
+TEST(SHD, MemoryBudget) {
+	const std::string filename = "budget-dict.shd";
+	RecordingObserver observer;
+	shd::BuildOptions options;
+	options.observer = &observer;
+	options.memory_budget = SIZE_MAX;
+	auto build = [&options, &filename]() {
+		shd::FileWriter output(filename.c_str());
+		auto input = CreateReaders<EmbeddingGenerator>(3, EmbeddingGenerator::MASK0);
+		return shd::BuildDict(input, output, options);
+	};
+	//without a budget, content is filled in memory as before
+	options.memory_budget = 0;
+	ASSERT_EQ(build(), shd::BUILD_STATUS_OK);
+	ASSERT_EQ(observer.plans.size(), 1U);
+	ASSERT_FALSE(observer.plans[0].fill_in_place);
+	options.memory_budget = SIZE_MAX;
+
+	//each smaller budget falls back to a slower plan, till nothing fits
+	std::vector<shd::BuildStrategy> strategies;
+	for (;;) {
+		observer.plans.clear();
+		const auto status = build();
+		if (status == shd::BUILD_STATUS_OUT_OF_MEMORY) {
+			ASSERT_TRUE(observer.plans.empty());
+			break;
+		}
+		ASSERT_EQ(status, shd::BUILD_STATUS_OK);
+		ASSERT_EQ(observer.plans.size(), 1U);
+		const auto& plan = observer.plans[0];
+		ASSERT_LE(plan.peak, options.memory_budget);
+		ASSERT_TRUE(plan.fill_in_place);
+		if (strategies.empty()) {
+			ASSERT_EQ(plan.strategy, shd::STRATEGY_SHADOW);
+			ASSERT_TRUE(plan.keep_ids);
+		}
+		strategies.push_back(plan.strategy);
+
+		shd::PerfectHashtable dict(filename);
+		ASSERT_FALSE(!dict);
+		EmbeddingGenerator checker(0, PIECE*3);
+		for (unsigned i = 0; i < PIECE*3; i++) {
+			auto rec = checker.read(false);
+			auto val = dict.search(rec.key.ptr);
+			ASSERT_NE(val.ptr, nullptr);
+			ASSERT_EQ(memcmp(val.ptr, rec.val.ptr, rec.val.len), 0);
+		}
+		options.memory_budget = plan.peak - 1U;
+	}
+	ASSERT_GE(strategies.size(), 2U);
+	ASSERT_EQ(strategies.back(), shd::STRATEGY_IN_PLACE);
+
+	//spill is the last choice, taken only when nothing in memory fits
+	options.spill_dir = ".";
+	for (auto strategy : {shd::STRATEGY_SPILL, shd::STRATEGY_SHADOW}) {
+		options.memory_budget = strategy == shd::STRATEGY_SPILL? 256U*1024U : SIZE_MAX;
+		observer.plans.clear();
+		{
+			shd::FileWriter output(filename.c_str());
+			auto input = CreateReaders<EmbeddingGenerator>(100, EmbeddingGenerator::MASK0);
+			ASSERT_EQ(shd::BuildDict(input, output, options), shd::BUILD_STATUS_OK);
+		}
+		ASSERT_EQ(observer.plans.size(), 1U);
+		ASSERT_EQ(observer.plans[0].strategy, strategy);
+		shd::PerfectHashtable dict(filename);
+		ASSERT_FALSE(!dict);
+		ASSERT_EQ(dict.item(), PIECE*100);
+	}
+	options.spill_dir.clear();
+
+	options.memory_budget = 1024U;
+	FakeWriter fake_output;
+	auto input = CreateReaders<EmbeddingGenerator>(3, EmbeddingGenerator::MASK0);
+	ASSERT_EQ(shd::BuildDict(input, fake_output, options), shd::BUILD_STATUS_OUT_OF_MEMORY);
+	options.spill_dir = ".";
+	ASSERT_EQ(shd::BuildDict(input, fake_output, options), shd::BUILD_STATUS_OUT_OF_MEMORY);
+}
+
+static std::vector<uint8_t> LoadFile(const std::string& filename) {
+	std::vector<uint8_t> out;
+	auto fp = fopen(filename.c_str(), "rb");
+	if (fp == nullptr) {
+		return out;
+	}
+	uint8_t buf[4096];
+	for (size_t n; (n = fread(buf, 1, sizeof(buf), fp)) != 0; ) {
+		out.insert(out.end(), buf, buf+n);
+	}
+	fclose(fp);
+	return out;
+}
+
+TEST(SHD, SeededBuild) {
+	const std::string filename = "seeded.shd";
+	using BuildFunc = std::function<shd::BuildStatus(shd::IDataWriter&, const shd::BuildOptions&)>;
+	auto build = [&filename](const BuildFunc& fn, const shd::BuildOptions& options) {
+		{
+			shd::FileWriter output(filename.c_str());
+			if (fn(output, options) != shd::BUILD_STATUS_OK) {
+				return std::vector<uint8_t>();
+			}
+		}
+		return LoadFile(filename);
+	};
+	const BuildFunc funcs[] = {
+		[](shd::IDataWriter& out, const shd::BuildOptions& options) {
+			auto input = CreateReaders<EmbeddingGenerator>(4, EmbeddingGenerator::MASK0);
+			return shd::BuildDict(input, out, options);
+		},
+		[](shd::IDataWriter& out, const shd::BuildOptions& options) {
+			auto input = CreateReaders<VariedValueGenerator>(4, 5U);
+			return shd::BuildDictWithVariedValue(input, out, options);
+		},
+		[](shd::IDataWriter& out, const shd::BuildOptions& options) {
+			auto input = CreateReaders<VarKeyGenerator>(4, 0U);
+			auto opt = options;
+			opt.layout = shd::LAYOUT_VAR_KEY;
+			return shd::BuildSet(input, out, opt);
+		},
+		[](shd::IDataWriter& out, const shd::BuildOptions& options) {
+			auto input = CreateReaders<EmbeddingGenerator>(4, EmbeddingGenerator::MASK0);
+			return shd::BuildFingerprintSet(input, out, 16, options);
+		},
+	};
+	for (auto& fn : funcs) {
+		shd::BuildOptions options;
+		options.seeds = {1234U, 5678U};
+		options.segments = 4;
+		options.workers = 1;
+		const auto base = build(fn, options);
+		ASSERT_FALSE(base.empty());
+
+		//neither workers nor the way of shuffle changes output
+		options.workers = 4;
+		options.use_extra_mem = true;
+		ASSERT_EQ(build(fn, options), base);
+
+		options.seeds = {4321U};
+		const auto other = build(fn, options);
+		ASSERT_FALSE(other.empty());
+		ASSERT_NE(other, base);
+	}
+
+	//records are spilled by many workers in any order, output stays the same
+	for (auto& fn : funcs) {
+		shd::BuildOptions options;
+		options.seeds = {1234U};
+		options.spill_dir = ".";
+		options.segments = 4;
+		options.workers = 1;
+		const auto base = build(fn, options);
+		ASSERT_FALSE(base.empty());
+		options.workers = 4;
+		ASSERT_EQ(build(fn, options), base);
+	}
+}
+
 TEST(SHD, FetchWithPatch) {
 	const std::string base_filename = "base.shd";
 	const std::string patch_filename = "patch.shd";
@@ -357,6 +1368,374 @@ TEST(SHD, FetchWithPatch) {
 	}
 }
 
+TEST(SHD, FetchWithPatchStack) {
+	constexpr uint64_t MASK2 = 0x3333333333333333UL;
+	const std::string filenames[3] = {"stack-base.shd", "stack-patch1.shd", "stack-patch2.shd"};
+	const uint64_t masks[3] = {EmbeddingGenerator::MASK0, EmbeddingGenerator::MASK1, MASK2};
+	const unsigned ranges[3] = {3, 1, 2};
+	for (unsigned i = 0; i < 3; i++) {
+		shd::FileWriter output(filenames[i].c_str());
+		auto input = CreateReaders<EmbeddingGenerator>(ranges[i], masks[i]);
+		ASSERT_EQ(shd::BuildDict(input, output), shd::BUILD_STATUS_OK);
+	}
+	shd::PerfectHashtable base(filenames[0]);
+	shd::PerfectHashtable patch1(filenames[1]);
+	shd::PerfectHashtable patch2(filenames[2]);
+	ASSERT_FALSE(!base);
+	ASSERT_FALSE(!patch1);
+	ASSERT_FALSE(!patch2);
+	const shd::PerfectHashtable* patches[2] = {&patch1, &patch2};
+
+	std::vector<uint64_t> keys(PIECE*4);
+	std::vector<const uint8_t*> in(keys.size());
+	for (unsigned i = 0; i < keys.size(); i++) {
+		keys[i] = i;
+		in[i] = (const uint8_t*)&keys[i];
+	}
+	std::vector<const uint8_t*> out(keys.size());
+	ASSERT_EQ(base.batch_search(keys.size(), in.data(), out.data(), patches, 2), PIECE*3);
+
+	auto buf = std::make_unique<uint8_t[]>(keys.size()*EmbeddingGenerator::VALUE_SIZE);
+	std::vector<unsigned> miss(keys.size());
+	ASSERT_EQ(base.batch_try_fetch(keys.size(), (const uint8_t*)keys.data(), buf.get(), miss.data(), patches, 2),
+			  PIECE*3);
+	for (unsigned i = 0; i < PIECE; i++) {
+		ASSERT_EQ(miss[i], PIECE*3+i);
+	}
+
+	const uint64_t expected[3] = {EmbeddingGenerator::MASK1, MASK2, EmbeddingGenerator::MASK0};
+	for (unsigned i = 0; i < PIECE*3; i++) {
+		auto val = (const uint64_t*)(buf.get() + i*EmbeddingGenerator::VALUE_SIZE);
+		ASSERT_EQ(val[0], keys[i] ^ expected[i/PIECE]);
+		ASSERT_NE(out[i], nullptr);
+		ASSERT_EQ(memcmp(out[i], val, EmbeddingGenerator::VALUE_SIZE), 0);
+	}
+	for (unsigned i = PIECE*3; i < PIECE*4; i++) {
+		ASSERT_EQ(out[i], nullptr);
+	}
+
+	ASSERT_EQ(base.batch_fetch(keys.size(), (const uint8_t*)keys.data(), buf.get(), nullptr, patches, 0),
+			  PIECE*3);
+	auto val = (const uint64_t*)buf.get();
+	ASSERT_EQ(val[0], keys[0] ^ EmbeddingGenerator::MASK0);
+}
+
+TEST(SHD, PipelineLevel) {
+	const std::string filename = "dict.shd";
+	{
+		shd::FileWriter output(filename.c_str());
+		auto input = CreateReaders<EmbeddingGenerator>(2, EmbeddingGenerator::MASK0);
+		ASSERT_EQ(shd::BuildDict(input, output), shd::BUILD_STATUS_OK);
+	}
+	shd::PerfectHashtable dict(filename);
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.pipeline_level(), 0);	//small table
+	ASSERT_FALSE(dict.set_pipeline_level(shd::PerfectHashtable::PIPELINE_LEVELS));
+
+	EmbeddingGenerator checker(PIECE, PIECE*2);
+	std::vector<uint64_t> keys(PIECE*2);
+	for (unsigned i = 0; i < PIECE; i++) {
+		auto key = *(const uint64_t*)checker.read(false).key.ptr;
+		keys[i*2] = key;
+		keys[i*2+1] = ~key;
+	}
+	std::vector<uint64_t> pos(keys.size());
+	dict.batch_locate(keys.size(), (const uint8_t*)keys.data(), sizeof(uint64_t), pos.data());
+
+	auto buf_sz = keys.size()*EmbeddingGenerator::VALUE_SIZE;
+	auto buf = std::make_unique<uint8_t[]>(buf_sz);
+	std::vector<uint64_t> tmp(keys.size());
+	for (unsigned level = 0; level < shd::PerfectHashtable::PIPELINE_LEVELS; level++) {
+		ASSERT_TRUE(dict.set_pipeline_level(level));
+		ASSERT_EQ(dict.pipeline_level(), level);
+		dict.batch_locate(keys.size(), (const uint8_t*)keys.data(), sizeof(uint64_t), tmp.data());
+		ASSERT_EQ(tmp, pos);
+		memset(buf.get(), 0, buf_sz);
+		ASSERT_EQ(dict.batch_fetch(keys.size(), (const uint8_t*)keys.data(), buf.get()), PIECE);
+		checker.reset();
+		auto line = buf.get();
+		for (unsigned i = 0; i < PIECE; i++) {
+			auto val = checker.read(false).val;
+			ASSERT_EQ(memcmp(line, val.ptr, val.len), 0);
+			line += EmbeddingGenerator::VALUE_SIZE*2;
+		}
+	}
+
+	ASSERT_LT(dict.tune_pipeline(), shd::PerfectHashtable::PIPELINE_LEVELS);
+	ASSERT_EQ(dict.batch_fetch(keys.size(), (const uint8_t*)keys.data(), buf.get()), PIECE);
+}
+
+TEST(SHD, BatchExecutor) {
+	const std::string filename = "dict.shd";
+	{
+		shd::FileWriter output(filename.c_str());
+		auto input = CreateReaders<EmbeddingGenerator>(2, EmbeddingGenerator::MASK0);
+		ASSERT_EQ(shd::BuildDict(input, output), shd::BUILD_STATUS_OK);
+	}
+	shd::PerfectHashtable dict(filename);
+	ASSERT_FALSE(!dict);
+
+	constexpr unsigned N = 20000;
+	std::vector<uint64_t> keys(N);
+	for (unsigned i = 0; i < N; i++) {
+		keys[i] = (i * 7919U) % (PIECE*4);	//half miss
+	}
+	std::vector<const uint8_t*> in(N);
+	for (unsigned i = 0; i < N; i++) {
+		in[i] = (const uint8_t*)&keys[i];
+	}
+	const auto raw = (const uint8_t*)keys.data();
+	constexpr auto buf_sz = N*EmbeddingGenerator::VALUE_SIZE;
+
+	std::vector<const uint8_t*> out1(N), out2(N);
+	std::vector<shd::Slice> slices(N);
+	std::vector<uint64_t> pos1(N), pos2(N);
+	auto buf1 = std::make_unique<uint8_t[]>(buf_sz);
+	auto buf2 = std::make_unique<uint8_t[]>(buf_sz);
+	std::vector<unsigned> miss1(N), miss2(N);
+
+	const auto hit = dict.batch_search(N, in.data(), out1.data());
+	dict.batch_locate(N, raw, sizeof(uint64_t), pos1.data());
+	memset(buf1.get(), 0, buf_sz);
+	ASSERT_EQ(dict.batch_try_fetch(N, raw, buf1.get(), miss1.data()), hit);
+
+	shd::BatchExecutor exec(4);
+	ASSERT_EQ(exec.workers(), 4);
+	for (unsigned round = 0; round < 3; round++) {
+		ASSERT_EQ(exec.batch_search(dict, N, in.data(), out2.data()), hit);
+		ASSERT_EQ(out1, out2);
+		ASSERT_EQ(exec.batch_search(dict, N, in.data(), slices.data()), hit);
+		for (unsigned i = 0; i < N; i++) {
+			ASSERT_EQ(slices[i].ptr, out1[i]);
+		}
+		exec.batch_locate(dict, N, raw, sizeof(uint64_t), pos2.data());
+		ASSERT_EQ(pos1, pos2);
+		memset(buf2.get(), 0, buf_sz);
+		ASSERT_EQ(exec.batch_fetch(dict, N, raw, buf2.get()), hit);
+		ASSERT_EQ(memcmp(buf1.get(), buf2.get(), buf_sz), 0);
+		memset(buf2.get(), 0, buf_sz);
+		ASSERT_EQ(exec.batch_try_fetch(dict, N, raw, buf2.get(), miss2.data()), hit);
+		ASSERT_EQ(memcmp(buf1.get(), buf2.get(), buf_sz), 0);
+		ASSERT_EQ(memcmp(miss1.data(), miss2.data(), (N-hit)*sizeof(unsigned)), 0);
+	}
+	ASSERT_EQ(exec.batch_fetch(dict, 0, raw, buf2.get()), 0);
+
+	//variable length keys are not fetched by fixed size, misses stay untouched
+	const std::string var_filename = "var-key-dict.shd";
+	{
+		shd::FileWriter output(var_filename.c_str());
+		shd::BuildOptions options;
+		options.layout = shd::LAYOUT_VAR_KEY;
+		auto input = CreateReaders<VarKeyGenerator>(2, 0U);
+		ASSERT_EQ(shd::BuildDict(input, output, options), shd::BUILD_STATUS_OK);
+	}
+	shd::PerfectHashtable var_dict(var_filename);
+	ASSERT_FALSE(!var_dict);
+	std::fill(miss2.begin(), miss2.end(), UINT32_MAX);
+	ASSERT_EQ(exec.batch_try_fetch(var_dict, N, raw, buf2.get(), miss2.data()), 0);
+	ASSERT_EQ(exec.batch_try_fetch(dict, N, raw, buf2.get(), miss2.data(), &var_dict), 0);
+	for (auto one : miss2) {
+		ASSERT_EQ(one, UINT32_MAX);
+	}
+}
+
+TEST(SHD, HotCache) {
+	const std::string base_filename = "base.shd";
+	const std::string patch_filename = "patch.shd";
+	{
+		shd::FileWriter base_output(base_filename.c_str());
+		auto base_input = CreateReaders<EmbeddingGenerator>(2, EmbeddingGenerator::MASK1);
+		ASSERT_EQ(shd::BuildDict(base_input, base_output), shd::BUILD_STATUS_OK);
+		shd::FileWriter patch_output(patch_filename.c_str());
+		auto patch_input = CreateReaders<EmbeddingGenerator>(1, EmbeddingGenerator::MASK0);
+		ASSERT_EQ(shd::BuildDict(patch_input, patch_output), shd::BUILD_STATUS_OK);
+	}
+	shd::PerfectHashtable base(base_filename);
+	ASSERT_FALSE(!base);
+	shd::PerfectHashtable patch(patch_filename);
+	ASSERT_FALSE(!patch);
+
+	//skewed traffic, small keys are hot and some keys are missing
+	constexpr unsigned N = PIECE*8;
+	std::vector<uint64_t> keys(N);
+	for (unsigned i = 0; i < N; i++) {
+		keys[i] = (i % 3 != 0)? i % 50 : i % (PIECE*3);
+	}
+	const auto raw = (const uint8_t*)keys.data();
+	constexpr auto buf_sz = N*EmbeddingGenerator::VALUE_SIZE;
+	auto buf1 = std::make_unique<uint8_t[]>(buf_sz);
+	auto buf2 = std::make_unique<uint8_t[]>(buf_sz);
+	std::vector<unsigned> miss1(N), miss2(N);
+
+	const auto hit = base.batch_try_fetch(N, raw, buf1.get(), miss1.data());
+	const auto hit_patched = base.batch_fetch(N, raw, buf2.get(), nullptr, &patch);
+	ASSERT_LT(hit, N);
+
+	ASSERT_FALSE(base.build_hot_cache(N, raw, 0));
+	ASSERT_TRUE(base.build_hot_cache(N, raw, 64));
+	ASSERT_EQ(base.hot_cache_stats().lookup, 0);
+
+	memset(buf2.get(), 0, buf_sz);
+	ASSERT_EQ(base.batch_try_fetch(N, raw, buf2.get(), miss2.data()), hit);
+	ASSERT_EQ(memcmp(buf1.get(), buf2.get(), buf_sz), 0);
+	ASSERT_EQ(miss1, miss2);
+	auto stats = base.hot_cache_stats();
+	ASSERT_EQ(stats.lookup, N);
+	ASSERT_GE(stats.hit, N/2);
+
+	std::vector<const uint8_t*> in(N);
+	for (unsigned i = 0; i < N; i++) {
+		in[i] = (const uint8_t*)&keys[i];
+	}
+	std::vector<shd::Slice> out(N);
+	ASSERT_EQ(base.batch_search(N, in.data(), out.data()), hit);
+	for (unsigned i = 0; i < N; i++) {
+		auto val = base.search(in[i]);
+		ASSERT_EQ(out[i].len, val.len);
+		if (val.valid()) {
+			ASSERT_EQ(memcmp(out[i].ptr, val.ptr, val.len), 0);
+		}
+	}
+
+	//cached lines of base never shadow the patch
+	memset(buf1.get(), 0, buf_sz);
+	ASSERT_EQ(base.batch_fetch(N, raw, buf1.get(), nullptr, &patch), hit_patched);
+	patch.build_hot_cache(N, raw, 16);
+	ASSERT_EQ(base.batch_fetch(N, raw, buf2.get(), nullptr, &patch), hit_patched);
+	ASSERT_EQ(memcmp(buf1.get(), buf2.get(), buf_sz), 0);
+	ASSERT_GT(patch.hot_cache_stats().hit, 0);
+
+	base.drop_hot_cache();
+	ASSERT_EQ(base.hot_cache_stats().lookup, 0);
+	ASSERT_EQ(base.batch_try_fetch(N, raw, buf2.get(), miss2.data()), hit);
+	ASSERT_EQ(miss1, miss2);
+}
+
+TEST(SHD, LocalLayout) {
+	const std::string filename = "local.shd";
+	{
+		shd::FileWriter output(filename.c_str());
+		auto input = CreateReaders<EmbeddingGenerator>(2, EmbeddingGenerator::MASK0);
+		ASSERT_EQ(shd::BuildSet(input, output, shd::DEFAULT_RETRY, shd::LAYOUT_LOCAL_L2), shd::BUILD_STATUS_OK);
+	}
+	{
+		shd::PerfectHashtable set(filename);
+		ASSERT_FALSE(!set);
+		ASSERT_EQ(set.type(), shd::PerfectHashtable::KEY_SET);
+		ASSERT_EQ(set.layout(), shd::LAYOUT_LOCAL_L2);
+		union {
+			uint64_t v;
+			uint8_t p[8];
+		} tmp;
+		for (unsigned i = 0; i < PIECE*3; i++) {
+			tmp.v = i;
+			ASSERT_EQ(set.search(tmp.p).ptr != nullptr, i < PIECE*2);
+		}
+	}
+	{
+		shd::FileWriter output(filename.c_str());
+		auto input = CreateReaders<EmbeddingGenerator>(20, EmbeddingGenerator::MASK0);
+		ASSERT_EQ(shd::BuildDict(input, output, shd::DEFAULT_RETRY, shd::LAYOUT_LOCAL_L2), shd::BUILD_STATUS_OK);
+	}
+	std::string derived = "local-new.shd";
+	{
+		shd::PerfectHashtable dict(filename);
+		ASSERT_FALSE(!dict);
+		ASSERT_EQ(dict.layout(), shd::LAYOUT_LOCAL_L2);
+		ASSERT_EQ(dict.item(), PIECE*20);
+
+		std::vector<uint64_t> keys(PIECE*40);
+		for (unsigned i = 0; i < keys.size(); i++) {
+			keys[i] = i;
+		}
+		auto buf_sz = keys.size()*EmbeddingGenerator::VALUE_SIZE;
+		auto buf = std::make_unique<uint8_t[]>(buf_sz);
+		ASSERT_EQ(dict.batch_fetch(keys.size(), (const uint8_t*)keys.data(), buf.get()), PIECE*20);
+		EmbeddingGenerator checker(0, PIECE*20, EmbeddingGenerator::MASK0);
+		auto line = buf.get();
+		for (unsigned i = 0; i < PIECE*20; i++) {
+			auto val = checker.read(false).val;
+			ASSERT_EQ(memcmp(line, val.ptr, val.len), 0);
+			line += EmbeddingGenerator::VALUE_SIZE;
+		}
+
+		shd::FileWriter output(derived.c_str());
+		auto input = CreateReaders<EmbeddingGenerator>(1, EmbeddingGenerator::MASK1);
+		ASSERT_EQ(dict.derive(input, output), shd::BUILD_STATUS_OK);
+	}
+	shd::PerfectHashtable dict(derived);
+	ASSERT_FALSE(!dict);
+	ASSERT_EQ(dict.layout(), shd::LAYOUT_LOCAL_L2);
+	ASSERT_EQ(dict.item(), PIECE*20);
+}
+
+TEST(SHD, SplitLayout) {
+	FakeWriter fake_output;
+	{
+		auto input = CreateReaders<EmbeddingGenerator>(1, EmbeddingGenerator::MASK0);
+		ASSERT_EQ(shd::BuildSet(input, fake_output, shd::DEFAULT_RETRY, shd::LAYOUT_SPLIT_KV),
+				  shd::BUILD_STATUS_BAD_INPUT);
+	}
+	const shd::IndexLayout layouts[] = {shd::LAYOUT_SPLIT_KV, shd::LAYOUT_SPLIT_KV | shd::LAYOUT_LOCAL_L2};
+	for (auto layout : layouts) {
+		const std::string filename = "split.shd";
+		{
+			shd::FileWriter output(filename.c_str());
+			auto input = CreateReaders<EmbeddingGenerator>(2, EmbeddingGenerator::MASK0);
+			ASSERT_EQ(shd::BuildDict(input, output, shd::DEFAULT_RETRY, layout), shd::BUILD_STATUS_OK);
+		}
+		shd::PerfectHashtable dict(filename);
+		ASSERT_FALSE(!dict);
+		ASSERT_EQ(dict.type(), shd::PerfectHashtable::KV_INLINE);
+		ASSERT_EQ(dict.layout(), layout);
+
+		std::vector<uint64_t> keys(PIECE*2);
+		for (unsigned i = 0; i < PIECE; i++) {
+			keys[i*2] = i;
+			keys[i*2+1] = PIECE*2+i;
+		}
+		auto buf_sz = keys.size()*EmbeddingGenerator::VALUE_SIZE;
+		auto buf = std::make_unique<uint8_t[]>(buf_sz);
+		std::vector<unsigned> miss(keys.size());
+		ASSERT_EQ(dict.batch_try_fetch(keys.size(), (const uint8_t*)keys.data(), buf.get(), miss.data()), PIECE);
+		for (unsigned i = 0; i < PIECE; i++) {
+			ASSERT_EQ(miss[i], i*2+1);
+		}
+
+		EmbeddingGenerator checker(0, PIECE, EmbeddingGenerator::MASK0);
+		std::vector<const uint8_t*> in(keys.size());
+		for (unsigned i = 0; i < keys.size(); i++) {
+			in[i] = (const uint8_t*)&keys[i];
+		}
+		std::vector<const uint8_t*> out(keys.size());
+		ASSERT_EQ(dict.batch_search(keys.size(), in.data(), out.data()), PIECE);
+		for (unsigned i = 0; i < PIECE; i++) {
+			auto val = checker.read(false).val;
+			ASSERT_EQ(memcmp(buf.get() + i*2*val.len, val.ptr, val.len), 0);
+			ASSERT_EQ(memcmp(out[i*2], val.ptr, val.len), 0);
+			ASSERT_EQ(out[i*2+1], nullptr);
+			auto one = dict.search(in[i*2]);
+			ASSERT_EQ(one.ptr, out[i*2]);
+		}
+
+		ASSERT_TRUE(dict.build_hot_cache(PIECE, (const uint8_t*)keys.data(), 64));
+		memset(buf.get(), 0, buf_sz);
+		ASSERT_EQ(dict.batch_fetch(keys.size(), (const uint8_t*)keys.data(), buf.get()), PIECE);
+		checker.reset();
+		for (unsigned i = 0; i < PIECE; i++) {
+			auto val = checker.read(false).val;
+			ASSERT_EQ(memcmp(buf.get() + i*2*val.len, val.ptr, val.len), 0);
+		}
+		memset(buf.get(), 0, buf_sz);
+		ASSERT_EQ(dict.batch_fetch(keys.size(), (const uint8_t*)keys.data(), buf.get(), nullptr, &dict), PIECE);
+		checker.reset();
+		for (unsigned i = 0; i < PIECE; i++) {
+			auto val = checker.read(false).val;
+			ASSERT_EQ(memcmp(buf.get() + i*2*val.len, val.ptr, val.len), 0);
+		}
+	}
+}
+
 TEST(SHD, RebuildInlinedDict) {
 	std::string filename = "dict-old.shd";
 	{
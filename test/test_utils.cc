@@ -16,15 +16,19 @@
 // along with the This Library; if not, see <https://www.gnu.org/licenses/>.
 //==============================================================================
 
+#include <cstring>
 #include <limits>
 #include <random>
 #if defined(__linux__)
 #include <cstdio>
-#include <cstring>
 #include <sys/mman.h>
 #endif
+#include <string>
+#include <vector>
 #include <gtest/gtest.h>
 #include <utils.h>
+#include "../src/internal.h"
+#include "../src/hash.h"
 
 #if defined(__linux__)
 namespace shd {
@@ -85,6 +89,110 @@ TEST(Divisor, Uint8) {
 	TestDivisor<uint8_t>();
 }
 
+//kernels picked at runtime are checked one by one where the cpu supports them
+#if defined(SHD_SIMD_DISPATCH) && (defined(__GNUC__) || defined(__clang__))
+#define SHD_TEST_KERNELS 1
+#endif
+
+#if !defined(_WIN32)
+using BatchHashFunc = void (*)(const uint8_t* const msgs[], unsigned n, unsigned len, uint64_t seed, shd::V128 out[]);
+
+static void TestBatchHash(BatchHashFunc batch_hash) {
+	std::mt19937_64 rand;
+	std::vector<uint8_t> data(64*48);
+	for (auto& b : data) {
+		b = rand();
+	}
+	const uint8_t* msgs[40];
+	shd::V128 out[40];
+	for (unsigned len = 0; len <= 64; len++) {
+		for (unsigned n = 1; n <= 40; n += 3) {
+			for (unsigned i = 0; i < n; i++) {
+				msgs[i] = data.data() + i*len;
+			}
+			const uint64_t seed = rand();
+			batch_hash(msgs, n, len, seed, out);
+			for (unsigned i = 0; i < n; i++) {
+				auto code = shd::HashTo128(msgs[i], len, seed);
+				ASSERT_EQ(out[i].l, code.l) << "len=" << len << " n=" << n << " i=" << i;
+				ASSERT_EQ(out[i].h, code.h) << "len=" << len << " n=" << n << " i=" << i;
+			}
+		}
+	}
+}
+
+TEST(Hash, MultiLane) {
+	TestBatchHash(shd::HashTo128);
+#ifdef SHD_TEST_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		TestBatchHash(shd::HashTo128AVX2);
+	}
+	if (__builtin_cpu_supports("avx512f")) {
+		TestBatchHash(shd::HashTo128AVX512);
+	}
+#endif
+}
+#endif
+
+using BatchModFunc = void (*)(const uint64_t x[], unsigned n, const shd::LaneModulus& m, uint64_t out[]);
+
+static void TestBatchMod(BatchModFunc batch_mod) {
+	std::mt19937_64 rand;
+	uint64_t x[40];
+	uint64_t out[40];
+	for (uint64_t n : {3ULL, 5ULL, 0x1ffffULL, 0x12345677ULL, 0x1ffffffffULL, 0x7fffffffffffffffULL}) {
+		const shd::LaneModulus mod = {n, UINT64_MAX / n};
+		for (unsigned round = 0; round < 100; round++) {
+			for (unsigned i = 0; i < 40; i++) {
+				x[i] = rand();
+			}
+			x[0] = UINT64_MAX;
+			x[1] = UINT64_MAX - UINT64_MAX % n;	//remainder 0 near top
+			x[2] = n - 1;
+			const unsigned cnt = 1 + round % 40;
+			batch_mod(x, cnt, mod, out);
+			for (unsigned i = 0; i < cnt; i++) {
+				ASSERT_EQ(out[i], x[i] % n) << "n=" << n << " x=" << x[i];
+			}
+		}
+	}
+}
+
+TEST(Hash, BatchMod) {
+	TestBatchMod(shd::BatchMod);
+#ifdef SHD_TEST_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		TestBatchMod(shd::BatchModAVX2);
+	}
+	if (__builtin_cpu_supports("avx512f")) {
+		TestBatchMod(shd::BatchModAVX512);
+	}
+#endif
+}
+
+TEST(Hash, SegmentSalt) {
+	std::mt19937 rand;
+	for (unsigned i = 0; i < 10000; i++) {
+		shd::V96 id = {{(uint32_t)rand(), (uint32_t)rand(), (uint32_t)rand()}};
+		const uint32_t salt = rand() | 1U;
+		ASSERT_TRUE(shd::SaltID(id, 0) == id);
+		auto salted = shd::SaltID(id, salt);
+		ASSERT_EQ(shd::L0Hash(salted), shd::L0Hash(id));
+		ASSERT_EQ(shd::Fingerprint(salted), shd::Fingerprint(id));
+		ASSERT_EQ(shd::KeyTag(salted), shd::KeyTag(id));
+		ASSERT_TRUE(shd::SaltID(salted, salt) == id);
+	}
+	//salts lead to different cells
+	unsigned moved = 0;
+	for (unsigned i = 0; i < 1000; i++) {
+		shd::V96 id = {{(uint32_t)rand(), (uint32_t)rand(), (uint32_t)rand()}};
+		moved += shd::L1Hash(shd::SaltID(id, 0x12345679U)) != shd::L1Hash(shd::SaltID(id, 0x9abcdef1U));
+	}
+	ASSERT_GT(moved, 990U);
+}
+
 #if defined(__linux__)
 static bool ExpectedHugePageShift(unsigned& shift,
 								unsigned long long& kb) noexcept {
@@ -135,3 +243,44 @@ TEST(HugePage, StartupDetection) {
 		<< "Hugepagesize=" << kb << " kB";
 }
 #endif
+
+#if !defined(_WIN32)
+TEST(FileWriter, PositionalWrite) {
+	const char* path = "positional.bin";
+	{
+		shd::FileWriter out(path);
+		ASSERT_FALSE(!out);
+		ASSERT_TRUE(out.write("head", 4));
+		const auto offset = out.reserve(8);
+		ASSERT_EQ(offset, 4U);
+		ASSERT_TRUE(out.write("tail", 4));
+		ASSERT_TRUE(out.write_at(offset+4, "5678", 4));
+		ASSERT_TRUE(out.write_at(offset, "1234", 4));
+	}
+	auto data = shd::MemBlock::LoadFile(path);
+	ASSERT_FALSE(!data);
+	ASSERT_EQ(std::string((const char*)data.addr(), data.size()), "head12345678tail");
+}
+
+TEST(FileWriter, MappedWrite) {
+	const char* path = "mapped.bin";
+	{
+		shd::FileWriter out(path);
+		ASSERT_FALSE(!out);
+		ASSERT_TRUE(out.write("head", 4));
+		auto space = out.map(8);
+		ASSERT_NE(space, nullptr);
+		ASSERT_TRUE(out.write("tail", 4));
+		memcpy(space, "12345678", 8);
+	}
+	auto data = shd::MemBlock::LoadFile(path);
+	ASSERT_FALSE(!data);
+	ASSERT_EQ(std::string((const char*)data.addr(), data.size()), "head12345678tail");
+
+	shd::FileWriter device("/dev/null");	//written, but not mapped
+	ASSERT_FALSE(!device);
+	ASSERT_FALSE(device.can_map());
+	ASSERT_EQ(device.map(8), nullptr);
+	ASSERT_TRUE(device.write("tail", 4));
+}
+#endif